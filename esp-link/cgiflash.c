@@ -18,6 +18,9 @@ Some flash handling cgi routines. Used for reading the existing flash and updati
 #include <osapi.h>
 #include "cgi.h"
 #include "cgiflash.h"
+#ifdef PROPLOADER
+#include "roffs.h"
+#endif
 
 #ifdef CGIFLASH_DBG
 #define DBG(format, ...) do { os_printf(format, ## __VA_ARGS__); } while(0)
@@ -201,6 +204,21 @@ int ICACHE_FLASH_ATTR cgiWriteFlash(HttpdConnData *connData) {
   }
   address += offset;
 
+#ifdef PROPLOADER
+  // take the filesystem out of use before it is replaced and empty it so a partial image is never
+  // mistaken for the old one, this waits until no files are open (uploads, loads or cache builds)
+  if (address == FLASH_FILESYSTEM_BASE) {
+    if (roffs_unmount() != 0) {
+      DBG("Error: flash filesystem in use\n");
+      errorResponse(connData, 409, "Flash filesystem in use\r\n");
+      connData->cgiPrivData = (void *)1;
+      return HTTPD_CGI_DONE;
+    }
+    if (roffs_format(FLASH_FILESYSTEM_BASE) != 0)
+      DBG("Error: emptying flash filesystem\n");
+  }
+#endif
+
   // erase next flash block if necessary
   if (address % SPI_FLASH_SEC_SIZE == 0){
     DBG("Erasing 0x%05x\n", address);
@@ -215,6 +233,12 @@ int ICACHE_FLASH_ATTR cgiWriteFlash(HttpdConnData *connData) {
     DBG("Error: writing flash\n");
 
   if (connData->post->received == connData->post->len){
+#ifdef PROPLOADER
+    // remount so the file index matches a newly written filesystem image
+    // stored image hashes and cached download streams come with the image like any other file
+    if (address - offset == FLASH_FILESYSTEM_BASE && roffs_mount(FLASH_FILESYSTEM_BASE) != 0)
+      DBG("Error: mounting flash filesystem\n");
+#endif
     httpdStartResponse(connData, 200);
     httpdEndHeaders(connData);
     return HTTPD_CGI_DONE;
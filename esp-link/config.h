@@ -37,6 +37,7 @@ typedef struct {
   uint8_t  mdns_enable;
   char     mdns_servername[32];           
   int8_t   timezone_offset;
+  int32_t  loader_baud_rate;             // calibrated second-stage loader baud rate, 0 if not calibrated
 } FlashConfig;
 extern FlashConfig flashConfig;
 
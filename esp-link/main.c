@@ -62,6 +62,7 @@ HttpdBuiltInUrl builtInUrls[] = {
   { "/flash/reboot", cgiRebootFirmware, NULL },
   { "/flash/write", cgiWriteFlash, NULL },
   { "/flash/format", cgiRoffsFormat, NULL },
+  { "/flash/space", cgiRoffsSpace, NULL },
   { "/flash/write-file", cgiRoffsWriteFile, NULL },
   { "/pgm/sync", cgiOptibootSync, NULL },
   { "/pgm/upload", cgiOptibootData, NULL },
@@ -97,6 +98,10 @@ HttpdBuiltInUrl builtInUrls[] = {
   { "/propeller/load", cgiPropLoad, NULL },
   { "/propeller/load-file", cgiPropLoadFile, NULL },
   { "/propeller/reset", cgiPropReset, NULL },
+  { "/propeller/status", cgiPropStatus, NULL },
+  { "/propeller/stats", cgiPropStats, NULL },
+  { "/propeller/image-hash", cgiPropImageHash, NULL },
+  { "/propeller/loader-baud-rate", cgiPropLoaderBaudRate, NULL },
   { "/files/*", cgiRoffsHook, NULL }, //Catch-all cgi function for the flash filesystem
   { "*", cgiHTTPHandleRequest, NULL }, //Check to see if MCU can handle the request
   { "*", cgiSSCPHandleRequest, NULL }, //Check to see if MCU can handle the request
@@ -5,6 +5,8 @@
 extern "C" {
 #endif
 
+#include <stdio.h>
+
 /* for windows builds */
 #ifdef __MINGW32__
 #include <stdint.h>
@@ -47,12 +49,13 @@ int BindSocket(short port, SOCKET *pSocket);
 void CloseSocket(SOCKET sock);
 int SocketDataAvailableP(SOCKET sock, int timeout);
 int SendSocketData(SOCKET sock, void *buf, int len);
+int SendSocketDataGather(SOCKET sock, void *hdr, int hdrLen, void *buf, int len);
 int ReceiveSocketData(SOCKET sock, void *buf, int len);
 int ReceiveSocketDataAndAddress(SOCKET sock, void *buf, int len, SOCKADDR_IN *addr);
 int ReceiveSocketDataTimeout(SOCKET sock, void *buf, int len, int timeout);
 int SendSocketDataTo(SOCKET sock, void *buf, int len, SOCKADDR_IN *addr);
 int ReceiveSocketDataFrom(SOCKET sock, void *buf, int len, SOCKADDR_IN *addr);
-void SocketTerminal(SOCKET sock, int check_for_exit, int pst_mode);
+void SocketTerminal(SOCKET sock, int check_for_exit, int pst_mode, int raw_mode, FILE *log);
 
 #ifdef __cplusplus
 }
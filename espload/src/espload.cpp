@@ -3,16 +3,48 @@
 #include <stdint.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
+#include <algorithm>
+#include <list>
+#include <string>
+#include <vector>
 #include "fastproploader.h"
 #include "utils.h"
 #include "sock.h"
 
 #define DEF_DISCOVER_PORT   2000
+#define DISCOVER_ROUND_TIME 500     /* time to wait for replies to each discover request (ms) */
+#define MAX_DISCOVER_SIZE   1024    /* maximum size of a discover request or reply */
 #define DEF_RESET_PIN       12
+#define DEF_MAX_LOADS       8
 
 #define MAX_IF_ADDRS        10
 
-typedef int XbeeAddrList;
+/* a module that answered a discover request */
+typedef struct {
+    SOCKADDR_IN addr;
+    std::string reply;  /* JSON description of the module */
+} DiscoveredModule;
+
+typedef std::list<DiscoveredModule> ModuleList;
+
+/* the load of the image on one module */
+typedef struct {
+    std::string hostName;
+    std::string address;    /* resolved before the load threads start since name lookups aren't thread safe */
+    int result;
+} LoadJob;
+
+/* loads shared by the load threads */
+typedef struct {
+    std::vector<LoadJob> jobs;
+    size_t nextJob;
+    pthread_mutex_t lock;
+    const char *fileName;
+    LoadType loadType;
+    int skipIfCurrent;
+    int calibrate;      /* find the loader baud rate of each module before loading it */
+} LoadPool;
 
 int initialBaudRate = 115200;
 int finalBaudRate = 921600;
@@ -20,19 +52,32 @@ int terminalBaudRate = 115200;
 int resetPin = DEF_RESET_PIN;
 int verbose = 0;
 
-int discover(XbeeAddrList &addrs, int timeout);
-int discover1(IFADDR *ifaddr, XbeeAddrList &addrs, int timeout);
-int TerminalMode(const char *hostName, int pstMode);
+int discover(ModuleList &modules, int timeout);
+int sendDiscoverRequest(SOCKET sock, IFADDR *ifaddrs, int ifcnt, ModuleList &modules);
+void printInventory(ModuleList &modules);
+int loadAll(LoadPool &pool, int maxLoads);
+int benchmark(const char *hostName, const char *fileName, LoadType loadType, int count);
+uint32_t percentile(std::vector<uint32_t> &values, int percent);
+void *loadThread(void *data);
+int TerminalMode(const char *hostName, int pstMode, int rawMode, const char *logName);
 void Usage();
 
 int main(int argc, char *argv[])
 {
-    XbeeAddrList addrs;
+    ModuleList modules;
+    std::vector<std::string> hosts;
     char *infile = NULL;
-    char *ipaddr = NULL;
     LoadType loadType = ltDownloadAndRun;
+    int maxLoads = DEF_MAX_LOADS;
+    int loadDiscovered = 0;
+    int calibrate = 0;
+    int benchCount = 0;
     int terminalMode = 0;
+    int skipIfCurrent = 0;
+    int forceLoad = 0;
     int pstMode = 0;
+    int rawMode = 0;
+    char *logName = NULL;
     int ret, i;
 
     /* get the arguments */
@@ -41,14 +86,49 @@ int main(int argc, char *argv[])
         /* handle switches */
         if (argv[i][0] == '-') {
             switch(argv[i][1]) {
+            case '-':
+                if (strcmp(&argv[i][2], "bench") == 0 && ++i < argc && (benchCount = atoi(argv[i])) > 0)
+                    break;
+                Usage();
+                break;
+            case 'a':
+                loadDiscovered = 1;
+                break;
+            case 'b':
+                rawMode = 1;
+                break;
+            case 'c':
+                calibrate = 1;
+                break;
             case 'e':
                 loadType = ltDownloadAndProgramAndRun;
                 break;
+            case 'f':
+                forceLoad = 1;
+                break;
             case 'i':
                 if (argv[i][2])
-                    ipaddr = &argv[i][2];
+                    hosts.push_back(&argv[i][2]);
+                else if (++i < argc)
+                    hosts.push_back(argv[i]);
+                else
+                    Usage();
+                break;
+            case 'j':
+                if (argv[i][2])
+                    maxLoads = atoi(&argv[i][2]);
+                else if (++i < argc)
+                    maxLoads = atoi(argv[i]);
+                else
+                    Usage();
+                if (maxLoads < 1)
+                    Usage();
+                break;
+            case 'l':
+                if (argv[i][2])
+                    logName = &argv[i][2];
                 else if (++i < argc)
-                    ipaddr = argv[i];
+                    logName = argv[i];
                 else
                     Usage();
                 break;
@@ -60,6 +140,9 @@ int main(int argc, char *argv[])
                 else
                     Usage();
                 break;
+            case 's':
+                skipIfCurrent = 1;
+                break;
             case 't':
                 terminalMode = 1;
                 break;
@@ -82,26 +165,73 @@ int main(int argc, char *argv[])
         }
     }
     
-    if (infile) {
-        if (!ipaddr) {
-            printf("error: must specify IP address or host name with -i\n");
+    if (terminalMode && (loadDiscovered || hosts.size() != 1)) {
+        printf("error: terminal mode needs exactly one module given with -i\n");
+        return 1;
+    }
+    
+    /* add the modules that answer a discover request to the ones given with -i */
+    if (benchCount > 0) {
+        if (!infile || loadDiscovered || hosts.size() != 1) {
+            printf("error: --bench needs a file and exactly one module given with -i\n");
+            return 1;
+        }
+        return benchmark(hosts[0].c_str(), infile, loadType, benchCount) == 0 ? 0 : 1;
+    }
+    
+    if ((infile || calibrate) && loadDiscovered) {
+        if ((ret = discover(modules, 2000)) < 0) {
+            printf("error: discover failed: %d\n", ret);
             return 1;
         }
-        if (fastLoad(ipaddr, infile, loadType) < 0)
+        for (ModuleList::iterator module = modules.begin(); module != modules.end(); ++module)
+            hosts.push_back(AddressToString(&module->addr));
+    }
+    
+    if (infile || calibrate) {
+        LoadPool pool;
+        if (hosts.empty()) {
+            printf("error: must specify IP address or host name with -i or use -a\n");
+            return 1;
+        }
+        for (i = 0; i < (int)hosts.size(); ++i) {
+            SOCKADDR_IN addr;
+            if (GetInternetAddress(hosts[i].c_str(), 80, &addr) != 0) {
+                printf("error: invalid host name or IP address '%s'\n", hosts[i].c_str());
+                return 1;
+            }
+            LoadJob job = { hosts[i], AddressToString(&addr), -1 };
+            pool.jobs.push_back(job);
+        }
+        pool.fileName = infile;
+        pool.loadType = loadType;
+        pool.skipIfCurrent = skipIfCurrent && !forceLoad;
+        pool.calibrate = calibrate;
+        if (loadAll(pool, maxLoads) != 0)
             return 1;
     }
     
     else if (!terminalMode) {
-        if ((ret = discover(addrs, 2000)) < 0) {
+        if ((ret = discover(modules, 2000)) < 0) {
             printf("error: discover failed: %d\n", ret);
             return 1;
         }
+        printInventory(modules);
     }
     
     if (terminalMode) {
-        setBaudRate(ipaddr, terminalBaudRate);
-        printf("[ Entering terminal mode. Type ESC or Control-C to exit. ]\n");
-        TerminalMode(ipaddr, pstMode);
+        HttpSession session;
+        if (openSession(&session, hosts[0].c_str()) == 0) {
+            setBaudRate(&session, terminalBaudRate);
+            closeSession(&session);
+        }
+        /* keep binary output clean for capturing */
+        if (!rawMode) {
+            printf("[ Entering terminal mode. Type ESC or Control-C to exit. ]\n");
+            fflush(stdout);
+        }
+        if (TerminalMode(hosts[0].c_str(), pstMode, rawMode, logName) != 0)
+            return 1;
     }
     
     return 0;
@@ -111,74 +241,233 @@ void Usage()
 {
     printf("\
 usage: espload\n\
+         [ --bench <n> ]   load the file <n> times and report load timing\n\
+         [ -a ]            load all modules that answer a discover request\n\
+         [ -b ]            pass terminal data through untouched (binary mode)\n\
+         [ -c ]            find and store the fastest reliable loader baud rate of each module\n\
          [ -e ]            write program to the EEPROM\n\
-         [ -i <addr> ]     IP address or host name of module to load\n\
+         [ -f ]            force a load even if -s is given\n\
+         [ -i <addr> ]     IP address or host name of module to load (may be repeated)\n\
+         [ -j <n> ]        maximum number of modules to load at once (default is %d)\n\
+         [ -l <file> ]     copy terminal output to a log file with timestamps\n\
          [ -r <pin> ]      pin to use for resetting the Propeller (default is %d)\n\
+         [ -s ]            skip the load if the Propeller is already running the program\n\
          [ -t ]            enter terminal mode after loading\n\
          [ -v ]            display verbose debugging output\n\
-         [ <name> ]        file to load (discover modules if not given)\n", DEF_RESET_PIN);
+         [ <name> ]        file to load (discover modules if not given)\n", DEF_MAX_LOADS, DEF_RESET_PIN);
     exit(1);
 }
 
-int discover(XbeeAddrList &addrs, int timeout)
+/* load the image on every module using up to maxLoads threads and report the result for each */
+int loadAll(LoadPool &pool, int maxLoads)
 {
-    IFADDR ifaddrs[MAX_IF_ADDRS];
-    int cnt, i;
+    std::vector<pthread_t> threads;
+    int failed = 0;
+    size_t i;
+
+    pool.nextJob = 0;
+    pthread_mutex_init(&pool.lock, NULL);
+
+    /* a single load doesn't need a thread */
+    if (pool.jobs.size() == 1) {
+        loadThread(&pool);
+        pthread_mutex_destroy(&pool.lock);
+        return pool.jobs[0].result;
+    }
+
+    /* each thread loads modules until there are none left */
+    for (i = 0; i < pool.jobs.size() && (int)i < maxLoads; ++i) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, loadThread, &pool) != 0) {
+            printf("error: can't start load thread\n");
+            break;
+        }
+        threads.push_back(thread);
+    }
     
-    if ((cnt = GetInterfaceAddresses(ifaddrs, MAX_IF_ADDRS)) < 0)
-        return -1;
+    /* load in this thread if none could be started */
+    if (threads.empty())
+        loadThread(&pool);
     
-    for (i = 0; i < cnt; ++i) {
-        int ret;
-        if ((ret = discover1(&ifaddrs[i], addrs, timeout)) < 0)
-            return ret;
+    for (i = 0; i < threads.size(); ++i)
+        pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&pool.lock);
+
+    for (i = 0; i < pool.jobs.size(); ++i) {
+        printf("%s: %s\n", pool.jobs[i].hostName.c_str(), pool.jobs[i].result == 0 ? "OK" : "FAILED");
+        if (pool.jobs[i].result != 0)
+            ++failed;
     }
+    printf("%d of %d modules %s\n", (int)pool.jobs.size() - failed, (int)pool.jobs.size(), pool.fileName ? "loaded" : "calibrated");
+
+    return failed ? -1 : 0;
+}
+
+void *loadThread(void *data)
+{
+    LoadPool *pool = (LoadPool *)data;
     
-    return 0;
+    for (;;) {
+        LoadJob *job = NULL;
+
+        pthread_mutex_lock(&pool->lock);
+        if (pool->nextJob < pool->jobs.size())
+            job = &pool->jobs[pool->nextJob++];
+        pthread_mutex_unlock(&pool->lock);
+        
+        if (!job)
+            break;
+            
+        /* the output of concurrent loads is prefixed with the module it is about */
+        setMessageHost(pool->jobs.size() > 1 ? job->hostName.c_str() : NULL);
+
+        job->result = 0;
+        if (pool->calibrate && calibrateBaudRate(job->address.c_str()) < 0)
+            job->result = -1;
+        else if (pool->fileName && fastLoad(job->address.c_str(), pool->fileName, pool->loadType, pool->skipIfCurrent, NULL) < 0)
+            job->result = -1;
+    }
+    
+    return NULL;
 }
 
-int discover1(IFADDR *ifaddr, XbeeAddrList &addrs, int timeout)
+/* load an image repeatedly and report how long each phase of the load takes */
+int benchmark(const char *hostName, const char *fileName, LoadType loadType, int count)
 {
-    uint8_t txBuf[1024]; // BUG: get rid of this magic number!
-    uint8_t rxBuf[1024]; // BUG: get rid of this magic number!
-    SOCKADDR_IN bcastaddr;
+    static const char *phaseNames[lpMAX] = { "connect", "loader", "start", "packets", "verify", "eeprom", "launch" };
+    std::vector<uint32_t> phaseTimes[lpMAX], totalTimes, rates, packetTimes;
+    int retransmits = 0, failed = 0, run, phase, i;
+    LoadStats stats;
+
+    for (run = 1; run <= count; ++run) {
+        uint32_t total = 0;
+
+        if (fastLoad(hostName, fileName, loadType, 0, &stats) != 0) {
+            printf("run %d: failed\n", run);
+            ++failed;
+            continue;
+        }
+
+        printf("run %d:", run);
+        for (phase = 0; phase < lpMAX; ++phase) {
+            printf(" %s %.1f", phaseNames[phase], stats.phaseTime[phase] / 1000.0);
+            phaseTimes[phase].push_back(stats.phaseTime[phase]);
+            total += stats.phaseTime[phase];
+        }
+        totalTimes.push_back(total);
+
+        /* the payload rate is over the packet stream only */
+        if (stats.phaseTime[lpPackets] > 0)
+            rates.push_back((uint32_t)((double)stats.payloadBytes * 1000000.0 / stats.phaseTime[lpPackets]));
+        else
+            rates.push_back(0);
+        printf(" total %.1f ms, %u bytes/s, %d retransmits\n", total / 1000.0, rates.back(), stats.retransmits);
+
+        retransmits += stats.retransmits;
+        for (i = 0; i < stats.packetCount; ++i)
+            packetTimes.push_back(stats.packetTime[i]);
+    }
+
+    if (totalTimes.empty()) {
+        printf("error: all %d loads failed\n", count);
+        return -1;
+    }
+
+    printf("\n%d of %d loads succeeded\n", count - failed, count);
+    printf("%-8s %10s %10s %10s %10s\n", "phase", "min ms", "p50 ms", "p99 ms", "max ms");
+    for (phase = 0; phase <= lpMAX; ++phase) {
+        std::vector<uint32_t> &times = phase < lpMAX ? phaseTimes[phase] : totalTimes;
+        printf("%-8s %10.1f %10.1f %10.1f %10.1f\n", phase < lpMAX ? phaseNames[phase] : "total",
+               percentile(times, 0) / 1000.0, percentile(times, 50) / 1000.0,
+               percentile(times, 99) / 1000.0, percentile(times, 100) / 1000.0);
+    }
+    printf("payload: p50 %u bytes/s, min %u bytes/s\n", percentile(rates, 50), percentile(rates, 0));
+    printf("retransmits: %d\n", retransmits);
+    if (!packetTimes.empty())
+        printf("packet ack time: p50 %.1f ms, p99 %.1f ms over %d packets\n",
+               percentile(packetTimes, 50) / 1000.0, percentile(packetTimes, 99) / 1000.0, (int)packetTimes.size());
+
+    return failed ? -1 : 0;
+}
+
+/* nearest rank percentile (0 is the minimum and 100 the maximum) */
+uint32_t percentile(std::vector<uint32_t> &values, int percent)
+{
+    std::vector<uint32_t> sorted(values);
+    size_t rank;
+    
+    if (sorted.empty())
+        return 0;
+    std::sort(sorted.begin(), sorted.end());
+    rank = (sorted.size() * percent + 99) / 100;
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+/* discover modules on all interfaces at once
+   each round of requests lists the modules already heard from so they don't reply again and the
+   remaining modules have fewer replies to collide with, discovery ends after a round with no new
+   modules or when the timeout expires */
+int discover(ModuleList &modules, int timeout)
+{
+    IFADDR ifaddrs[MAX_IF_ADDRS];
+    uint8_t rxBuf[MAX_DISCOVER_SIZE];
+    uint32_t start, roundStart;
+    int ifcnt, newModules, remaining, cnt;
     SOCKADDR_IN addr;
     SOCKET sock;
-    int cnt;
     
-    /* create a broadcast socket */
-    if (OpenBroadcastSocket(DEF_DISCOVER_PORT, &sock) != 0) {
+    if ((ifcnt = GetInterfaceAddresses(ifaddrs, MAX_IF_ADDRS)) < 0)
+        return -1;
+    
+    /* replies come back to the port the request was sent from */
+    if (OpenBroadcastSocket(0, &sock) != 0) {
         printf("error: OpenBroadcastSocket failed\n");
         return -2;
     }
-        
-    /* build a broadcast address */
-    bcastaddr = ifaddr->bcast;
-    bcastaddr.sin_port = htons(DEF_DISCOVER_PORT);
-    
-    /* send the broadcast packet */
-    sprintf((char *)txBuf, "Me here! Ignore this message.\n");
-    if ((cnt = SendSocketDataTo(sock, txBuf, strlen((char *)txBuf), &bcastaddr)) != (int)strlen((char *)txBuf)) {
-        perror("error: SendSocketDataTo failed");
-        CloseSocket(sock);
-        return -1;
-    }
-
-    /* receive Xbee responses */
-    while (SocketDataAvailableP(sock, timeout)) {
-
-        /* get the next response */
-        memset(rxBuf, 0, sizeof(rxBuf));
-        if ((cnt = ReceiveSocketDataAndAddress(sock, rxBuf, sizeof(rxBuf) - 1, &addr)) < 0) {
-            printf("error: ReceiveSocketData failed\n");
+    
+    start = msTime();
+    do {
+        if (sendDiscoverRequest(sock, ifaddrs, ifcnt, modules) != 0) {
             CloseSocket(sock);
-            return -3;
+            return -1;
         }
-        rxBuf[cnt] = '\0';
         
-        if (!strstr((char *)rxBuf, "Me here!"))
-            printf("from %s got: %s", AddressToString(&addr), rxBuf);
-    }
+        /* collect the replies to this round */
+        newModules = 0;
+        roundStart = msTime();
+        for (;;) {
+            remaining = DISCOVER_ROUND_TIME - (int)(msTime() - roundStart);
+            if (remaining > timeout - (int)(msTime() - start))
+                remaining = timeout - (int)(msTime() - start);
+            if (remaining <= 0 || !SocketDataAvailableP(sock, remaining))
+                break;
+                
+            if ((cnt = ReceiveSocketDataAndAddress(sock, rxBuf, sizeof(rxBuf) - 1, &addr)) < 0) {
+                printf("error: ReceiveSocketData failed\n");
+                CloseSocket(sock);
+                return -3;
+            }
+            rxBuf[cnt] = '\0';
+            
+            /* ignore anything that isn't a module description */
+            if (rxBuf[0] != '{')
+                continue;
+                
+            ModuleList::iterator i;
+            for (i = modules.begin(); i != modules.end(); ++i)
+                if (i->addr.sin_addr.s_addr == addr.sin_addr.s_addr)
+                    break;
+            if (i == modules.end()) {
+                DiscoveredModule module;
+                module.addr = addr;
+                module.reply = (char *)rxBuf;
+                modules.push_back(module);
+                ++newModules;
+                if (verbose)
+                    printf("from %s got: %s", AddressToString(&addr), rxBuf);
+            }
+        }
+    } while (newModules > 0 && (int)(msTime() - start) < timeout);
     
     /* close the socket */
     CloseSocket(sock);
@@ -187,9 +476,56 @@ int discover1(IFADDR *ifaddr, XbeeAddrList &addrs, int timeout)
     return 0;
 }
 
-int TerminalMode(const char *hostName, int pstMode)
+/* broadcast a discover request on every interface
+   the request is a zero long followed by the addresses of the modules that shouldn't reply */
+int sendDiscoverRequest(SOCKET sock, IFADDR *ifaddrs, int ifcnt, ModuleList &modules)
+{
+    uint8_t txBuf[MAX_DISCOVER_SIZE];
+    SOCKADDR_IN bcastaddr;
+    int txCnt, i;
+    
+    memset(txBuf, 0, sizeof(uint32_t));
+    txCnt = sizeof(uint32_t);
+    for (ModuleList::iterator module = modules.begin(); module != modules.end(); ++module) {
+        if (txCnt + (int)sizeof(uint32_t) > (int)sizeof(txBuf))
+            break;
+        memcpy(&txBuf[txCnt], &module->addr.sin_addr.s_addr, sizeof(uint32_t));
+        txCnt += sizeof(uint32_t);
+    }
+    
+    for (i = 0; i < ifcnt; ++i) {
+        bcastaddr = ifaddrs[i].bcast;
+        bcastaddr.sin_port = htons(DEF_DISCOVER_PORT);
+        if (SendSocketDataTo(sock, txBuf, txCnt, &bcastaddr) != txCnt) {
+            perror("error: SendSocketDataTo failed");
+            return -1;
+        }
+    }
+    
+    return 0;
+}
+
+/* print the discovered modules as a JSON array with the address added to each module description */
+void printInventory(ModuleList &modules)
+{
+    ModuleList::iterator module;
+    
+    printf("[");
+    for (module = modules.begin(); module != modules.end(); ++module) {
+        std::string fields = module->reply.substr(1);
+        size_t end = fields.find_last_not_of(" \t\r\n}");
+        size_t begin = fields.find_first_not_of(" \t\r\n");
+        fields = end == std::string::npos || begin > end ? "" : fields.substr(begin, end - begin + 1);
+        printf("%s\n  { \"address\": \"%s\"%s%s }", module == modules.begin() ? "" : ",",
+               AddressToString(&module->addr), fields.empty() ? "" : ", ", fields.c_str());
+    }
+    printf("%s]\n", modules.empty() ? "" : "\n");
+}
+
+int TerminalMode(const char *hostName, int pstMode, int rawMode, const char *logName)
 {
     SOCKADDR_IN addr;
+    FILE *log = NULL;
     SOCKET sock;
     
     if (GetInternetAddress(hostName, 23, &addr) != 0) {
@@ -197,14 +533,23 @@ int TerminalMode(const char *hostName, int pstMode)
         return -1;
     }
     
+    if (logName && !(log = fopen(logName, rawMode ? "wb" : "w"))) {
+        printf("error: can't create '%s'\n", logName);
+        return -1;
+    }
+    
     if (ConnectSocket(&addr, &sock) != 0) {
         printf("error: connect failed\n");
+        if (log)
+            fclose(log);
         return -1;
     }
     
-    SocketTerminal(sock, 0, pstMode);
+    SocketTerminal(sock, 0, pstMode, rawMode, log);
     
     CloseSocket(sock);
+    if (log)
+        fclose(log);
     
     return 0;
 }
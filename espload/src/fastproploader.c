@@ -11,6 +11,22 @@
 #define MAX_RX_SENSE_ERROR  23          /* Maximum number of cycles by which the detection of a start bit could be off (as affected by the Loader code) */
 #define MAX_PACKET_SIZE     1024        /* size of data buffer in the second-stage loader */
 
+/* Image packets are acked as soon as the loader has received them so a lost packet or ack is detected by timing
+   out well before the loader's failsafe timeout expires. The timeout is the time needed to send the packet over
+   the serial link plus a margin over the measured network round trip time. Packets travel over TCP so a late ack
+   is almost always TCP recovering from a loss rather than a lost packet. A retransmission sent while TCP is still
+   delivering the original arrives right behind it and the loader takes the two as one packet, so the timeout never
+   drops below the time TCP takes to retransmit. */
+#define INITIAL_ROUND_TRIP  100         /* round trip time assumed until one has been measured (ms) */
+#define MIN_ACK_TIMEOUT     500         /* minimum time to wait for an image packet ack (ms) */
+#define MAX_ACK_TIMEOUT     ((int)(FAILSAFE_TIMEOUT * 1000) / 2)    /* leave time for a retry before the loader gives up (ms) */
+
+/* Baud rate calibration loads a few packets of test data at each rate in turn and verifies them with
+   the RAM checksum. Retransmissions are left out of it since they mostly come from network delays. A rate
+   that fails is tried again before the search stops and the highest rate that passed is stored on the module. */
+#define PROBE_PACKETS       4           /* number of test packets sent at each rate */
+#define PROBE_ATTEMPTS      2           /* number of times a rate is tried before it is judged to fail */
+
 // Offset (in bytes) from end of Loader Image pointing to where most host-initialized values exist.
 // Host-Initialized values are: Initial Bit Time, Final Bit Time, 1.5x Bit Time, Failsafe timeout,
 // End of Packet timeout, and ExpectedID.  In addition, the image checksum at word 5 needs to be
@@ -30,30 +46,80 @@ static uint8_t initCallFrame[] = {0xFF, 0xFF, 0xF9, 0xFF, 0xFF, 0xFF, 0xF9, 0xFF
 
 double ClockSpeed = 80000000.0;
 
-static void generateInitialLoaderImage(PropellerImage *image, int packetID, int initialBaudRate, int finalBaudRate);
-static int transmitPacket(SOCKET sock, int id, uint8_t *payload, int payloadSize, int *pResult, int timeout);
+/* rates tried by calibrateBaudRate */
+static int probeBaudRates[] = { 230400, 460800, 921600, 1500000, 2000000, 3000000 };
+
+/* packet timing for one load */
+typedef struct {
+    int baudRate;       /* second-stage loader baud rate */
+    int roundTripTime;  /* smoothed ack round trip time of image packets less their serial time (ms) */
+    int retransmits;    /* number of image packets that had to be sent again */
+    LoadStats *stats;   /* where to record load measurements or NULL */
+    uint32_t phaseStart;
+} PacketTiming;
+
+static void endPhase(PacketTiming *timing, LoadPhase phase);
+static int startLoader(HttpSession *session, int packetID, PacketTiming *timing, SOCKET *pSock);
+static int transmitImage(SOCKET sock, int32_t *pPacketID, uint8_t *image, int imageSize, PacketTiming *timing);
+static int probeBaudRate(HttpSession *session, int baudRate);
+static void generateInitialLoaderImage(PropellerImage *image, uint8_t *imageData, int packetID, int initialBaudRate, int finalBaudRate);
+static int transmitPacket(SOCKET sock, int id, uint8_t *payload, int payloadSize, int *pResult, int timeout, PacketTiming *timing);
+static int ackTimeout(int packetSize, PacketTiming *timing);
+static int receiveResponse(SOCKET sock, uint8_t *response, int timeout);
 static int32_t getLong(const uint8_t *buf);
 static void setLong(uint8_t *buf, uint32_t value);
 
-int fastLoad(const char *hostName, const char *fileName, LoadType loadType)
+int fastLoad(const char *hostName, const char *fileName, LoadType loadType, int skipIfCurrent, LoadStats *stats)
 {
-    PropellerImage loaderImage;
+    PropellerImage programImage;
     int32_t packetID, checksum;
-    uint8_t response[8];
-    int imageSize, result, cnt, i;
-    SOCKADDR_IN addr;
+    uint32_t hash, currentHash;
+    int fileSize, imageSize, result, i;
+    PacketTiming timing;
+    HttpSession session;
     uint8_t *image;
     SOCKET sock;
 
-    if ((image = readEntireFile(fileName, &imageSize)) == NULL)
+    /* packets are sent straight from the mapped file */
+    if ((image = mapFile(fileName, &fileSize)) == NULL)
+        return -1;
+    imageSize = fileSize;
+
+    if (stats)
+        memset(stats, 0, sizeof(*stats));
+    timing.stats = stats;
+    timing.phaseStart = usTime();
+
+    /* all of the control requests for this load share one session with the module */
+    if (openSession(&session, hostName) != 0) {
+        unmapFile(image, fileSize);
         return -1;
+    }
+
+    /* skip the load if the module says the Propeller is already running this image */
+    hash = imageHash(image, imageSize);
+    if (skipIfCurrent && getImageHash(&session, &currentHash) == 1 && currentHash == hash) {
+        message("Image is current, not loading\n");
+        closeSession(&session);
+        unmapFile(image, fileSize);
+        return 0;
+    }
+
+    /* use the baud rate found by calibrateBaudRate if the module has one */
+    if (getLoaderBaudRate(&session, &timing.baudRate) != 1 || timing.baudRate <= 0)
+        timing.baudRate = finalBaudRate;
+    if (verbose)
+        message("Loader baud rate %d\n", timing.baudRate);
+
+    /* only the program region of a Spin image needs to be sent */
+    pimageSetImage(&programImage, image, imageSize);
+    imageSize = pimageLoadSize(&programImage);
+    if (verbose)
+        message("Loading %d of %d bytes\n", imageSize, programImage.imageSize);
 
     /* compute the packet ID (number of packets to be sent) */
     packetID = (imageSize + MAX_PACKET_SIZE - 1) / MAX_PACKET_SIZE;
 
-    /* generate a loader packet */
-    generateInitialLoaderImage(&loaderImage, packetID, initialBaudRate, finalBaudRate);
-
     /* compute the image checksum */
     checksum = 0;
     for (i = 0; i < imageSize; ++i)
@@ -61,49 +127,231 @@ int fastLoad(const char *hostName, const char *fileName, LoadType loadType)
     for (i = 0; i < (int)sizeof(initCallFrame); ++i)
         checksum += initCallFrame[i];
 
-    if (GetInternetAddress(hostName, 23, &addr) != 0) {
-        printf("error: invalid host name or IP address '%s'\n", hostName);
+    /* start the second-stage loader */
+    if (startLoader(&session, packetID, &timing, &sock) != 0)
+        goto fail;
+
+    /* transmit the image */
+    if (transmitImage(sock, &packetID, image, imageSize, &timing) != 0)
+        goto failSocket;
+    endPhase(&timing, lpPackets);
+    if (stats) {
+        stats->payloadBytes = imageSize;
+        stats->retransmits = timing.retransmits;
+    }
+
+    /* transmit the RAM verify packet and verify the checksum */
+    if (transmitPacket(sock, packetID, verifyRAM, sizeof(verifyRAM), &result, 2000, NULL) != 0) {
+        message("error: transmitPacket failed\n");
+        goto failSocket;
+    }
+    if (result != -checksum) {
+        message("error: bad checksum\n");
+        goto failSocket;
+    }
+    packetID = -checksum;
+    endPhase(&timing, lpVerify);
+
+    /* program the eeprom if requested */
+    if (loadType & ltDownloadAndProgram) {
+        if (transmitPacket(sock, packetID, programVerifyEEPROM, sizeof(programVerifyEEPROM), &result, 8000, NULL) != 0) {
+            message("error: transmitPacket failed\n");
+            goto failSocket;
+        }
+        if (result != -checksum*2) {
+            message("error: bad checksum\n");
+            goto failSocket;
+        }
+        packetID = -checksum*2;
+        endPhase(&timing, lpEEPROM);
+    }
+
+    /* transmit the readyToLaunch packet */
+    if (transmitPacket(sock, packetID, readyToLaunch, sizeof(readyToLaunch), &result, 2000, NULL) != 0) {
+        message("error: transmitPacket failed\n");
+        goto failSocket;
+    }
+    if (result != packetID - 1) {
+        message("error: readyToLaunch failed\n");
+        goto failSocket;
+    }
+    --packetID;
+
+    /* transmit the launchNow packet which actually starts the downloaded program */
+    if (transmitPacket(sock, packetID, launchNow, sizeof(launchNow), NULL, 2000, NULL) != 0) {
+        message("error: transmitPacket failed\n");
+        goto failSocket;
+    }
+    endPhase(&timing, lpLaunch);
+
+    CloseSocket(sock);
+    unmapFile(image, fileSize);
+
+    /* remember what was loaded so the next load can be skipped if it's the same image */
+    setImageHash(&session, hash);
+    closeSession(&session);
+
+    return 0;
+
+failSocket:
+    CloseSocket(sock);
+fail:
+    closeSession(&session);
+    unmapFile(image, fileSize);
+    return -1;
+}
+
+/* find the highest second-stage loader baud rate that works reliably with a module and store it there */
+int calibrateBaudRate(const char *hostName)
+{
+    HttpSession session;
+    int best = 0, attempt, i;
+
+    if (openSession(&session, hostName) != 0)
         return -1;
+
+    /* stop at the first rate that fails since higher rates are not going to do any better */
+    for (i = 0; i < (int)(sizeof(probeBaudRates) / sizeof(probeBaudRates[0])); ++i) {
+        for (attempt = 0; attempt < PROBE_ATTEMPTS; ++attempt)
+            if (probeBaudRate(&session, probeBaudRates[i]) == 0)
+                break;
+        if (attempt == PROBE_ATTEMPTS)
+            break;
+        best = probeBaudRates[i];
     }
+
+    if (best == 0) {
+        message("error: no loader baud rate works\n");
+        closeSession(&session);
+        return -1;
+    }
+
+    if (setLoaderBaudRate(&session, best) != 0) {
+        closeSession(&session);
+        return -1;
+    }
+    message("loader baud rate %d\n", best);
+    closeSession(&session);
+
+    return best;
+}
+
+/* load test data at the given rate and check that it arrives intact */
+static int probeBaudRate(HttpSession *session, int baudRate)
+{
+    uint8_t data[PROBE_PACKETS * MAX_PACKET_SIZE];
+    int32_t packetID = PROBE_PACKETS, checksum;
+    PacketTiming timing;
+    int result, ok, i;
+    SOCKET sock;
+
+    /* pseudo-random data exercises more bit patterns than a fixed fill would */
+    checksum = 0;
+    for (i = 0; i < (int)sizeof(data); ++i)
+        checksum += (data[i] = (uint8_t)rand());
+    for (i = 0; i < (int)sizeof(initCallFrame); ++i)
+        checksum += initCallFrame[i];
+
+    timing.baudRate = baudRate;
+    timing.stats = NULL;
+    if (startLoader(session, packetID, &timing, &sock) != 0)
+        return -1;
+
+    /* the loader is left waiting for more packets and is reset by the next load */
+    ok = transmitImage(sock, &packetID, data, sizeof(data), &timing) == 0
+      && transmitPacket(sock, packetID, verifyRAM, sizeof(verifyRAM), &result, 2000, NULL) == 0
+      && result == -checksum;
+    CloseSocket(sock);
+
+    if (verbose)
+        message("Baud rate %d %s (%d retransmits)\n", baudRate, ok ? "works" : "fails", timing.retransmits);
+
+    return ok ? 0 : -1;
+}
+
+/* add the time since the end of the last phase to the given phase */
+static void endPhase(PacketTiming *timing, LoadPhase phase)
+{
+    uint32_t now = usTime();
+    if (timing->stats)
+        timing->stats->phaseTime[phase] += now - timing->phaseStart;
+    timing->phaseStart = now;
+}
+
+/* load the second-stage loader through the ROM loader and switch to the loader baud rate */
+static int startLoader(HttpSession *session, int packetID, PacketTiming *timing, SOCKET *pSock)
+{
+    uint8_t loaderData[sizeof(rawLoaderImage)];
+    PropellerImage loaderImage;
+    uint8_t response[8];
+    SOCKADDR_IN addr;
+    int result, cnt;
+
+    /* generate a loader packet */
+    generateInitialLoaderImage(&loaderImage, loaderData, packetID, initialBaudRate, timing->baudRate);
+
+    /* the second-stage loader talks to us through the serial bridge port */
+    addr = session->addr;
+    addr.sin_port = htons(23);
     
-    if (ConnectSocket(&addr, &sock) != 0) {
-        printf("error: connect failed\n");
+    if (ConnectSocket(&addr, pSock) != 0) {
+        message("error: connect failed\n");
         return -1;
     }
+    endPhase(timing, lpConnect);
     
     /* load the second-stage loader using the propeller ROM protocol */
-    if (slowLoad(hostName, &loaderImage, ltDownloadAndRun, 0/*sizeof(response)*/) != 0)
+    if (slowLoad(session, &loaderImage, ltDownloadAndRun, 0/*sizeof(response)*/) != 0) {
+        CloseSocket(*pSock);
         return -1;
+    }
+    endPhase(timing, lpLoader);
 
     /* wait for the second-stage loader to start */
-    cnt = ReceiveSocketDataTimeout(sock, response, sizeof(response), 2000);
+    cnt = ReceiveSocketDataTimeout(*pSock, response, sizeof(response), 2000);
     if (cnt != 8) {
-        printf("error: second-stage loader failed to start - cnt %d\n", cnt);
+        message("error: second-stage loader failed to start - cnt %d\n", cnt);
+        CloseSocket(*pSock);
         return -1;
     }
     result = getLong(&response[0]);
     if (result != packetID) {
-        printf("error: second-stage loader failed to start - packetID %d, result %d\n", packetID, result);
+        message("error: second-stage loader failed to start - packetID %d, result %d\n", packetID, result);
+        CloseSocket(*pSock);
         return -1;
     }
     
-    /* switch to the final baud rate */
-    if (setBaudRate(hostName, finalBaudRate) != 0)
+    /* switch to the loader baud rate */
+    if (setBaudRate(session, timing->baudRate) != 0) {
+        CloseSocket(*pSock);
         return -1;
+    }
 
-    /* transmit the image */
-    uint8_t *p = image;
+    timing->roundTripTime = INITIAL_ROUND_TRIP;
+    timing->retransmits = 0;
+    endPhase(timing, lpStart);
+
+    return 0;
+}
+
+/* transmit the image in packets counting the packet ID down to the ID of the next packet */
+static int transmitImage(SOCKET sock, int32_t *pPacketID, uint8_t *image, int imageSize, PacketTiming *timing)
+{
+    int32_t packetID = *pPacketID;
     int remaining = imageSize;
+    uint8_t *p = image;
+    int result;
+
     while (remaining > 0) {
         int size;
         if ((size = remaining) > MAX_PACKET_SIZE)
             size = MAX_PACKET_SIZE;
-        if (transmitPacket(sock, packetID, p, size, &result, 2000) != 0) {
-            printf("error: transmitPacket failed\n");
+        if (transmitPacket(sock, packetID, p, size, &result, 0, timing) != 0) {
+            message("error: transmitPacket failed\n");
             return -1;
         }
         if (result != packetID - 1) {
-            printf("error: unexpected result: expected %d, received %d\n", packetID - 1, result);
+            message("error: unexpected result: expected %d, received %d\n", packetID - 1, result);
             return -1;
         }
         remaining -= size;
@@ -111,60 +359,21 @@ int fastLoad(const char *hostName, const char *fileName, LoadType loadType)
         --packetID;
     }
 
-    /* transmit the RAM verify packet and verify the checksum */
-    if (transmitPacket(sock, packetID, verifyRAM, sizeof(verifyRAM), &result, 2000) != 0) {
-        printf("error: transmitPacket failed\n");
-        return -1;
-    }
-    if (result != -checksum) {
-        printf("error: bad checksum\n");
-        return -1;
-    }
-    packetID = -checksum;
-
-    /* program the eeprom if requested */
-    if (loadType & ltDownloadAndProgram) {
-        if (transmitPacket(sock, packetID, programVerifyEEPROM, sizeof(programVerifyEEPROM), &result, 8000) != 0) {
-            printf("error: transmitPacket failed\n");
-            return -1;
-        }
-        if (result != -checksum*2) {
-            printf("error: bad checksum\n");
-            return -1;
-        }
-        packetID = -checksum*2;
-    }
-
-    /* transmit the readyToLaunch packet */
-    if (transmitPacket(sock, packetID, readyToLaunch, sizeof(readyToLaunch), &result, 2000) != 0) {
-        printf("error: transmitPacket failed\n");
-        return -1;
-    }
-    if (result != packetID - 1) {
-        printf("error: readyToLaunch failed\n");
-        return -1;
-    }
-    --packetID;
-
-    /* transmit the launchNow packet which actually starts the downloaded program */
-    if (transmitPacket(sock, packetID, launchNow, sizeof(launchNow), NULL, 2000) != 0) {
-        printf("error: transmitPacket failed\n");
-        return -1;
-    }
-
-    CloseSocket(sock);
+    *pPacketID = packetID;
 
     return 0;
 }
 
 #define SPACE_FOR_HEADER    1024
 
-static void generateInitialLoaderImage(PropellerImage *image, int packetID, int initialBaudRate, int finalBaudRate)
+// imageData is where the image is built and must be large enough to hold the loader
+static void generateInitialLoaderImage(PropellerImage *image, uint8_t *imageData, int packetID, int initialBaudRate, int finalBaudRate)
 {
     int initAreaOffset = sizeof(rawLoaderImage) + RAW_LOADER_INIT_OFFSET_FROM_END;
     
-    // Make an image from the loader template
-    pimageSetImage(image, rawLoaderImage, sizeof(rawLoaderImage));
+    // Make an image from a copy of the loader template since loads to different modules can run at once
+    memcpy(imageData, rawLoaderImage, sizeof(rawLoaderImage));
+    pimageSetImage(image, imageData, sizeof(rawLoaderImage));
  
     // Clock mode
     //pimageSetLong(image, initAreaOffset +  0, 0);
@@ -204,18 +413,17 @@ static void generateInitialLoaderImage(PropellerImage *image, int packetID, int
     pimageUpdateChecksum(image);
 }
 
-static int transmitPacket(SOCKET sock, int id, uint8_t *payload, int payloadSize, int *pResult, int timeout)
+// image packets pass their packet timing to use an adaptive timeout in place of a fixed one
+static int transmitPacket(SOCKET sock, int id, uint8_t *payload, int payloadSize, int *pResult, int timeout, PacketTiming *timing)
 {
     int packetSize = 2*sizeof(uint32_t) + payloadSize;
-    uint8_t *packet, response[8];
-    int retries, result, cnt;
+    uint8_t header[2*sizeof(uint32_t)], response[8];
+    int retries, result, remaining;
+    uint32_t sent, sentTime;
     int32_t tag;
 
-    /* build the packet to transmit */
-    if (!(packet = (uint8_t *)malloc(packetSize)))
-        return -1;
-    setLong(&packet[0], id);
-    memcpy(&packet[8], payload, payloadSize);
+    /* the header is sent in front of the payload without copying them into one packet */
+    setLong(&header[0], id);
 
     /* send the packet */
     retries = 3;
@@ -223,35 +431,78 @@ static int transmitPacket(SOCKET sock, int id, uint8_t *payload, int payloadSize
 
         /* setup the packet header */
         tag = (int32_t)rand();
-        setLong(&packet[4], tag);
-        if (SendSocketData(sock, packet, packetSize) != packetSize)
+        setLong(&header[4], tag);
+        if (timing)
+            timeout = ackTimeout(packetSize, timing);
+        sent = msTime();
+        sentTime = usTime();
+        if (SendSocketDataGather(sock, header, sizeof(header), payload, payloadSize) != packetSize)
             return -1;
 
-        /* receive the response */
-        if (pResult) {
-            cnt = ReceiveSocketDataTimeout(sock, response, sizeof(response), timeout);
-            result = getLong(&response[0]);
-            if (cnt == 8 && getLong(&response[4]) == tag && result != id) {
-                free(packet);
-                *pResult = result;
-                return 0;
+        /* don't wait for a result */
+        if (!pResult)
+            return 0;
+
+        /* receive the response skipping late acks of earlier transmissions */
+        while ((remaining = timeout - (int)(msTime() - sent)) > 0 && receiveResponse(sock, response, remaining) == 0) {
+            if (getLong(&response[4]) != tag)
+                continue;
+            if ((result = getLong(&response[0])) == id)
+                break;
+
+            /* only time packets that were acked on their first transmission */
+            if (timing && retries == 2) {
+                int sample = (int)(msTime() - sent) - (packetSize * 10 * 1000) / timing->baudRate;
+                if (sample < 0)
+                    sample = 0;
+                timing->roundTripTime = (timing->roundTripTime * 7 + sample + 7) / 8;
             }
-        }
 
-        /* don't wait for a result */
-        else {
-            free(packet);
+            if (timing && timing->stats && timing->stats->packetCount < MAX_STATS_PACKETS)
+                timing->stats->packetTime[timing->stats->packetCount++] = usTime() - sentTime;
+
+            *pResult = result;
             return 0;
         }
-    }
 
-    /* free the packet */
-    free(packet);
+        if (timing)
+            ++timing->retransmits;
+        if (verbose)
+            message("Retransmitting packet %d\n", id);
+    }
 
     /* return timeout */
     return -1;
 }
 
+// time to wait for the ack of an image packet
+static int ackTimeout(int packetSize, PacketTiming *timing)
+{
+    int timeout = (packetSize * 10 * 1000 + timing->baudRate - 1) / timing->baudRate + 4 * timing->roundTripTime;
+    if (timeout < MIN_ACK_TIMEOUT)
+        timeout = MIN_ACK_TIMEOUT;
+    else if (timeout > MAX_ACK_TIMEOUT)
+        timeout = MAX_ACK_TIMEOUT;
+    return timeout;
+}
+
+// receive an 8 byte response which may arrive in more than one piece
+static int receiveResponse(SOCKET sock, uint8_t *response, int timeout)
+{
+    uint32_t start = msTime();
+    int count = 0, remaining, cnt;
+
+    while (count < 8) {
+        if ((remaining = timeout - (int)(msTime() - start)) <= 0)
+            return -1;
+        if ((cnt = ReceiveSocketDataTimeout(sock, &response[count], 8 - count, remaining)) <= 0)
+            return -1;
+        count += cnt;
+    }
+
+    return 0;
+}
+
 static int32_t getLong(const uint8_t *buf)
 {
      return (buf[3] << 24) | (buf[2] << 16) | (buf[1] << 8) | buf[0];
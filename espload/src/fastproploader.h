@@ -5,6 +5,8 @@
 extern "C" {
 #endif
 
+#include <stdint.h>
+
 typedef enum {
     ltShutdown = 0,
     ltDownloadAndRun = (1 << 0),
@@ -12,7 +14,31 @@ typedef enum {
     ltDownloadAndProgramAndRun = ltDownloadAndRun | ltDownloadAndProgram
 } LoadType;
 
-int fastLoad(const char *hostName, const char *fileName, LoadType loadType);
+/* phases of a load timed by LoadStats */
+typedef enum {
+    lpConnect,      /* module queries and connecting to the serial bridge */
+    lpLoader,       /* loading the second-stage loader through the ROM loader */
+    lpStart,        /* waiting for the second-stage loader and switching baud rate */
+    lpPackets,      /* sending the image packets */
+    lpVerify,       /* verifying the RAM checksum */
+    lpEEPROM,       /* programming and verifying the EEPROM */
+    lpLaunch,       /* launching the program */
+    lpMAX
+} LoadPhase;
+
+#define MAX_STATS_PACKETS   64
+
+/* measurements of one load */
+typedef struct {
+    uint32_t phaseTime[lpMAX];              /* time spent in each phase (us) */
+    int payloadBytes;                       /* image bytes sent in packets */
+    int retransmits;                        /* number of image packets that had to be sent again */
+    int packetCount;                        /* number of image packets acked */
+    uint32_t packetTime[MAX_STATS_PACKETS]; /* time from the last transmission of each image packet to its ack (us) */
+} LoadStats;
+
+int fastLoad(const char *hostName, const char *fileName, LoadType loadType, int skipIfCurrent, LoadStats *stats);
+int calibrateBaudRate(const char *hostName);
 
 #ifdef __cplusplus
 }
@@ -29,6 +29,9 @@ void pimageSetClkFreq(PropellerImage *image, uint32_t clkFreq);
 uint8_t pimageClkMode(PropellerImage *image);
 void pimageSetClkMode(PropellerImage *image, uint8_t clkMode);
 uint8_t pimageUpdateChecksum(PropellerImage *image);
+int pimageProgramSize(PropellerImage *image);
+int pimageIsPadding(PropellerImage *image, int offset, const uint8_t *buf, int size);
+int pimageLoadSize(PropellerImage *image);
 uint8_t pimageGetByte(PropellerImage *image, int offset);
 void pimageSetByte(PropellerImage *image, int offset, uint8_t value);
 uint16_t pimageGetWord(PropellerImage *image, int offset);
@@ -3,14 +3,20 @@
 #include <string.h>
 #include <ctype.h>
 
+#include <errno.h>
+#include <sys/time.h>
+
 #ifdef __MINGW32__
 #include <ws2tcpip.h>
 #include <iphlpapi.h>
 #include <conio.h>
+#include <io.h>
+#include <fcntl.h>
 #else
 #include <arpa/inet.h>
 #include <ifaddrs.h>
 #include <termios.h>
+#include <sys/uio.h>
 #endif
 
 #include "sock.h"
@@ -122,7 +128,6 @@ int ConnectSocket(SOCKADDR_IN *addr, SOCKET *pSocket)
 
     /* connect to the server */
     if (connect(sock, (SOCKADDR *)addr, sizeof(*addr)) != 0) {
-    printf("connect failed\n");
         closesocket(sock);
         return -1;
     }
@@ -218,6 +223,60 @@ int SendSocketData(SOCKET sock, void *buf, int len)
     return send(sock, buf, len, 0);
 }
 
+/* SendSocketDataGather - send a header and data with one call without copying them together */
+int SendSocketDataGather(SOCKET sock, void *hdr, int hdrLen, void *buf, int len)
+{
+#ifdef __MINGW32__
+    WSABUF bufs[2];
+    DWORD sent;
+    
+    bufs[0].buf = (char *)hdr;
+    bufs[0].len = hdrLen;
+    bufs[1].buf = (char *)buf;
+    bufs[1].len = len;
+    
+    if (WSASend(sock, bufs, 2, &sent, 0, NULL, NULL) != 0)
+        return -1;
+        
+    return (int)sent;
+#else
+    struct iovec iov[2];
+    struct msghdr msg;
+    int total = 0;
+    ssize_t cnt;
+    
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = hdrLen;
+    iov[1].iov_base = buf;
+    iov[1].iov_len = len;
+    
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    
+    /* keep going after a partial send starting with the first byte that wasn't sent */
+    while (total < hdrLen + len) {
+        if ((cnt = sendmsg(sock, &msg, 0)) <= 0)
+            return -1;
+        total += (int)cnt;
+        while (cnt > 0) {
+            if ((size_t)cnt >= msg.msg_iov->iov_len) {
+                cnt -= msg.msg_iov->iov_len;
+                ++msg.msg_iov;
+                --msg.msg_iovlen;
+            }
+            else {
+                msg.msg_iov->iov_base = (uint8_t *)msg.msg_iov->iov_base + cnt;
+                msg.msg_iov->iov_len -= cnt;
+                cnt = 0;
+            }
+        }
+    }
+    
+    return total;
+#endif
+}
+
 /* ReceiveSocketData - receive socket data */
 int ReceiveSocketData(SOCKET sock, void *buf, int len)
 {
@@ -276,133 +335,189 @@ int SendSocketDataTo(SOCKET sock, void *buf, int len, SOCKADDR_IN *addr)
  */
 #define EXIT_CHAR   0xff
 
-void SocketTerminal(SOCKET sock, int check_for_exit, int pst_mode)
+/* data is moved in large batches so sustained high baud rate output keeps up */
+#define TERMINAL_BUFFER_SIZE    65536
+#define TERMINAL_RCVBUF_SIZE    (256 * 1024)
+
+/* state shared by the platform specific terminal loops */
+typedef struct {
+    int check_for_exit;
+    int pst_mode;
+    int raw_mode;       /* pass data through untouched */
+    FILE *log;          /* copy of the received data or NULL */
+    uint32_t start;     /* time the terminal started for log timestamps (ms) */
+    int log_line_start;
+    int sawexit_char;
+    int sawexit_valid;
+    int exitcode;
+    int continue_terminal;
+} TerminalState;
+
+static uint32_t terminalTime(void)
 {
-#ifdef __MINGW32__
-    int sawexit_char = 0;
-    int sawexit_valid = 0;
-    int exitcode = 0;
-    int continue_terminal = 1;
-
-    while (continue_terminal) {
-        uint8_t buf[1];
-        if (ReceiveSocketDataTimeout(sock, buf, 1, 0) != -1) {
-            if (sawexit_valid) {
-                exitcode = buf[0];
-                continue_terminal = 0;
-            }
-            else if (sawexit_char) {
-                if (buf[0] == 0) {
-                    sawexit_valid = 1;
-                } else {
-                    putchar(EXIT_CHAR);
-                    putchar(buf[0]);
-                    fflush(stdout);
-                }
-            }
-            else if (check_for_exit && buf[0] == EXIT_CHAR) {
-                sawexit_char = 1;
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (uint32_t)now.tv_sec * 1000 + now.tv_usec / 1000;
+}
+
+/* filter data received from the socket into out (which must be twice the size of buf) and log it */
+static int filterTerminalData(TerminalState *t, const uint8_t *buf, int cnt, uint8_t *out)
+{
+    int realbytes = 0, i;
+    
+    if (t->raw_mode) {
+        memcpy(out, buf, cnt);
+        if (t->log)
+            fwrite(buf, 1, cnt, t->log);
+        return cnt;
+    }
+    
+    for (i = 0; i < cnt; i++) {
+        if (t->sawexit_valid) {
+            t->exitcode = buf[i];
+            t->continue_terminal = 0;
+            break;
+        }
+        else if (t->sawexit_char) {
+            if (buf[i] == 0) {
+                t->sawexit_valid = 1;
+            } else {
+                out[realbytes++] = EXIT_CHAR;
+                out[realbytes++] = buf[i];
+                t->sawexit_char = 0;
             }
-            else {
-                putchar(buf[0]);
-                if (pst_mode && buf[0] == '\r')
-                    putchar('\n');
-                fflush(stdout);
+        } else if (t->check_for_exit && buf[i] == EXIT_CHAR) {
+            t->sawexit_char = 1;
+        } else {
+            out[realbytes++] = buf[i];
+            if (t->pst_mode && buf[i] == '\r')
+                out[realbytes++] = '\n';
+        }
+    }
+    
+    /* timestamp each line in the log with the time since the terminal started */
+    if (t->log) {
+        for (i = 0; i < realbytes; i++) {
+            if (t->log_line_start) {
+                uint32_t elapsed = terminalTime() - t->start;
+                fprintf(t->log, "[%6u.%03u] ", (unsigned)(elapsed / 1000), (unsigned)(elapsed % 1000));
+                t->log_line_start = 0;
             }
+            putc(out[i], t->log);
+            if (out[i] == '\n')
+                t->log_line_start = 1;
         }
-        else if (kbhit()) {
-            if ((buf[0] = getch()) == ESC)
+    }
+    
+    return realbytes;
+}
+
+void SocketTerminal(SOCKET sock, int check_for_exit, int pst_mode, int raw_mode, FILE *log)
+{
+    static uint8_t buf[TERMINAL_BUFFER_SIZE], realbuf[TERMINAL_BUFFER_SIZE * 2]; // double in case buf is filled with \r in PST mode
+    int rcvbuf = TERMINAL_RCVBUF_SIZE;
+    TerminalState t;
+    
+    memset(&t, 0, sizeof(t));
+    t.check_for_exit = check_for_exit && !raw_mode;
+    t.pst_mode = pst_mode && !raw_mode;
+    t.raw_mode = raw_mode;
+    t.log = log;
+    t.start = terminalTime();
+    t.log_line_start = 1;
+    t.continue_terminal = 1;
+    
+    /* a large receive buffer rides out bursts while the output catches up */
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, (void *)&rcvbuf, sizeof(rcvbuf));
+
+#ifdef __MINGW32__
+    if (raw_mode)
+        _setmode(_fileno(stdout), _O_BINARY);
+
+    while (t.continue_terminal) {
+        int cnt;
+        
+        /* wait briefly for data so the keyboard is still checked without spinning */
+        if (SocketDataAvailableP(sock, 10)) {
+            if ((cnt = recv(sock, (char *)buf, sizeof(buf), 0)) <= 0)
                 break;
+            cnt = filterTerminalData(&t, buf, cnt, realbuf);
+            fwrite(realbuf, 1, cnt, stdout);
+            fflush(stdout);
+        }
+        
+        while (kbhit()) {
+            if ((buf[0] = getch()) == ESC)
+                goto done;
             SendSocketData(sock, buf, 1);
         }
     }
 
-    if (check_for_exit && sawexit_valid) {
-        exit(exitcode);
-    }
+done:
 #else
     struct termios oldt, newt;
-    char buf[128], realbuf[256]; // double in case buf is filled with \r in PST mode
+    int stdin_tty = isatty(STDIN_FILENO);
+    int stdin_open = 1;
     ssize_t cnt;
     fd_set set;
-    int exit_char = 0xdead; /* not a valid character */
-    int sawexit_char = 0;
-    int sawexit_valid = 0; 
-    int exitcode = 0;
-    int continue_terminal = 1;
-
-    tcgetattr(STDIN_FILENO, &oldt);
-    newt = oldt;
-    newt.c_lflag &= ~(ICANON | ECHO | ISIG);
-    newt.c_iflag &= ~(ICRNL | INLCR);
-    newt.c_oflag &= ~OPOST;
-    tcsetattr(STDIN_FILENO, TCSANOW, &newt);
-
-    if (check_for_exit)
-        exit_char = EXIT_CHAR;
-
-#if 0
-    /* make it possible to detect breaks */
-    tcgetattr(sock, &newt);
-    newt.c_iflag &= ~IGNBRK;
-    newt.c_iflag |= PARMRK;
-    tcsetattr(sock, TCSANOW, &newt);
-#endif
+
+    if (stdin_tty) {
+        tcgetattr(STDIN_FILENO, &oldt);
+        newt = oldt;
+        newt.c_lflag &= ~(ICANON | ECHO | ISIG);
+        newt.c_iflag &= ~(ICRNL | INLCR);
+        newt.c_oflag &= ~OPOST;
+        tcsetattr(STDIN_FILENO, TCSANOW, &newt);
+    }
 
     do {
         FD_ZERO(&set);
         FD_SET(sock, &set);
-        FD_SET(STDIN_FILENO, &set);
+        if (stdin_open)
+            FD_SET(STDIN_FILENO, &set);
         if (select(sock + 1, &set, NULL, NULL, NULL) > 0) {
             if (FD_ISSET(sock, &set)) {
-                if ((cnt = recv(sock, buf, sizeof(buf), 0)) > 0) {
-                    int i;
-                    // check for breaks
-                    ssize_t realbytes = 0;
-                    for (i = 0; i < cnt; i++) {
-                      if (sawexit_valid)
-                        {
-                          exitcode = buf[i];
-                          continue_terminal = 0;
-                        }
-                      else if (sawexit_char) {
-                        if (buf[i] == 0) {
-                          sawexit_valid = 1;
-                        } else {
-                          realbuf[realbytes++] = exit_char;
-                          realbuf[realbytes++] = buf[i];
-                          sawexit_char = 0;
-                        }
-                      } else if (((int)buf[i] & 0xff) == exit_char) {
-                        sawexit_char = 1;
-                      } else {
-                        realbuf[realbytes++] = buf[i];
-                        if (pst_mode && buf[i] == '\r')
-                            realbuf[realbytes++] = '\n';
-                      }
+                if ((cnt = recv(sock, buf, sizeof(buf), 0)) <= 0)
+                    break;
+                cnt = filterTerminalData(&t, buf, (int)cnt, realbuf);
+                
+                /* write all of it even if the output takes it in pieces */
+                uint8_t *p = realbuf;
+                while (cnt > 0) {
+                    ssize_t written = write(fileno(stdout), p, cnt);
+                    if (written < 0) {
+                        if (errno == EINTR)
+                            continue;
+                        goto done;
                     }
-                    write(fileno(stdout), realbuf, realbytes);
+                    p += written;
+                    cnt -= written;
                 }
             }
-            if (FD_ISSET(STDIN_FILENO, &set)) {
-                if ((cnt = read(STDIN_FILENO, buf, sizeof(buf))) > 0) {
-                    int i;
-                    for (i = 0; i < cnt; ++i) {
-                        if (buf[i] == ESC)
-                            goto done;
-                    }
-                    write(sock, buf, cnt);
+            if (stdin_open && FD_ISSET(STDIN_FILENO, &set)) {
+                /* input that isn't a terminal is sent until it runs out and the output is still received */
+                if ((cnt = read(STDIN_FILENO, buf, sizeof(buf))) <= 0)
+                    stdin_open = 0;
+                else {
+                    if (stdin_tty && memchr(buf, ESC, cnt))
+                        goto done;
+                    if (SendSocketData(sock, buf, (int)cnt) != cnt)
+                        goto done;
                 }
             }
         }
-    } while (continue_terminal);
+    } while (t.continue_terminal);
 
 done:
-    tcsetattr(STDIN_FILENO, TCSANOW, &oldt);
-
-    if (sawexit_valid)
-        exit(exitcode);
+    if (stdin_tty)
+        tcsetattr(STDIN_FILENO, TCSANOW, &oldt);
 #endif
+
+    if (log)
+        fflush(log);
+
+    if (t.sawexit_valid)
+        exit(t.exitcode);
 }
 
 /* GetInterfaceAddresses - get the addresses of all IPv4 interfaces */
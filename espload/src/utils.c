@@ -1,6 +1,15 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
+#include <ctype.h>
+#include <sys/time.h>
+#ifndef __MINGW32__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 #include "propimage.h"
 #include "fastproploader.h"
 #include "utils.h"
@@ -11,6 +20,46 @@
 #define FALSE   0
 #endif
 
+/* module that the messages from this thread are about when several modules are loaded at once */
+static __thread const char *messageHost = NULL;
+
+void setMessageHost(const char *hostName)
+{
+    messageHost = hostName;
+}
+
+/* print a line prefixed with the module it is about so the output of concurrent loads can be told apart */
+void message(const char *fmt, ...)
+{
+    char buf[512];
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+
+    if (messageHost)
+        printf("%s: %s", messageHost, buf);
+    else
+        fputs(buf, stdout);
+}
+
+/* milliseconds since some arbitrary point in the past */
+uint32_t msTime(void)
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (uint32_t)now.tv_sec * 1000 + now.tv_usec / 1000;
+}
+
+/* microseconds since some arbitrary point in the past (wraps after about 71 minutes) */
+uint32_t usTime(void)
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (uint32_t)now.tv_sec * 1000000 + now.tv_usec;
+}
+
 uint8_t *readEntireFile(const char *fileName, int *pSize)
 {
     uint8_t *image;
@@ -18,7 +67,7 @@ uint8_t *readEntireFile(const char *fileName, int *pSize)
 
     /* open the image file */
     if (!(fp = fopen(fileName, "rb"))) {
-        printf("error: can't open '%s'\n", fileName);
+        message("error: can't open '%s'\n", fileName);
         return NULL;
     }
     
@@ -29,13 +78,13 @@ uint8_t *readEntireFile(const char *fileName, int *pSize)
 
     /* allocate space for the file */
     if (!(image = (uint8_t *)malloc(*pSize))) {
-        printf("error: insufficient memory\n");
+        message("error: insufficient memory\n");
         return NULL;
     }
 
     /* read the entire image into memory */
     if ((int)fread(image, 1, *pSize, fp) != *pSize) {
-        printf("error: reading '%s'\n", fileName);
+        message("error: reading '%s'\n", fileName);
         free(image);
         return NULL;
     }
@@ -47,105 +96,359 @@ uint8_t *readEntireFile(const char *fileName, int *pSize)
     return image;
 }
 
-int setBaudRate(const char *hostName, int baudRate)
+/* map a file read-only into memory (the file is read into memory where mapping isn't available) */
+uint8_t *mapFile(const char *fileName, int *pSize)
 {
-    uint8_t buffer[1024];
-    int hdrCnt, result;
-    SOCKADDR_IN addr;
+#ifdef __MINGW32__
+    return readEntireFile(fileName, pSize);
+#else
+    struct stat info;
+    void *image;
+    int fd;
+
+    if ((fd = open(fileName, O_RDONLY)) < 0) {
+        message("error: can't open '%s'\n", fileName);
+        return NULL;
+    }
+
+    if (fstat(fd, &info) != 0 || info.st_size == 0) {
+        message("error: reading '%s'\n", fileName);
+        close(fd);
+        return NULL;
+    }
+    *pSize = (int)info.st_size;
+
+    /* the mapping stays valid after the file is closed */
+    image = mmap(NULL, *pSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        message("error: reading '%s'\n", fileName);
+        return NULL;
+    }
+
+    return (uint8_t *)image;
+#endif
+}
+
+void unmapFile(uint8_t *image, int size)
+{
+#ifdef __MINGW32__
+    free(image);
+#else
+    munmap(image, size);
+#endif
+}
 
-    if (GetInternetAddress(hostName, 80, &addr) != 0) {
-        printf("error: invalid host name or IP address '%s'\n", hostName);
+static int receiveResponse(HttpSession *session, uint8_t *res, int resMax, int *pResult, int *pKeepAlive);
+static int findHeaderEnd(const uint8_t *buf, int size);
+static const char *headerValue(const char *hdr, const char *name);
+
+/* resolve the address of the module's web server (no connection is made until the first request) */
+int openSession(HttpSession *session, const char *hostName)
+{
+    if (GetInternetAddress(hostName, 80, &session->addr) != 0) {
+        message("error: invalid host name or IP address '%s'\n", hostName);
         return -1;
     }
+    snprintf(session->hostName, sizeof(session->hostName), "%s", hostName);
+    session->connected = FALSE;
+    return 0;
+}
 
-    hdrCnt = snprintf((char *)buffer, sizeof(buffer), "\
-POST /propeller/set-baud-rate?baud-rate=%d HTTP/1.1\r\n\
-\r\n", baudRate);
+void closeSession(HttpSession *session)
+{
+    if (session->connected) {
+        CloseSocket(session->sock);
+        session->connected = FALSE;
+    }
+}
 
-    if (sendRequest(&addr, buffer, hdrCnt, buffer, sizeof(buffer), &result) == -1) {
-        printf("error: set-baud-rate request failed\n");
+int setBaudRate(HttpSession *session, int baudRate)
+{
+    uint8_t buffer[1024];
+    char path[64];
+    int result;
+
+    snprintf(path, sizeof(path), "/propeller/set-baud-rate?baud-rate=%d", baudRate);
+
+    if (sendRequest(session, "POST", path, NULL, 0, buffer, sizeof(buffer), &result) == -1) {
+        message("error: set-baud-rate request failed\n");
         return -1;
     }
     else if (result != 200) {
-        printf("error: set-baud-rate returned %d\n", result);
+        message("error: set-baud-rate returned %d\n", result);
         return -1;
     }
     
     return 0;
 }
 
-int slowLoad(const char *hostName, PropellerImage *image, LoadType loadType, int ackSize)
+/* FNV-1a hash of the image file content (the same hash the module keeps for its files) */
+uint32_t imageHash(const uint8_t *image, int imageSize)
+{
+    uint32_t hash = 2166136261u;
+    int i;
+    for (i = 0; i < imageSize; ++i)
+        hash = (hash ^ image[i]) * 16777619u;
+    return hash;
+}
+
+/* get the hash of the image last loaded on the reset pin (returns 1 if there is one, 0 if not) */
+int getImageHash(HttpSession *session, uint32_t *pHash)
 {
-    uint8_t buffer[1024], *packet;
-    int hdrCnt, result;
-    SOCKADDR_IN addr;
+    uint8_t buffer[1024];
+    int cnt, result;
+    char path[64];
+    char *body;
 
-    if (GetInternetAddress(hostName, 80, &addr) != 0) {
-        printf("error: invalid host name or IP address '%s'\n", hostName);
+    snprintf(path, sizeof(path), "/propeller/image-hash?reset-pin=%d", resetPin);
+
+    if ((cnt = sendRequest(session, "GET", path, NULL, 0, buffer, sizeof(buffer) - 1, &result)) == -1) {
+        message("error: image-hash request failed\n");
         return -1;
     }
+    else if (result != 200)
+        return 0;
+    buffer[cnt] = '\0';
 
-    hdrCnt = snprintf((char *)buffer, sizeof(buffer), "\
-POST /propeller/load?reset-pin=%d&baud-rate=%d HTTP/1.1\r\n\
-Content-Length: %d\r\n\
-\r\n", resetPin, initialBaudRate, image->imageSize);
+    if (!(body = strstr((char *)buffer, "\r\n\r\n")) || sscanf(body + 4, "%x", pHash) != 1)
+        return 0;
 
-    if (!(packet = (uint8_t *)malloc(hdrCnt + image->imageSize)))
-        return -1;
+    return 1;
+}
 
-    memcpy(packet,  buffer, hdrCnt);
-    memcpy(&packet[hdrCnt], image->imageData, image->imageSize);
-    
-    if (sendRequest(&addr, packet, hdrCnt + image->imageSize, buffer, sizeof(buffer), &result) == -1) {
-        printf("error: load request failed\n");
+/* record the hash of the image just loaded on the reset pin */
+int setImageHash(HttpSession *session, uint32_t hash)
+{
+    uint8_t buffer[1024];
+    char path[64];
+    int result;
+
+    snprintf(path, sizeof(path), "/propeller/image-hash?reset-pin=%d&hash=%08x", resetPin, hash);
+
+    if (sendRequest(session, "POST", path, NULL, 0, buffer, sizeof(buffer), &result) == -1) {
+        message("error: image-hash request failed\n");
         return -1;
     }
     else if (result != 200) {
-        printf("error: load returned %d\n", result);
+        message("error: image-hash returned %d\n", result);
         return -1;
     }
     
     return 0;
 }
 
-int sendRequest(SOCKADDR_IN *addr, uint8_t *req, int reqSize, uint8_t *res, int resMax, int *pResult)
+/* get the second-stage loader baud rate stored on the module (returns 1 if there is one, 0 if not) */
+int getLoaderBaudRate(HttpSession *session, int *pBaudRate)
 {
-    char buf[80];
-    SOCKET sock;
-    int cnt;
-    
-    if (ConnectSocket(addr, &sock) != 0) {
-        printf("error: connect failed\n");
+    uint8_t buffer[1024];
+    int cnt, result;
+    char *body;
+
+    if ((cnt = sendRequest(session, "GET", "/propeller/loader-baud-rate", NULL, 0, buffer, sizeof(buffer) - 1, &result)) == -1) {
+        message("error: loader-baud-rate request failed\n");
         return -1;
     }
-    
-    if (verbose) {
-        printf("REQ: %d\n", reqSize);
-        dumpHdr(req, reqSize);
+    else if (result != 200)
+        return 0;
+    buffer[cnt] = '\0';
+
+    if (!(body = strstr((char *)buffer, "\r\n\r\n")) || sscanf(body + 4, "%d", pBaudRate) != 1)
+        return 0;
+
+    return 1;
+}
+
+/* store the second-stage loader baud rate on the module */
+int setLoaderBaudRate(HttpSession *session, int baudRate)
+{
+    uint8_t buffer[1024];
+    char path[64];
+    int result;
+
+    snprintf(path, sizeof(path), "/propeller/loader-baud-rate?baud-rate=%d", baudRate);
+
+    if (sendRequest(session, "POST", path, NULL, 0, buffer, sizeof(buffer), &result) == -1) {
+        message("error: loader-baud-rate request failed\n");
+        return -1;
+    }
+    else if (result != 200) {
+        message("error: loader-baud-rate returned %d\n", result);
+        return -1;
     }
     
-    if (SendSocketData(sock, req, reqSize) != reqSize) {
-        printf("error: send request failed\n");
+    return 0;
+}
+
+int slowLoad(HttpSession *session, PropellerImage *image, LoadType loadType, int ackSize)
+{
+    uint8_t buffer[1024];
+    char path[96];
+    int result;
+
+    snprintf(path, sizeof(path), "/propeller/load?reset-pin=%d&baud-rate=%d", resetPin, initialBaudRate);
+
+    if (sendRequest(session, "POST", path, image->imageData, image->imageSize, buffer, sizeof(buffer), &result) == -1) {
+        message("error: load request failed\n");
         return -1;
     }
+    else if (result != 200) {
+        message("error: load returned %d\n", result);
+        return -1;
+    }
+    
+    return 0;
+}
+
+/* send a request over the session's connection and return the number of response bytes in res
+   the connection is kept open for the next request if the server allows it and reopened if the
+   server has closed it in the meantime */
+int sendRequest(HttpSession *session, const char *method, const char *path, const uint8_t *body, int bodySize,
+                uint8_t *res, int resMax, int *pResult)
+{
+    int hdrCnt, cnt, keepAlive, attempt;
+    uint8_t req[REQUEST_HEADER_MAX];
     
-    if ((cnt = ReceiveSocketDataTimeout(sock, res, resMax, 10000)) == -1) {
-        printf("error: receive response failed\n");
+    hdrCnt = snprintf((char *)req, sizeof(req), "\
+%s %s HTTP/1.1\r\n\
+Host: %s\r\n\
+Connection: keep-alive\r\n\
+Content-Length: %d\r\n\
+\r\n", method, path, session->hostName, bodySize);
+    if (hdrCnt >= (int)sizeof(req))
         return -1;
+
+    if (verbose) {
+        message("REQ: %d\n", hdrCnt + bodySize);
+        dumpHdr(req, hdrCnt);
     }
     
+    /* a reused connection may have been closed by the server so try once more on a new one */
+    for (attempt = 0; attempt < 2; ++attempt) {
+        int reused = session->connected;
+
+        if (!session->connected) {
+            if (ConnectSocket(&session->addr, &session->sock) != 0) {
+                message("error: connect failed\n");
+                return -1;
+            }
+            session->connected = TRUE;
+        }
+    
+        /* the body is sent from where it is with the header in front of it */
+        if (SendSocketDataGather(session->sock, req, hdrCnt, (void *)body, bodySize) == hdrCnt + bodySize
+        &&  (cnt = receiveResponse(session, res, resMax, pResult, &keepAlive)) != -1)
+            break;
+
+        closeSession(session);
+        if (!reused) {
+            message("error: request failed\n");
+            return -1;
+        }
+    }
+    
+    if (attempt >= 2)
+        return -1;
+
     if (verbose) {
-        printf("RES: %d\n", cnt);
+        message("RES: %d\n", cnt);
         dumpResponse(res, cnt);
     }
     
-    if (sscanf((char *)res, "%s %d", buf, pResult) != 2)
-        return -1;
-        
-    CloseSocket(sock);
+    if (!keepAlive)
+        closeSession(session);
     
     return cnt;
 }
+
+/* receive a complete response (the part of the body that doesn't fit in res is discarded) */
+static int receiveResponse(HttpSession *session, uint8_t *res, int resMax, int *pResult, int *pKeepAlive)
+{
+    int cnt = 0, hdrSize = -1, contentLength = -1, total, n;
+    char hdr[RESPONSE_HEADER_MAX + 1], version[16];
+    const char *value;
+    uint8_t discard[256];
+
+    /* read until the end of the header */
+    while (hdrSize < 0) {
+        if (cnt >= resMax)
+            return -1;
+        if ((n = ReceiveSocketDataTimeout(session->sock, &res[cnt], resMax - cnt, RESPONSE_TIMEOUT)) <= 0)
+            return -1;
+        cnt += n;
+        hdrSize = findHeaderEnd(res, cnt);
+    }
+
+    /* parse the status line and the headers that determine how the body is delimited */
+    if (hdrSize > RESPONSE_HEADER_MAX)
+        return -1;
+    memcpy(hdr, res, hdrSize);
+    hdr[hdrSize] = '\0';
+    if (sscanf(hdr, "%15s %d", version, pResult) != 2)
+        return -1;
+    if ((value = headerValue(hdr, "Content-Length")) != NULL)
+        contentLength = atoi(value);
+    if ((value = headerValue(hdr, "Connection")) != NULL)
+        *pKeepAlive = strncmp(value, "close", 5) != 0 && (strcmp(version, "HTTP/1.1") == 0 || strncmp(value, "keep-alive", 10) == 0);
+    else
+        *pKeepAlive = strcmp(version, "HTTP/1.1") == 0;
+
+    /* without a content length the body ends when the server closes the connection */
+    if (contentLength < 0)
+        *pKeepAlive = FALSE;
+
+    /* read the rest of the body */
+    total = cnt;
+    while (contentLength < 0 || total < hdrSize + contentLength) {
+        uint8_t *buf = cnt < resMax ? &res[cnt] : discard;
+        int max = cnt < resMax ? resMax - cnt : (int)sizeof(discard);
+        if (contentLength >= 0 && max > hdrSize + contentLength - total)
+            max = hdrSize + contentLength - total;
+        if ((n = ReceiveSocketDataTimeout(session->sock, buf, max, RESPONSE_TIMEOUT)) <= 0) {
+            if (contentLength < 0)
+                break;
+            return -1;
+        }
+        if (buf != discard)
+            cnt += n;
+        total += n;
+    }
+
+    return cnt;
+}
+
+/* return the size of the response header including the blank line or -1 if it isn't complete */
+static int findHeaderEnd(const uint8_t *buf, int size)
+{
+    int i;
+    for (i = 0; i + 4 <= size; ++i)
+        if (buf[i] == '\r' && buf[i + 1] == '\n' && buf[i + 2] == '\r' && buf[i + 3] == '\n')
+            return i + 4;
+    return -1;
+}
+
+/* find the value of a header field (field names are case insensitive) */
+static const char *headerValue(const char *hdr, const char *name)
+{
+    int len = (int)strlen(name);
+    const char *p = hdr;
+    int i;
+    
+    while ((p = strstr(p, "\r\n")) != NULL) {
+        p += 2;
+        for (i = 0; i < len; ++i)
+            if (tolower((unsigned char)p[i]) != tolower((unsigned char)name[i]))
+                break;
+        if (i == len && p[len] == ':') {
+            p += len + 1;
+            while (*p == ' ' || *p == '\t')
+                ++p;
+            return p;
+        }
+    }
+    
+    return NULL;
+}
     
 void dumpHdr(const uint8_t *buf, int size)
 {
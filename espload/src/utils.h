@@ -15,10 +15,36 @@ extern int finalBaudRate;
 extern int resetPin;
 extern int verbose;
 
+#define REQUEST_HEADER_MAX  512     /* maximum size of a request header */
+#define RESPONSE_HEADER_MAX 1024    /* maximum size of a response header */
+#define RESPONSE_TIMEOUT    10000   /* time to wait for each part of a response (ms) */
+
+/* an HTTP session with the module's web server that is reused for every request to the module */
+typedef struct {
+    SOCKADDR_IN addr;
+    char hostName[256];
+    SOCKET sock;
+    int connected;
+} HttpSession;
+
+void setMessageHost(const char *hostName);
+void message(const char *fmt, ...);
+uint32_t msTime(void);
+uint32_t usTime(void);
 uint8_t *readEntireFile(const char *fileName, int *pSize);
-int setBaudRate(const char *hostName, int baudRate);
-int slowLoad(const char *hostName, PropellerImage *image, LoadType loadType, int ackSize);
-int sendRequest(SOCKADDR_IN *addr, uint8_t *req, int reqSize, uint8_t *res, int resMax, int *pResult);
+uint8_t *mapFile(const char *fileName, int *pSize);
+void unmapFile(uint8_t *image, int size);
+int openSession(HttpSession *session, const char *hostName);
+void closeSession(HttpSession *session);
+int setBaudRate(HttpSession *session, int baudRate);
+uint32_t imageHash(const uint8_t *image, int imageSize);
+int getImageHash(HttpSession *session, uint32_t *pHash);
+int setImageHash(HttpSession *session, uint32_t hash);
+int getLoaderBaudRate(HttpSession *session, int *pBaudRate);
+int setLoaderBaudRate(HttpSession *session, int baudRate);
+int slowLoad(HttpSession *session, PropellerImage *image, LoadType loadType, int ackSize);
+int sendRequest(HttpSession *session, const char *method, const char *path, const uint8_t *body, int bodySize,
+                uint8_t *res, int resMax, int *pResult);
 void dumpHdr(const uint8_t *buf, int size);
 void dumpResponse(const uint8_t *buf, int size);
 
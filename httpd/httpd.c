@@ -46,6 +46,12 @@ struct HttpdPriv {
   short sendBuffLen;        // offset into output buffer
   short sendBuffMax;        // size of output buffer
   short code;               // http response code (only for logging)
+  short respStart;          // offset of the response status line in the output buffer or -1
+  short respHeadEnd;        // offset of the end of the status and connection lines
+  short bodyStart;          // offset of the response body in the output buffer or -1
+  char hasLength;           // the cgi supplied its own Content-Length header
+  char keepAlive;           // the client wants the connection kept open for another request
+  char idle;                // kept open and waiting for the next request
 };
 
 //Connection pool
@@ -128,6 +134,7 @@ static void ICACHE_FLASH_ATTR httpdRetireConn(HttpdConnData *conn) {
 #endif
 
   conn->conn = NULL; // don't try to send anything, the SDK crashes...
+  conn->priv->idle = 0;
   if (conn->cgi != NULL) conn->cgi(conn); // free cgi data
   if (conn->post->buff != NULL) os_free(conn->post->buff);
   conn->cgi = NULL;
@@ -233,6 +240,8 @@ void ICACHE_FLASH_ATTR httpdSetOutputBuffer(HttpdConnData *conn, char *buff, sho
   conn->priv->sendBuff = buff;
   conn->priv->sendBuffLen = 0;
   conn->priv->sendBuffMax = max;
+  conn->priv->respStart = -1;
+  conn->priv->bodyStart = -1;
 }
 
 //Start the response headers.
@@ -242,7 +251,12 @@ void ICACHE_FLASH_ATTR httpdStartResponse(HttpdConnData *conn, int code) {
   conn->priv->code = code;
   char *status = code < 400 ? "OK" : "ERROR";
   l = os_sprintf(buff, "HTTP/1.0 %d %s\r\nServer: esp-link\r\nConnection: close\r\n", code, status);
-  httpdSend(conn, buff, l);
+  // remember where the response starts so httpdFlush can frame it for keep-alive
+  conn->priv->respStart = conn->priv->sendBuffLen;
+  conn->priv->bodyStart = -1;
+  conn->priv->hasLength = 0;
+  if (!httpdSend(conn, buff, l)) conn->priv->respStart = -1;
+  conn->priv->respHeadEnd = conn->priv->sendBuffLen;
 }
 
 //Send a http header.
@@ -252,11 +266,13 @@ void ICACHE_FLASH_ATTR httpdHeader(HttpdConnData *conn, const char *field, const
 
   l = os_sprintf(buff, "%s: %s\r\n", field, val);
   httpdSend(conn, buff, l);
+  if (os_strcmp(field, "Content-Length") == 0) conn->priv->hasLength = 1;
 }
 
 //Finish the headers.
 void ICACHE_FLASH_ATTR httpdEndHeaders(HttpdConnData *conn) {
   httpdSend(conn, "\r\n", -1);
+  if (conn->priv->respStart >= 0) conn->priv->bodyStart = conn->priv->sendBuffLen;
 }
 
 //ToDo: sprintf->snprintf everywhere... esp doesn't have snprintf tho' :/
@@ -296,15 +312,67 @@ int ICACHE_FLASH_ATTR httpdSend(HttpdConnData *conn, const char *data, int len)
   return 1;
 }
 
+//Turn a complete response in the send buffer into an HTTP/1.1 keep-alive response with a
+//Content-Length so the client can send its next request on the same connection. Only
+//responses of cgis that are done (cgi == NULL) and that are entirely in the buffer qualify,
+//everything else is delimited by closing the connection as before.
+static void ICACHE_FLASH_ATTR httpdFrameResponse(HttpdConnData *conn) {
+  HttpdPriv *p = conn->priv;
+  char buff[128];
+  int l, headLen;
+
+  if (!p->keepAlive) return;
+  p->keepAlive = 0;
+  if (conn->cgi != NULL || p->respStart < 0 || p->bodyStart < 0) return;
+  // unread request body would be taken for the next request
+  if (conn->post->len > 0 && conn->post->received < conn->post->len) return;
+
+  l = os_sprintf(buff, "HTTP/1.1 %d %s\r\nServer: esp-link\r\nConnection: keep-alive\r\n",
+      p->code, p->code < 400 ? "OK" : "ERROR");
+  if (!p->hasLength)
+    l += os_sprintf(buff + l, "Content-Length: %d\r\n", p->sendBuffLen - p->bodyStart);
+  headLen = p->respHeadEnd - p->respStart;
+  if (p->sendBuffLen + l - headLen > p->sendBuffMax) return;
+
+  os_memmove(p->sendBuff + p->respStart + l, p->sendBuff + p->respHeadEnd, p->sendBuffLen - p->respHeadEnd);
+  os_memcpy(p->sendBuff + p->respStart, buff, l);
+  p->sendBuffLen += l - headLen;
+  p->keepAlive = 1;
+}
+
+//Get a kept-alive connection ready to receive the next request.
+static void ICACHE_FLASH_ATTR httpdNextRequest(HttpdConnData *conn) {
+  uint32 dt = (system_get_time() - conn->startTime) / 1000;
+  if (conn->url)
+    DBG("HTTP %s %s: %d, %ums, h=%ld (keep-alive)\n",
+      conn->requestType == HTTPD_METHOD_GET ? "GET" : "POST", conn->url,
+      conn->priv->code, dt, (unsigned long)system_get_free_heap_size());
+
+  if (conn->post->buff != NULL) os_free(conn->post->buff);
+  conn->post->buff = NULL;
+  conn->post->buffLen = 0;
+  conn->post->received = 0;
+  conn->post->len = -1;
+  conn->url = NULL;
+  conn->getArgs = NULL;
+  conn->priv->headPos = 0;
+  conn->priv->keepAlive = 0;
+  conn->priv->idle = 1;
+  conn->startTime = system_get_time();
+}
+
 //Helper function to send any data in conn->priv->sendBuff
 void ICACHE_FLASH_ATTR httpdFlush(HttpdConnData *conn) {
   if (conn->priv->sendBuffLen != 0) {
+    httpdFrameResponse(conn);
     sint8 status = espconn_sent(conn->conn, (uint8_t*)conn->priv->sendBuff, conn->priv->sendBuffLen);
     if (status != 0) {
       DBG("%sERROR! espconn_sent returned %d, trying to send %d to %s\n",
           connStr, status, conn->priv->sendBuffLen, conn->url);
     }
     conn->priv->sendBuffLen = 0;
+    conn->priv->respStart = -1;
+    conn->priv->bodyStart = -1;
   }
 }
 
@@ -319,6 +387,10 @@ static void ICACHE_FLASH_ATTR httpdSentCb(void *arg) {
   httpdSetOutputBuffer(conn, sendBuff, sizeof(sendBuff));
 
   if (conn->cgi == NULL) { //Marked for destruction?
+    if (conn->priv->keepAlive) { //The response was framed, wait for the next request
+      httpdNextRequest(conn);
+      return;
+    }
     //os_printf("Closing 0x%p/0x%p->0x%p\n", arg, conn->conn, conn);
     espconn_disconnect(conn->conn); // we will get a disconnect callback
     return; //No need to call httpdFlush.
@@ -326,7 +398,7 @@ static void ICACHE_FLASH_ATTR httpdSentCb(void *arg) {
 
   int r = conn->cgi(conn); //Execute cgi fn.
   if (r == HTTPD_CGI_DONE) {
-    conn->cgi = NULL; //mark for destruction.
+    conn->cgi = NULL; //mark for destruction (before the flush so a keep-alive response can be framed)
   }
   if (r == HTTPD_CGI_NOTFOUND || r == HTTPD_CGI_AUTHENTICATED) {
     DBG("%sERROR! Bad CGI code %d\n", connStr, r);
@@ -392,8 +464,8 @@ static void ICACHE_FLASH_ATTR httpdProcessRequest(HttpdConnData *conn) {
     }
     else if (r == HTTPD_CGI_DONE) {
       //Yep, it's happy to do so and already is done sending data.
+      conn->cgi = NULL; //mark for destruction (before the flush so a keep-alive response can be framed)
       httpdFlush(conn);
-      conn->cgi = NULL; //mark for destruction.
       if (conn->post) conn->post->len = 0; // skip any remaining receives
       return;
     }
@@ -436,6 +508,9 @@ static void ICACHE_FLASH_ATTR httpdParseHeader(char *h, HttpdConnData *conn) {
     if (e == NULL) return; //wtf?
     *e = 0; //terminate url part
 
+    //HTTP/1.1 clients keep the connection open unless they ask otherwise
+    conn->priv->keepAlive = os_strncmp(e + 1, "HTTP/1.1", 8) == 0;
+
     // Count number of open connections
     //esp_tcp *tcp = conn->conn->proto.tcp;
     //DBG("%sHTTP %s %s from %s\n", connStr,
@@ -471,6 +546,10 @@ static void ICACHE_FLASH_ATTR httpdParseHeader(char *h, HttpdConnData *conn) {
     conn->post->buff = (char*)os_malloc(conn->post->buffSize + 1);
     conn->post->buffLen = 0;
   }
+  else if (os_strncmp(h, "Connection:", 11) == 0) {
+    if (os_strstr(h, "close") || os_strstr(h, "Close")) conn->priv->keepAlive = 0;
+    else if (os_strstr(h, "keep-alive") || os_strstr(h, "Keep-Alive")) conn->priv->keepAlive = 1;
+  }
   else if (os_strncmp(h, "Content-Type: ", 14) == 0) {
     if (os_strstr(h, "multipart/form-data")) {
       // It's multipart form data so let's pull out the boundary for future use
@@ -495,6 +574,7 @@ static void ICACHE_FLASH_ATTR httpdRecvCb(void *arg, char *data, unsigned short
 
   char sendBuff[MAX_SENDBUFF_LEN];
   httpdSetOutputBuffer(conn, sendBuff, sizeof(sendBuff));
+  conn->priv->idle = 0;
 
   //This is slightly evil/dirty: we abuse conn->post->len as a state variable for where in the http communications we are:
   //<0 (-1): Post len unknown because we're still receiving headers
@@ -513,6 +593,7 @@ static void ICACHE_FLASH_ATTR httpdRecvCb(void *arg, char *data, unsigned short
         conn->post->len = 0;
         //Reset url data
         conn->url = NULL;
+        conn->priv->keepAlive = 0;
         //Iterate over all received headers and parse them.
         char *p = conn->priv->head;
         while (p<(&conn->priv->head[conn->priv->headPos - 4])) {
@@ -571,6 +652,15 @@ static void ICACHE_FLASH_ATTR httpdConnectCb(void *arg) {
   int i;
   for (i = 0; i<MAX_CONN; i++) if (connData[i].conn == NULL) break;
   //DBG("Con req, conn=%p, pool slot %d\n", conn, i);
+  if (i == MAX_CONN) {
+    //Make room by closing a kept-alive connection that is waiting for its next request
+    for (i = 0; i<MAX_CONN; i++) if (connData[i].priv->idle) break;
+    if (i != MAX_CONN) {
+      struct espconn *idleConn = connData[i].conn;
+      httpdRetireConn(&connData[i]);
+      espconn_disconnect(idleConn);
+    }
+  }
   if (i == MAX_CONN) {
     os_printf("%sHTTP: conn pool overflow!\n", connStr);
     espconn_disconnect(conn);
@@ -587,6 +677,10 @@ static void ICACHE_FLASH_ATTR httpdConnectCb(void *arg) {
   connData[i].conn = conn;
   conn->reverse = connData+i;
   connData[i].priv->headPos = 0;
+  connData[i].priv->keepAlive = 0;
+  connData[i].priv->idle = 0;
+  connData[i].priv->respStart = -1;
+  connData[i].priv->bodyStart = -1;
 
   esp_tcp *tcp = conn->proto.tcp;
   os_sprintf(connData[i].priv->from, "%d.%d.%d.%d:%d", tcp->remote_ip[0], tcp->remote_ip[1],
@@ -621,5 +715,6 @@ void ICACHE_FLASH_ATTR httpdInit(HttpdBuiltInUrl *fixedUrls, int port) {
   DBG("Httpd init, conn=%p\n", &httpdConn);
   espconn_regist_connectcb(&httpdConn, httpdConnectCb);
   espconn_accept(&httpdConn);
-  espconn_tcp_set_max_con_allow(&httpdConn, MAX_CONN);
+  //One more than the pool so a new client can push out an idle kept-alive connection
+  espconn_tcp_set_max_con_allow(&httpdConn, MAX_CONN + 1);
 }
@@ -37,7 +37,7 @@ int ICACHE_FLASH_ATTR
 cgiRoffsHook(HttpdConnData *connData) {
 	ROFFS_FILE *file = connData->cgiData;
 	int len=0;
-	char buff[1024];
+	uint32_t buff[1024/4]; //roffs_read needs a long aligned buffer
 	char acceptEncodingBuffer[64];
 	int isGzip;
 
@@ -64,6 +64,11 @@ cgiRoffsHook(HttpdConnData *connData) {
 		//First call to this cgi. Open the file so we can read it.
 		file=roffs_open(fileName);
 		if (file==NULL) {
+			//The file may be in the middle of being moved by compaction
+			if (roffs_busy()) {
+				errorResponse(connData, 503, "Filesystem busy\r\n");
+				return HTTPD_CGI_DONE;
+			}
 			return HTTPD_CGI_NOTFOUND;
 		}
 
@@ -97,7 +102,7 @@ cgiRoffsHook(HttpdConnData *connData) {
 		return HTTPD_CGI_MORE;
 	}
 
-	len=roffs_read(file, buff, 1024);
+	len=roffs_read(file, (char *)buff, 1024);
 	if (len>0) espconn_sent(connData->conn, (uint8 *)buff, len);
 	if (len!=1024) {
 		//We're done.
@@ -118,8 +123,8 @@ static void ICACHE_FLASH_ATTR httpdSendResponse(HttpdConnData *connData, int cod
     httpdStartResponse(connData, code);
     httpdEndHeaders(connData);
     httpdSend(connData, message, len);
-    httpdFlush(connData);
     connData->cgi = NULL;
+    httpdFlush(connData);
 }
 
 int ICACHE_FLASH_ATTR cgiRoffsFormat(HttpdConnData *connData)
@@ -127,21 +132,40 @@ int ICACHE_FLASH_ATTR cgiRoffsFormat(HttpdConnData *connData)
     if (connData->conn == NULL)
         return HTTPD_CGI_DONE;
     if (roffs_format(FLASH_FILESYSTEM_BASE) != 0) {
-        errorResponse(connData, 400, "Error formatting filesystem\r\n");
+        if (roffs_busy())
+            errorResponse(connData, 409, "Filesystem in use\r\n");
+        else
+            errorResponse(connData, 400, "Error formatting filesystem\r\n");
         return HTTPD_CGI_DONE;
     }
     httpdSendResponse(connData, 200, "", -1);
     return HTTPD_CGI_DONE;
 }
 
+int ICACHE_FLASH_ATTR cgiRoffsSpace(HttpdConnData *connData)
+{
+    uint32_t freeSpace, reclaimable;
+    char buf[64];
+    if (connData->conn == NULL)
+        return HTTPD_CGI_DONE;
+    if (roffs_space(&freeSpace, &reclaimable) != 0) {
+        errorResponse(connData, 400, "Filesystem not mounted\r\n");
+        return HTTPD_CGI_DONE;
+    }
+    os_sprintf(buf, "{\"free\": %lu, \"reclaimable\": %lu}\r\n", (unsigned long)freeSpace, (unsigned long)reclaimable);
+    httpdSendResponse(connData, 200, buf, -1);
+    return HTTPD_CGI_DONE;
+}
+
 int ICACHE_FLASH_ATTR cgiRoffsWriteFile(HttpdConnData *connData)
 {
     ROFFS_FILE *file = connData->cgiData;
     
     // check for the cleanup call
+    // a file that wasn't completely received is abandoned so the next upload can go ahead
     if (connData->conn == NULL) {
 		if (file) {
-            roffs_close(file);
+            roffs_discard(file);
             connData->cgiData = NULL;
         }
         return HTTPD_CGI_DONE;
@@ -157,7 +181,10 @@ int ICACHE_FLASH_ATTR cgiRoffsWriteFile(HttpdConnData *connData)
         }
 
         if (!(file = roffs_create(fileName))) {
-            errorResponse(connData, 400, "File not created\r\n");
+            if (roffs_busy())
+                errorResponse(connData, 503, "Filesystem busy\r\n");
+            else
+                errorResponse(connData, 400, "File not created\r\n");
             return HTTPD_CGI_DONE;
         }
         connData->cgiData = file;
@@ -168,6 +195,8 @@ int ICACHE_FLASH_ATTR cgiRoffsWriteFile(HttpdConnData *connData)
     // append data to the file
     if (connData->post->buffLen > 0) {
         if (roffs_write(file, connData->post->buff, connData->post->buffLen) != connData->post->buffLen) {
+            roffs_discard(file);
+            connData->cgiData = NULL;
             errorResponse(connData, 400, "File write failed\r\n");
             return HTTPD_CGI_DONE;
         }
@@ -6,6 +6,7 @@
 
 int cgiRoffsHook(HttpdConnData *connData);
 int cgiRoffsFormat(HttpdConnData *connData);
+int cgiRoffsSpace(HttpdConnData *connData);
 int cgiRoffsWriteFile(HttpdConnData *connData);
 
 #endif
@@ -142,9 +142,8 @@ void ICACHE_FLASH_ATTR HTTP_Response(CmdPacket *cmd)
     httpdHeader(h->connData, "Content-Length", buf);
     httpdEndHeaders(h->connData);
     httpdSend(h->connData, message, messageLen);
-    httpdFlush(h->connData);
-    
     h->connData->cgi = NULL;
+    httpdFlush(h->connData);
 
     status = 0;
     
@@ -5,6 +5,8 @@
 #include "config.h"
 #include "serbridge.h"
 #include "proploader.h"
+#include "propimage.h"
+#include "imagehash.h"
 #include "uart.h"
 #include "serled.h"
 #include "roffs.h"
@@ -12,28 +14,55 @@
 //#define STATE_DEBUG
 
 static ETSTimer resetButtonTimer;
+static ETSTimer compactTimer;
 static int resetButtonState;
 static int resetButtonCount;
 
+static PropellerConnection *newJob(HttpdConnData *connData, JobType jobType);
+static PropellerConnection *findJob(HttpdConnData *connData);
+static void queueJob(PropellerConnection *connection);
+static void startJob(PropellerConnection *connection);
+static void finishJob(PropellerConnection *connection);
+static void cancelJob(PropellerConnection *connection);
+static void httpdSendImageCurrentResponse(HttpdConnData *connData);
+static void setState(PropellerConnection *connection, LoadState state);
+static void recordStats(PropellerConnection *connection);
+static int statsStateJSON(char *buf, LoadState state, const char *separator);
+static int statsLoadJSON(char *buf, LoadStats *stats);
 static void startLoading(PropellerConnection *connection, const uint8_t *image, int imageSize);
 static void finishLoading(PropellerConnection *connection);
 static void abortLoading(PropellerConnection *connection);
 static void httpdSendResponse(HttpdConnData *connData, int code, char *message, int len);
+static void httpdSendLoadResponse(PropellerConnection *connection, char *message, int len);
 static void resetButtonTimerCallback(void *data);
+static void compactTimerCallback(void *data);
 static void armTimer(PropellerConnection *connection, int delay);
+static void awaitPacketAck(PropellerConnection *connection, LoadState state);
+static void updateReceiveHold(PropellerConnection *connection);
+static void captureResponse(PropellerConnection *connection, char *buf, short length);
+static void growResponseBuffer(PropellerConnection *connection, int size);
+static void sendResponse(PropellerConnection *connection);
+static int sendResponseData(PropellerConnection *connection);
 static void timerCallback(void *data);
 static void readCallback(char *buf, short length);
 
 /* the order here must match the definition of LoadState in proploader.h */
 static const char * ICACHE_RODATA_ATTR stateNames[] = {
     "Idle",
+    "Queued",
     "Reset",
     "TxHandshake",
     "RxHandshakeStart",
     "RxHandshake",
     "LoadContinue",
     "VerifyChecksum",
-    "StartAck"
+    "StartAck",
+    "LoaderStart",
+    "ImagePacketAck",
+    "VerifyRAMAck",
+    "ReadyToLaunchAck",
+    "BuildCache",
+    "Launch"
 };
 
 static const ICACHE_FLASH_ATTR char *stateName(LoadState state)
@@ -50,13 +79,31 @@ static int8_t ICACHE_FLASH_ATTR getIntArg(HttpdConnData *connData, char *name, i
   return 1;
 }
 
-// this is statically allocated because the serial read callback has no context parameter
-PropellerConnection myConnection;
+// load jobs run one at a time in the order they were requested
+// these are statically allocated because the serial read callback has no context parameter
+static PropellerConnection jobs[LOAD_QUEUE_SIZE];
+static PropellerConnection *jobQueue[LOAD_QUEUE_SIZE];
+static int jobCount;
+
+// state timing for recent loads
+static LoadStats recentLoads[LOAD_STATS_SIZE];
+static int recentLoadsNext;
+static int recentLoadsCount;
+
+/* the order here must match the definition of JobType in proploader.h */
+static const char * ICACHE_RODATA_ATTR jobTypeNames[] = {
+    "load",
+    "load-file",
+    "reset"
+};
 
 int ICACHE_FLASH_ATTR cgiPropInit()
 {
-    memset(&myConnection, 0, sizeof(PropellerConnection));
-    myConnection.state = stIdle;
+    int i;
+    memset(jobs, 0, sizeof(jobs));
+    for (i = 0; i < LOAD_QUEUE_SIZE; ++i)
+        jobs[i].state = stIdle;
+    jobCount = 0;
     resetButtonState = 1;
     resetButtonCount = 0;
     gpio_output_set(0, 0, 0, 1 << RESET_BUTTON_PIN);
@@ -70,6 +117,10 @@ int ICACHE_FLASH_ATTR cgiPropInit()
     }
     os_printf("Flash filesystem mounted!\n");
 
+    // reclaim the space used by deleted files a little at a time in the background
+    os_timer_setfn(&compactTimer, compactTimerCallback, 0);
+    os_timer_arm(&compactTimer, COMPACT_INTERVAL, 1);
+
     return 1;
 }
 
@@ -99,33 +150,42 @@ int ICACHE_FLASH_ATTR cgiPropSetBaudRate(HttpdConnData *connData)
 
 int ICACHE_FLASH_ATTR cgiPropLoad(HttpdConnData *connData)
 {
-    PropellerConnection *connection = &myConnection;
+    PropellerConnection *connection;
+    PropellerImage image;
     
     // check for the cleanup call
-    if (connData->conn == NULL)
+    if (connData->conn == NULL) {
+        // the image is lost if the connection goes away before the load finishes
+        if ((connection = findJob(connData)) != NULL)
+            cancelJob(connection);
         return HTTPD_CGI_DONE;
+    }
 
-    if (connection->state != stIdle) {
-        char buf[128];
-        os_sprintf(buf, "Transfer already in progress: state %s\r\n", stateName(connection->state));
-        errorResponse(connData, 400, buf);
-        return HTTPD_CGI_DONE;
+    // the previous part of the program response has been sent
+    if ((connection = findJob(connData)) != NULL && connection->state == stStartAck)
+        return sendResponseData(connection);
+
+    // additional chunks of a streamed image
+    if (connData->post->received > connData->post->buffLen) {
+        if (!(connection = findJob(connData)) || !connection->streamBuffer)
+            return HTTPD_CGI_DONE;
+        if (ploadWriteStream(connection, (uint8_t *)connData->post->buff, connData->post->buffLen) != 0) {
+            errorResponse(connData, 400, "Stream buffer overflow\r\n");
+            cancelJob(connection);
+            return HTTPD_CGI_DONE;
+        }
+        updateReceiveHold(connection);
+        return HTTPD_CGI_MORE;
     }
-    connData->cgiPrivData = connection;
-    connection->connData = connData;
 
-    os_timer_setfn(&connection->timer, timerCallback, connection);
-    
     if (connData->post->len == 0) {
         errorResponse(connData, 400, "No data\r\n");
-        abortLoading(connection);
         return HTTPD_CGI_DONE;
     }
-    else if (connData->post->buffLen != connData->post->len) {
-        errorResponse(connData, 400, "Data too large\r\n");
+
+    if (!(connection = newJob(connData, jtLoad)))
         return HTTPD_CGI_DONE;
-    }
-    
+
     if (!getIntArg(connData, "baud-rate", &connection->baudRate))
         connection->baudRate = flashConfig.baud_rate;
     if (!getIntArg(connData, "final-baud-rate", &connection->finalBaudRate))
@@ -136,53 +196,66 @@ int ICACHE_FLASH_ATTR cgiPropLoad(HttpdConnData *connData)
         connection->responseSize = 0;
     if (!getIntArg(connData, "response-timeout", &connection->responseTimeout))
         connection->responseTimeout = 1000;
+    if (!getIntArg(connData, "dense-encoding", &connection->denseEncoding))
+        connection->denseEncoding = 0;
     
-    DBG("load: size %d, baud-rate %d, final-baud-rate %d, reset-pin %d\n", connData->post->buffLen, connection->baudRate, connection->finalBaudRate, connection->resetPin);
-    if (connection->responseSize > 0)
+    DBG("load: size %d, baud-rate %d, final-baud-rate %d, reset-pin %d\n", connData->post->len, connection->baudRate, connection->finalBaudRate, connection->resetPin);
+    if (connection->responseSize != 0)
         DBG("  responseSize %d, responseTimeout %d\n", connection->responseSize, connection->responseTimeout);
 
-    connection->file = NULL;
-    startLoading(connection, (uint8_t *)connData->post->buff, connData->post->buffLen);
+    // images that don't fit in a single POST buffer are encoded as the rest of the body arrives
+    if (connData->post->buffLen != connData->post->len) {
+        if (ploadInitStream(connection) != 0) {
+            errorResponse(connData, 400, "Insufficient memory\r\n");
+            connection->state = stIdle;
+            return HTTPD_CGI_DONE;
+        }
+        ploadWriteStream(connection, (uint8_t *)connData->post->buff, connData->post->buffLen);
+        updateReceiveHold(connection);
+        connection->imageSize = connData->post->len;
+    }
+
+    // only the program region of a Spin image in memory needs to be loaded
+    else {
+        pimageSetImage(&image, (uint8_t *)connData->post->buff, connData->post->len);
+        connection->image = image.imageData;
+        connection->imageSize = pimageLoadSize(&image);
+    }
+
+    queueJob(connection);
 
     return HTTPD_CGI_MORE;
 }
 
 int ICACHE_FLASH_ATTR cgiPropLoadFile(HttpdConnData *connData)
 {
-    PropellerConnection *connection = &myConnection;
-    char fileName[128];
-    int fileSize = 0;
+    PropellerConnection *connection;
+    int force;
     
     // check for the cleanup call
     if (connData->conn == NULL) {
-        if (connection->file) {
-            roffs_close(connection->file);
-            connection->file = NULL;
-        }
+        if ((connection = findJob(connData)) != NULL)
+            cancelJob(connection);
         return HTTPD_CGI_DONE;
     }
 
-    if (connection->state != stIdle) {
-        char buf[128];
-        os_sprintf(buf, "Transfer already in progress: state %s\r\n", stateName(connection->state));
-        errorResponse(connData, 400, buf);
+    if (!(connection = newJob(connData, jtLoadFile)))
         return HTTPD_CGI_DONE;
-    }
-    connData->cgiPrivData = connection;
-    connection->connData = connData;
-    
-    os_timer_setfn(&connection->timer, timerCallback, connection);
-    
-    if (!getStringArg(connData, "file", fileName, sizeof(fileName))) {
+
+    if (!getStringArg(connData, "file", connection->fileName, sizeof(connection->fileName))) {
         errorResponse(connData, 400, "Missing file argument\r\n");
+        connection->state = stIdle;
         return HTTPD_CGI_DONE;
     }
 
-    if (!(connection->file = roffs_open(fileName))) {
-        errorResponse(connData, 400, "File not found\r\n");
+    if (!(connection->file = roffs_open(connection->fileName))) {
+        if (roffs_busy())
+            errorResponse(connData, 503, "Filesystem busy\r\n");
+        else
+            errorResponse(connData, 400, "File not found\r\n");
+        connection->state = stIdle;
         return HTTPD_CGI_DONE;
     }
-    fileSize = roffs_file_size(connection->file);
 
     if (!getIntArg(connData, "baud-rate", &connection->baudRate))
         connection->baudRate = flashConfig.baud_rate;
@@ -190,72 +263,498 @@ int ICACHE_FLASH_ATTR cgiPropLoadFile(HttpdConnData *connData)
         connection->finalBaudRate = connection->baudRate;
     if (!getIntArg(connData, "reset-pin", &connection->resetPin))
         connection->resetPin = flashConfig.reset_pin;
+    if (!getIntArg(connData, "dense-encoding", &connection->denseEncoding))
+        connection->denseEncoding = 0;
+    if (!getIntArg(connData, "use-cache", &connection->useCache))
+        connection->useCache = 0;
+
+    // a cached download stream goes through the ROM loader so the calibrated loader baud rate
+    // only applies when the cache isn't requested
+    if (!getIntArg(connData, "loader-baud-rate", &connection->loaderBaudRate))
+        connection->loaderBaudRate = connection->useCache ? 0 : flashConfig.loader_baud_rate;
+    else if (connection->useCache && connection->loaderBaudRate > 0) {
+        errorResponse(connData, 400, "Can't use both use-cache and loader-baud-rate\r\n");
+        roffs_close(connection->file);
+        connection->file = NULL;
+        connection->state = stIdle;
+        return HTTPD_CGI_DONE;
+    }
+    else if (connection->loaderBaudRate != 0
+         && (connection->loaderBaudRate < LOADER_BAUD_RATE_MIN || connection->loaderBaudRate > LOADER_BAUD_RATE_MAX)) {
+        errorResponse(connData, 400, "Invalid loader-baud-rate\r\n");
+        roffs_close(connection->file);
+        connection->file = NULL;
+        connection->state = stIdle;
+        return HTTPD_CGI_DONE;
+    }
+    if (!getIntArg(connData, "skip-if-current", &connection->skipIfCurrent))
+        connection->skipIfCurrent = 0;
+    if (getIntArg(connData, "force", &force) && force)
+        connection->skipIfCurrent = 0;
     
-    DBG("load-file: file %s, size %d, baud-rate %d, final-baud-rate %d, reset-pin %d\n", fileName, fileSize, connection->baudRate, connection->finalBaudRate, connection->resetPin);
+    DBG("load-file: file %s, size %d, baud-rate %d, final-baud-rate %d, reset-pin %d\n", connection->fileName, roffs_file_size(connection->file), connection->baudRate, connection->finalBaudRate, connection->resetPin);
 
-    startLoading(connection, NULL, fileSize);
+    queueJob(connection);
 
     return HTTPD_CGI_MORE;
 }
 
 int ICACHE_FLASH_ATTR cgiPropReset(HttpdConnData *connData)
 {
-    PropellerConnection *connection = &myConnection;
+    PropellerConnection *connection;
     
     // check for the cleanup call
-    if (connData->conn == NULL)
+    if (connData->conn == NULL) {
+        if ((connection = findJob(connData)) != NULL)
+            cancelJob(connection);
         return HTTPD_CGI_DONE;
+    }
 
-    if (connection->state != stIdle) {
-        char buf[128];
-        os_sprintf(buf, "Transfer already in progress: state %s\r\n", stateName(connection->state));
-        errorResponse(connData, 400, buf);
+    if (!(connection = newJob(connData, jtReset)))
         return HTTPD_CGI_DONE;
-    }
-    connData->cgiPrivData = connection;
-    connection->connData = connData;
 
-    os_timer_setfn(&connection->timer, timerCallback, connection);
-    
     if (!getIntArg(connData, "reset-pin", &connection->resetPin))
         connection->resetPin = flashConfig.reset_pin;
 
     DBG("reset: reset-pin %d\n", connection->resetPin);
 
-    connection->image = NULL;
+    queueJob(connection);
 
-    GPIO_OUTPUT_SET(connection->resetPin, 0);
-    connection->state = stReset;
+    return HTTPD_CGI_MORE;
+}
+
+// get or set the content hash of the image last loaded on a reset pin
+int ICACHE_FLASH_ATTR cgiPropImageHash(HttpdConnData *connData)
+{
+    char buf[16], *p;
+    int resetPin, len;
+    uint32_t hash;
     
-    armTimer(connection, RESET_DELAY_1);
+    // check for the cleanup call
+    if (connData->conn == NULL)
+        return HTTPD_CGI_DONE;
+
+    if (!getIntArg(connData, "reset-pin", &resetPin))
+        resetPin = flashConfig.reset_pin;
+
+    // record the hash of an image loaded by the client
+    if ((len = httpdFindArg(connData->getArgs, "hash", buf, sizeof(buf))) >= 0) {
+        if (len == 0 || len > 8) {
+            errorResponse(connData, 400, "Invalid hash\r\n");
+            return HTTPD_CGI_DONE;
+        }
+        for (hash = 0, p = buf; p < &buf[len]; ++p) {
+            int digit = *p >= '0' && *p <= '9' ? *p - '0' : *p >= 'a' && *p <= 'f' ? *p - 'a' + 10 : *p >= 'A' && *p <= 'F' ? *p - 'A' + 10 : -1;
+            if (digit < 0) {
+                errorResponse(connData, 400, "Invalid hash\r\n");
+                return HTTPD_CGI_DONE;
+            }
+            hash = (hash << 4) | digit;
+        }
+        DBG("image-hash: reset-pin %d, hash %08lx\n", resetPin, (unsigned long)hash);
+        ploadSetLoadedImage(resetPin, hash);
+        len = 0;
+    }
+
+    else if (ploadLoadedImage(resetPin, &hash))
+        len = os_sprintf(buf, "%08lx\r\n", (unsigned long)hash);
+
+    else {
+        errorResponse(connData, 404, "No image loaded\r\n");
+        return HTTPD_CGI_DONE;
+    }
+
+    noCacheHeaders(connData, 200);
+    httpdEndHeaders(connData);
+    httpdSend(connData, buf, len);
+
+    return HTTPD_CGI_DONE;
+}
+
+// get or set the second-stage loader baud rate found by calibrating the module with its Propeller
+int ICACHE_FLASH_ATTR cgiPropLoaderBaudRate(HttpdConnData *connData)
+{
+    char buf[16];
+    int baudRate, len;
+    
+    // check for the cleanup call
+    if (connData->conn == NULL)
+        return HTTPD_CGI_DONE;
+
+    if (getIntArg(connData, "baud-rate", &baudRate)) {
+        // zero goes back to loading through the ROM loader only
+        if (baudRate != 0 && (baudRate < LOADER_BAUD_RATE_MIN || baudRate > LOADER_BAUD_RATE_MAX)) {
+            errorResponse(connData, 400, "Invalid baud-rate\r\n");
+            return HTTPD_CGI_DONE;
+        }
+        DBG("loader-baud-rate: %d\n", baudRate);
+        flashConfig.loader_baud_rate = baudRate;
+        if (!configSave()) {
+            errorResponse(connData, 500, "Failed to save config\r\n");
+            return HTTPD_CGI_DONE;
+        }
+        len = 0;
+    }
+
+    else
+        len = os_sprintf(buf, "%d\r\n", (int)flashConfig.loader_baud_rate);
+
+    noCacheHeaders(connData, 200);
+    httpdEndHeaders(connData);
+    httpdSend(connData, buf, len);
+
+    return HTTPD_CGI_DONE;
+}
+
+int ICACHE_FLASH_ATTR cgiPropStatus(HttpdConnData *connData)
+{
+    char buf[128 + LOAD_QUEUE_SIZE * 128];
+    int len, i;
+    
+    // check for the cleanup call
+    if (connData->conn == NULL)
+        return HTTPD_CGI_DONE;
+
+    len = os_sprintf(buf, "{\"queue-size\":%d,\"jobs\":[", LOAD_QUEUE_SIZE);
+    for (i = 0; i < jobCount; ++i) {
+        PropellerConnection *connection = jobQueue[i];
+        esp_tcp *tcp = connection->connData->conn->proto.tcp;
+        len += os_sprintf(&buf[len], "%s{\"position\":%d,\"request\":\"%s\",\"state\":\"%s\",\"reset-pin\":%d,\"remote\":\"%d.%d.%d.%d:%d\"}",
+                i > 0 ? "," : "", i, jobTypeNames[connection->jobType], stateName(connection->state), connection->resetPin,
+                tcp->remote_ip[0], tcp->remote_ip[1], tcp->remote_ip[2], tcp->remote_ip[3], tcp->remote_port);
+    }
+    len += os_sprintf(&buf[len], "]}");
+
+    jsonHeader(connData, 200);
+    httpdSend(connData, buf, len);
+
+    return HTTPD_CGI_DONE;
+}
+
+// send the state timing of recent loads with min/avg/max for each state
+// one recent load is sent each time the cgi is called
+int ICACHE_FLASH_ATTR cgiPropStats(HttpdConnData *connData)
+{
+    int index = (int)connData->cgiData;
+    char buf[512];
+    int len, state;
+
+    // check for the cleanup call
+    if (connData->conn == NULL)
+        return HTTPD_CGI_DONE;
+
+    // send the summary on the first call
+    if (index == 0) {
+        const char *separator = "";
+        jsonHeader(connData, 200);
+        len = os_sprintf(buf, "{\"loads\":%d,\"states\":{", recentLoadsCount);
+        httpdSend(connData, buf, len);
+        for (state = stQueued; state < stMAX; ++state) {
+            if ((len = statsStateJSON(buf, state, separator)) > 0) {
+                httpdSend(connData, buf, len);
+                separator = ",";
+            }
+        }
+        len = os_sprintf(buf, "},\"recent\":[");
+    }
+
+    // send the recent loads, newest first
+    else if (index <= recentLoadsCount) {
+        int i = (recentLoadsNext - index + LOAD_STATS_SIZE) % LOAD_STATS_SIZE;
+        len = os_sprintf(buf, "%s", index > 1 ? "," : "");
+        len += statsLoadJSON(&buf[len], &recentLoads[i]);
+    }
+
+    else {
+        httpdSend(connData, "]}", -1);
+        return HTTPD_CGI_DONE;
+    }
+
+    httpdSend(connData, buf, len);
+    connData->cgiData = (void *)(index + 1);
 
     return HTTPD_CGI_MORE;
 }
 
+// allocate a job for a request or send an error response if the queue is full
+static PropellerConnection ICACHE_FLASH_ATTR *newJob(HttpdConnData *connData, JobType jobType)
+{
+    PropellerConnection *connection;
+    int i;
+
+    for (i = 0; i < LOAD_QUEUE_SIZE; ++i) {
+        connection = &jobs[i];
+        if (connection->state == stIdle) {
+            os_memset(connection, 0, sizeof(PropellerConnection));
+            connection->jobType = jobType;
+            connection->state = stQueued;
+            connection->stateStart = system_get_time();
+            connection->stats.jobType = jobType;
+            connection->connData = connData;
+            connData->cgiPrivData = connection;
+            os_timer_setfn(&connection->timer, timerCallback, connection);
+            return connection;
+        }
+    }
+
+    errorResponse(connData, 400, "Load queue full\r\n");
+    return NULL;
+}
+
+static PropellerConnection ICACHE_FLASH_ATTR *findJob(HttpdConnData *connData)
+{
+    int i;
+    for (i = 0; i < jobCount; ++i) {
+        if (jobQueue[i]->connData == connData)
+            return jobQueue[i];
+    }
+    return NULL;
+}
+
+// add a job to the end of the queue and start it if nothing else is running
+static void ICACHE_FLASH_ATTR queueJob(PropellerConnection *connection)
+{
+    jobQueue[jobCount++] = connection;
+    DBG("queued %s: position %d\n", jobTypeNames[connection->jobType], jobCount - 1);
+    if (jobCount == 1)
+        startJob(connection);
+}
+
+// start the job at the head of the queue
+// a job that fails to start sends its error response and the next job is started
+static void ICACHE_FLASH_ATTR startJob(PropellerConnection *connection)
+{
+    int loadSize, finished, result;
+    uint32_t hash;
+
+    switch (connection->jobType) {
+    case jtLoad:
+        startLoading(connection, connection->image, connection->imageSize);
+        break;
+
+    case jtLoadFile:
+        // the content hash is only needed to skip a current image or to find its cached download stream
+        if (connection->skipIfCurrent || connection->useCache)
+            connection->imageHashValid = ploadFileHash(connection->fileName, &connection->imageHash) == 0;
+
+        // skip the load if the Propeller is already running this image
+        if (connection->skipIfCurrent && connection->imageHashValid
+        &&  ploadLoadedImage(connection->resetPin, &hash) && hash == connection->imageHash) {
+            DBG("  image is current\n");
+            httpdSendImageCurrentResponse(connection->connData);
+            connection->stats.succeeded = 1;
+            finishJob(connection);
+            break;
+        }
+
+        // only the program region of a Spin image needs to be loaded
+        loadSize = ploadFileLoadSize(connection->file);
+        roffs_close(connection->file);
+        if (loadSize < 0 || !(connection->file = roffs_open(connection->fileName))) {
+            connection->file = NULL;
+            httpdSendResponse(connection->connData, 400, "Error reading file\r\n", -1);
+            abortLoading(connection);
+            break;
+        }
+        connection->loadSize = loadSize;
+        DBG("  load size %d\n", loadSize);
+
+        // use the second-stage loader if a loader baud rate was given
+        if (connection->loaderBaudRate > 0) {
+            DBG("  loader-baud-rate %d\n", connection->loaderBaudRate);
+            if (ploadInitFastLoader(connection, loadSize) != 0) {
+                httpdSendResponse(connection->connData, 400, "Insufficient memory\r\n", -1);
+                abortLoading(connection);
+                break;
+            }
+            startLoading(connection, connection->image, connection->imageSize);
+        }
+
+        // load from the cached download stream for this image, building it first if necessary
+        else if (connection->useCache) {
+            if (!connection->imageHashValid) {
+                httpdSendResponse(connection->connData, 400, "Error reading file\r\n", -1);
+                abortLoading(connection);
+                break;
+            }
+            ploadCacheName(connection->imageHash, loadSize, ltDownloadAndRun, connection->denseEncoding, connection->cacheName);
+            roffs_close(connection->file);
+            if ((connection->file = roffs_open(connection->cacheName)) != NULL) {
+                DBG("  using cache %s\n", connection->cacheName);
+                connection->cachedImageSize = loadSize;
+                startLoading(connection, NULL, roffs_file_size(connection->file));
+            }
+            else if (!(connection->file = roffs_open(connection->fileName))) {
+                httpdSendResponse(connection->connData, 400, "File not found\r\n", -1);
+                abortLoading(connection);
+            }
+            else {
+                DBG("  building cache %s\n", connection->cacheName);
+                connection->image = NULL;
+                connection->imageSize = loadSize;
+                if ((result = ploadInitCacheBuild(connection, ltDownloadAndRun, &finished)) < 0) {
+                    httpdSendResponse(connection->connData, 400, "Error building cache\r\n", -1);
+                    abortLoading(connection);
+                    break;
+                }
+
+                // load straight from the file if the cache can't be built now
+                if (result > 0) {
+                    DBG("  loading without cache\n");
+                    startLoading(connection, NULL, loadSize);
+                    break;
+                }
+                armTimer(connection, CACHE_BUILD_DELAY);
+                setState(connection, stBuildCache);
+            }
+        }
+
+        else
+            startLoading(connection, NULL, loadSize);
+        break;
+
+    case jtReset:
+        connection->image = NULL;
+        ploadForgetLoadedImage(connection->resetPin);
+        GPIO_OUTPUT_SET(connection->resetPin, 0);
+        setState(connection, stReset);
+        armTimer(connection, RESET_DELAY_1);
+        break;
+    }
+}
+
+// remove a finished job from the queue and start the next one right away
+static void ICACHE_FLASH_ATTR finishJob(PropellerConnection *connection)
+{
+    int i, j;
+
+    if (connection->file) {
+        roffs_close(connection->file);
+        connection->file = NULL;
+    }
+    if (jobCount > 0 && jobQueue[0] == connection)
+        programmingCB = NULL;
+    setState(connection, stIdle);
+    recordStats(connection);
+
+    for (i = j = 0; i < jobCount; ++i) {
+        if (jobQueue[i] != connection)
+            jobQueue[j++] = jobQueue[i];
+    }
+    jobCount = j;
+
+    if (jobCount > 0 && jobQueue[0]->state == stQueued)
+        startJob(jobQueue[0]);
+}
+
+// change state and record the time spent in the previous state
+static void ICACHE_FLASH_ATTR setState(PropellerConnection *connection, LoadState state)
+{
+    uint32_t now = system_get_time();
+    if (state != connection->state) {
+        connection->stats.stateTime[connection->state] += now - connection->stateStart;
+        connection->stats.statesEntered |= 1 << connection->state;
+        connection->stateStart = now;
+        connection->state = state;
+    }
+}
+
+// add the state timing of a finished job to the recent loads
+static void ICACHE_FLASH_ATTR recordStats(PropellerConnection *connection)
+{
+    recentLoads[recentLoadsNext] = connection->stats;
+    recentLoadsNext = (recentLoadsNext + 1) % LOAD_STATS_SIZE;
+    if (recentLoadsCount < LOAD_STATS_SIZE)
+        ++recentLoadsCount;
+}
+
+// format min/avg/max for a state over the recent loads that entered it
+static int ICACHE_FLASH_ATTR statsStateJSON(char *buf, LoadState state, const char *separator)
+{
+    uint32_t min = 0, max = 0, total = 0;
+    int cnt = 0, i;
+
+    for (i = 0; i < recentLoadsCount; ++i) {
+        LoadStats *stats = &recentLoads[i];
+        if (stats->statesEntered & (1 << state)) {
+            uint32_t t = stats->stateTime[state];
+            if (cnt == 0 || t < min)
+                min = t;
+            if (t > max)
+                max = t;
+            total += t;
+            ++cnt;
+        }
+    }
+
+    if (cnt == 0)
+        return 0;
+
+    return os_sprintf(buf, "%s\"%s\":{\"count\":%d,\"min\":%lu,\"avg\":%lu,\"max\":%lu}",
+                      separator, stateName(state), cnt, (unsigned long)min, (unsigned long)(total / cnt), (unsigned long)max);
+}
+
+// format the state timing of a single load
+static int ICACHE_FLASH_ATTR statsLoadJSON(char *buf, LoadStats *stats)
+{
+    uint32_t total = 0;
+    int len, state;
+
+    len = os_sprintf(buf, "{\"request\":\"%s\",\"success\":%s,\"states\":{",
+                     jobTypeNames[stats->jobType], stats->succeeded ? "true" : "false");
+    for (state = stQueued; state < stMAX; ++state) {
+        if (stats->statesEntered & (1 << state)) {
+            len += os_sprintf(&buf[len], "%s\"%s\":%lu", buf[len - 1] == '{' ? "" : ",", stateName(state), (unsigned long)stats->stateTime[state]);
+            total += stats->stateTime[state];
+        }
+    }
+    len += os_sprintf(&buf[len], "},\"total\":%lu}", (unsigned long)total);
+
+    return len;
+}
+
+// cancel a job whose connection has gone away
+static void ICACHE_FLASH_ATTR cancelJob(PropellerConnection *connection)
+{
+    os_timer_disarm(&connection->timer);
+    abortLoading(connection);
+}
+
 static void ICACHE_FLASH_ATTR startLoading(PropellerConnection *connection, const uint8_t *image, int imageSize)
 {
     connection->image = image;
     connection->imageSize = imageSize;
     
     uart0_baud(connection->baudRate);
+    connection->uartBaudRate = connection->baudRate;
 
+    ploadForgetLoadedImage(connection->resetPin);
     GPIO_OUTPUT_SET(connection->resetPin, 0);
     armTimer(connection, RESET_DELAY_1);
-    connection->state = stReset;
+    setState(connection, stReset);
 }
 
 static void ICACHE_FLASH_ATTR finishLoading(PropellerConnection *connection)
 {
-    if (connection->finalBaudRate != connection->baudRate);
+    if (connection->finalBaudRate != connection->uartBaudRate)
         uart0_baud(connection->finalBaudRate);
-    programmingCB = NULL;
-    myConnection.state = stIdle;
+    if (connection->imageHashValid)
+        ploadSetLoadedImage(connection->resetPin, connection->imageHash);
+    connection->stats.succeeded = 1;
+    abortLoading(connection);
 }
 
 static void ICACHE_FLASH_ATTR abortLoading(PropellerConnection *connection)
 {
-    programmingCB = NULL;
-    myConnection.state = stIdle;
+    if (connection->responseBuffer) {
+        os_free(connection->responseBuffer);
+        connection->responseBuffer = NULL;
+    }
+    ploadFreeLoadBuffers(connection);
+    ploadFreeFastLoader(connection);
+    ploadFreeCacheBuild(connection);
+    updateReceiveHold(connection);
+    finishJob(connection);
 }
 
 #define MAX_SENDBUFF_LEN 2600
@@ -267,8 +766,43 @@ static void ICACHE_FLASH_ATTR httpdSendResponse(HttpdConnData *connData, int cod
     httpdStartResponse(connData, code);
     httpdEndHeaders(connData);
     httpdSend(connData, message, len);
+    connData->cgi = NULL;
+    httpdFlush(connData);
+}
+
+// tell the client that the Propeller is already running the image
+static void ICACHE_FLASH_ATTR httpdSendImageCurrentResponse(HttpdConnData *connData)
+{
+    char sendBuff[256];
+    httpdSetOutputBuffer(connData, sendBuff, sizeof(sendBuff));
+    httpdStartResponse(connData, 200);
+    httpdHeader(connData, "X-Image-Current", "1");
+    httpdEndHeaders(connData);
+    connData->cgi = NULL;
     httpdFlush(connData);
+}
+
+// send a successful load response including the transfer rate achieved
+static void ICACHE_FLASH_ATTR httpdSendLoadResponse(PropellerConnection *connection, char *message, int len)
+{
+    HttpdConnData *connData = connection->connData;
+    char sendBuff[MAX_SENDBUFF_LEN];
+    char rate[16];
+    os_sprintf(rate, "%d", connection->bytesPerSecond);
+    httpdSetOutputBuffer(connData, sendBuff, sizeof(sendBuff));
+    httpdStartResponse(connData, 200);
+    httpdHeader(connData, "X-Bytes-Per-Second", rate);
+    httpdEndHeaders(connData);
+    httpdSend(connData, message, len);
     connData->cgi = NULL;
+    httpdFlush(connData);
+}
+
+// flash erases stall the CPU long enough to break the timing of a load so compaction waits for loads to finish
+static void ICACHE_FLASH_ATTR compactTimerCallback(void *data)
+{
+    if (jobCount == 0)
+        roffs_compact();
 }
 
 static void ICACHE_FLASH_ATTR resetButtonTimerCallback(void *data)
@@ -302,12 +836,151 @@ static void ICACHE_FLASH_ATTR resetButtonTimerCallback(void *data)
     previousState = newState;
 }
 
+// buffer response bytes from the program and start sending them if the connection is idle
+// the response ends when responseSize bytes have been received or when it goes idle
+static void ICACHE_FLASH_ATTR captureResponse(PropellerConnection *connection, char *buf, short length)
+{
+    int cnt, room;
+
+    if (connection->responseRemaining == 0)
+        return;
+
+    if (connection->responseRemaining > 0 && length > connection->responseRemaining)
+        length = connection->responseRemaining;
+    if ((cnt = length) > (room = connection->responseBufferSize - connection->responseCount)) {
+        growResponseBuffer(connection, connection->responseCount + cnt);
+        if (cnt > (room = connection->responseBufferSize - connection->responseCount)) {
+            DBG("Response buffer overflow, %d bytes lost\n", cnt - room);
+            connection->responseLost += cnt - room;
+            cnt = room;
+        }
+    }
+    os_memcpy(&connection->responseBuffer[connection->responseCount], buf, cnt);
+    connection->responseCount += cnt;
+
+    if (connection->responseRemaining > 0)
+        connection->responseRemaining -= length;
+    if (connection->responseRemaining != 0)
+        armTimer(connection, connection->responseTimeout);
+
+    if (!connection->responseSending)
+        sendResponse(connection);
+}
+
+// double the response buffer until it holds size bytes or reaches its limit
+// the buffer stays the same size if there isn't enough memory to grow it
+static void ICACHE_FLASH_ATTR growResponseBuffer(PropellerConnection *connection, int size)
+{
+    int newSize = connection->responseBufferSize;
+    char *newBuffer;
+
+    while (newSize < size && newSize < RESPONSE_BUFFER_MAX_SIZE)
+        newSize *= 2;
+    if (newSize > RESPONSE_BUFFER_MAX_SIZE)
+        newSize = RESPONSE_BUFFER_MAX_SIZE;
+    if (newSize == connection->responseBufferSize || !(newBuffer = (char *)os_malloc(newSize)))
+        return;
+
+    os_memcpy(newBuffer, connection->responseBuffer, connection->responseCount);
+    os_free(connection->responseBuffer);
+    connection->responseBuffer = newBuffer;
+    connection->responseBufferSize = newSize;
+}
+
+// send buffered response bytes outside of the httpd sent callback
+static void ICACHE_FLASH_ATTR sendResponse(PropellerConnection *connection)
+{
+    HttpdConnData *connData = connection->connData;
+    struct espconn *conn = connData->conn;
+    char sendBuff[MAX_SENDBUFF_LEN];
+
+    httpdSetOutputBuffer(connData, sendBuff, sizeof(sendBuff));
+    if (sendResponseData(connection) == HTTPD_CGI_DONE) {
+        connData->cgi = NULL;
+        // nothing left to send so there will be no sent callback to close the connection
+        if (!connection->responseSending) {
+            espconn_disconnect(conn);
+            return;
+        }
+    }
+    httpdFlush(connData);
+}
+
+// add the headers and any buffered response bytes to the httpd output buffer
+// the job is finished once the capture is complete and the last of the response is queued
+static int ICACHE_FLASH_ATTR sendResponseData(PropellerConnection *connection)
+{
+    HttpdConnData *connData = connection->connData;
+    char rate[16], lost[48];
+    int cnt;
+
+    connection->responseSending = 0;
+
+    if (!connection->responseStarted) {
+        os_sprintf(rate, "%d", connection->bytesPerSecond);
+        httpdStartResponse(connData, 200);
+        httpdHeader(connData, "X-Bytes-Per-Second", rate);
+        httpdEndHeaders(connData);
+        connection->responseStarted = 1;
+        connection->responseSending = 1;
+    }
+
+    // the rest of the buffer goes out in the next sent callback
+    if (connection->responseCount > 0) {
+        if ((cnt = connection->responseCount) > RESPONSE_SEND_MAX_SIZE)
+            cnt = RESPONSE_SEND_MAX_SIZE;
+        httpdSend(connData, connection->responseBuffer, cnt);
+        os_memmove(connection->responseBuffer, &connection->responseBuffer[cnt], connection->responseCount - cnt);
+        connection->responseCount -= cnt;
+        connection->responseSending = 1;
+    }
+
+    if (connection->responseRemaining == 0 && connection->responseCount == 0) {
+        // the headers are long gone so the client is told about dropped bytes at the end of the response
+        if (connection->responseLost > 0) {
+            os_sprintf(lost, "\r\n[%d response bytes lost]\r\n", connection->responseLost);
+            httpdSend(connData, lost, -1);
+            connection->responseSending = 1;
+        }
+        os_timer_disarm(&connection->timer);
+        finishLoading(connection);
+        return HTTPD_CGI_DONE;
+    }
+
+    return HTTPD_CGI_MORE;
+}
+
 static void ICACHE_FLASH_ATTR armTimer(PropellerConnection *connection, int delay)
 {
     os_timer_disarm(&connection->timer);
     os_timer_arm(&connection->timer, delay, 0);
 }
 
+static void ICACHE_FLASH_ATTR awaitPacketAck(PropellerConnection *connection, LoadState state)
+{
+    connection->bytesReceived = 0;
+    connection->bytesRemaining = 2 * sizeof(uint32_t);
+    connection->retriesRemaining = PACKET_RETRIES;
+    armTimer(connection, PACKET_ACK_TIMEOUT);
+    setState(connection, state);
+}
+
+// hold TCP receive while the stream buffer is too full to accept another chunk of the request body
+static void ICACHE_FLASH_ATTR updateReceiveHold(PropellerConnection *connection)
+{
+    int hold = connection->streamBuffer && ploadStreamRoom(connection) < LOAD_STREAM_HOLD_ROOM;
+    if (hold != connection->receiveHeld) {
+        struct espconn *conn = connection->connData->conn;
+        if (conn) {
+            if (hold)
+                espconn_recv_hold(conn);
+            else
+                espconn_recv_unhold(conn);
+        }
+        connection->receiveHeld = hold;
+    }
+}
+
 static void ICACHE_FLASH_ATTR timerCallback(void *data)
 {
     PropellerConnection *connection = (PropellerConnection *)data;
@@ -319,22 +992,24 @@ static void ICACHE_FLASH_ATTR timerCallback(void *data)
 
     switch (connection->state) {
     case stIdle:
+    case stQueued:
         // shouldn't happen
         break;
     case stReset:
         GPIO_OUTPUT_SET(connection->resetPin, 1);
         armTimer(connection, RESET_DELAY_2);
-        if (connection->image || connection->file) {
-            connection->state = stTxHandshake;
+        if (connection->image || connection->file || connection->streamBuffer) {
+            setState(connection, stTxHandshake);
             programmingCB = readCallback;
         }
         else {
             httpdSendResponse(connection->connData, 200, "", -1);
-            connection->state = stIdle;
+            connection->stats.succeeded = 1;
+            finishJob(connection);
         }
         break;
     case stTxHandshake:
-        connection->state = stRxHandshakeStart;
+        setState(connection, stRxHandshakeStart);
         ploadInitiateHandshake(connection);
         armTimer(connection, RX_HANDSHAKE_TIMEOUT);
         break;
@@ -346,20 +1021,29 @@ static void ICACHE_FLASH_ATTR timerCallback(void *data)
     case stLoadContinue:
         if (ploadLoadImageContinue(connection, ltDownloadAndRun, &finished) == 0) {
             if (finished) {
-                armTimer(connection, connection->retryDelay);
-                connection->state = stVerifyChecksum;
+                armTimer(connection, ploadDrainDelay(connection));
+                setState(connection, stVerifyChecksum);
             }
             else {
-                armTimer(connection, LOAD_SEGMENT_DELAY);
-                connection->state = stLoadContinue;
+                armTimer(connection, ploadLoadDelay(connection));
+                setState(connection, stLoadContinue);
             }
+            updateReceiveHold(connection);
+        }
+        else {
+            httpdSendResponse(connection->connData, 400, "Load image failed\r\n", -1);
+            abortLoading(connection);
         }
         break;
     case stVerifyChecksum:
-        if (connection->retriesRemaining > 0) {
+        if (uart0_tx_fifo_count() > 0)
+            armTimer(connection, ploadDrainDelay(connection));
+        else if (connection->checksumTimeRemaining > 0) {
             uart_tx_one_char(UART0, 0xF9);
             armTimer(connection, connection->retryDelay);
-            --connection->retriesRemaining;
+            connection->checksumTimeRemaining -= connection->retryDelay;
+            if ((connection->retryDelay *= 2) > CHECKSUM_POLL_MAX_DELAY)
+                connection->retryDelay = CHECKSUM_POLL_MAX_DELAY;
         }
         else {
             httpdSendResponse(connection->connData, 400, "Checksum timeout\r\n", -1);
@@ -367,9 +1051,64 @@ static void ICACHE_FLASH_ATTR timerCallback(void *data)
         }
         break;
     case stStartAck:
-        httpdSendResponse(connection->connData, 400, "StartAck timeout\r\n", -1);
+        if (!connection->responseStarted) {
+            httpdSendResponse(connection->connData, 400, "StartAck timeout\r\n", -1);
+            abortLoading(connection);
+        }
+        else {
+            // the response has gone idle
+            connection->responseRemaining = 0;
+            if (!connection->responseSending)
+                sendResponse(connection);
+        }
+        break;
+    case stLoaderStart:
+        httpdSendResponse(connection->connData, 400, "Second-stage loader start timeout\r\n", -1);
         abortLoading(connection);
         break;
+    case stBuildCache:
+        if (connection->cacheFile && ploadCacheBuildContinue(connection, ltDownloadAndRun, &finished) != 0) {
+            httpdSendResponse(connection->connData, 400, "Error building cache\r\n", -1);
+            if (connection->file) {
+                roffs_close(connection->file);
+                connection->file = NULL;
+            }
+            abortLoading(connection);
+        }
+        else if (connection->cacheFile)
+            armTimer(connection, CACHE_BUILD_DELAY);
+        else if (!(connection->file = roffs_open(connection->cacheName))) {
+            httpdSendResponse(connection->connData, 400, "Error opening cache\r\n", -1);
+            abortLoading(connection);
+        }
+        else {
+            // the image size was recorded as the size of the transfer into the cache
+            connection->cachedImageSize = connection->transferSize;
+            startLoading(connection, NULL, roffs_file_size(connection->file));
+        }
+        break;
+    case stLaunch:
+        // the baud rate can't change until LaunchNow has been sent
+        if (uart0_tx_fifo_count() > 0)
+            armTimer(connection, ploadDrainDelay(connection));
+        else {
+            httpdSendLoadResponse(connection, "", -1);
+            finishLoading(connection);
+        }
+        break;
+    case stImagePacketAck:
+    case stVerifyRAMAck:
+    case stReadyToLaunchAck:
+        if (--connection->retriesRemaining > 0) {
+            connection->bytesReceived = 0;
+            ploadRetransmitPacket(connection);
+            armTimer(connection, PACKET_ACK_TIMEOUT);
+        }
+        else {
+            httpdSendResponse(connection->connData, 400, "Packet ack timeout\r\n", -1);
+            abortLoading(connection);
+        }
+        break;
     default:
         break;
     }
@@ -381,8 +1120,14 @@ static void ICACHE_FLASH_ATTR timerCallback(void *data)
 
 static void ICACHE_FLASH_ATTR readCallback(char *buf, short length)
 {
-    PropellerConnection *connection = &myConnection;
+    PropellerConnection *connection;
     int cnt, version, finished;
+    int32_t result;
+
+    // serial data belongs to the job at the head of the queue
+    if (jobCount == 0)
+        return;
+    connection = jobQueue[0];
     
 #ifdef STATE_DEBUG
     DBG("READ: length %d, state %s", length, stateName(connection->state));
@@ -390,15 +1135,21 @@ static void ICACHE_FLASH_ATTR readCallback(char *buf, short length)
 
     switch (connection->state) {
     case stIdle:
+    case stQueued:
     case stReset:
     case stTxHandshake:
     case stLoadContinue:
+    case stBuildCache:
+    case stLaunch:
         // just ignore data received when we're not expecting it
         break;
+    case stStartAck:
+        captureResponse(connection, buf, length);
+        break;
     case stRxHandshakeStart:    // skip junk before handshake
         while (length > 0) {
             if (*buf == 0xEE) {
-                connection->state = stRxHandshake;
+                setState(connection, stRxHandshake);
                 break;
             }
             DBG("Ignoring %02x looking for 0xEE\n", *buf);
@@ -407,9 +1158,13 @@ static void ICACHE_FLASH_ATTR readCallback(char *buf, short length)
         }
         if (connection->state == stRxHandshakeStart || length == 0)
             break;
+        // the handshake starts in this chunk so buffer it
         // fall through
     case stRxHandshake:
-    case stStartAck:
+    case stLoaderStart:
+    case stImagePacketAck:
+    case stVerifyRAMAck:
+    case stReadyToLaunchAck:
         if ((cnt = length) > connection->bytesRemaining)
             cnt = connection->bytesRemaining;
         memcpy(&connection->buffer[connection->bytesReceived], buf, cnt);
@@ -421,13 +1176,14 @@ static void ICACHE_FLASH_ATTR readCallback(char *buf, short length)
                 if (ploadVerifyHandshakeResponse(connection, &version) == 0) {
                     if (ploadLoadImage(connection, ltDownloadAndRun, &finished) == 0) {
                         if (finished) {
-                            armTimer(connection, connection->retryDelay);
-                            connection->state = stVerifyChecksum;
+                            armTimer(connection, ploadDrainDelay(connection));
+                            setState(connection, stVerifyChecksum);
                         }
                         else {
-                            armTimer(connection, LOAD_SEGMENT_DELAY);
-                            connection->state = stLoadContinue;
+                            armTimer(connection, ploadLoadDelay(connection));
+                            setState(connection, stLoadContinue);
                         }
+                        updateReceiveHold(connection);
                     }
                     else {
                         httpdSendResponse(connection->connData, 400, "Load image failed\r\n", -1);
@@ -439,9 +1195,77 @@ static void ICACHE_FLASH_ATTR readCallback(char *buf, short length)
                     abortLoading(connection);
                 }
                 break;
-            case stStartAck:
-                httpdSendResponse(connection->connData, 200, (char *)connection->buffer, connection->bytesReceived);
-                finishLoading(connection);
+            case stLoaderStart:
+                if (ploadVerifyLoaderStart(connection) != 0) {
+                    httpdSendResponse(connection->connData, 400, "Second-stage loader failed to start\r\n", -1);
+                    abortLoading(connection);
+                    break;
+                }
+                uart0_baud(connection->loaderBaudRate);
+                connection->uartBaudRate = connection->loaderBaudRate;
+                connection->imageSize = connection->loadSize;
+                ploadStartTransfer(connection, connection->imageSize);
+                // fall through
+            case stImagePacketAck:
+                if (connection->state == stImagePacketAck) {
+                    if (ploadVerifyPacketResponse(connection, &result) != 0) {
+                        connection->bytesReceived = 0;
+                        connection->bytesRemaining = 2 * sizeof(uint32_t);
+                        break;
+                    }
+                    if (result != connection->packetID - 1) {
+                        httpdSendResponse(connection->connData, 400, "Unexpected packet ack\r\n", -1);
+                        abortLoading(connection);
+                        break;
+                    }
+                    --connection->packetID;
+                }
+                if (connection->imageSize > 0) {
+                    if (ploadTransmitImagePacket(connection, &finished) != 0) {
+                        httpdSendResponse(connection->connData, 400, "Load image failed\r\n", -1);
+                        abortLoading(connection);
+                        break;
+                    }
+                    awaitPacketAck(connection, stImagePacketAck);
+                }
+                else {
+                    ploadEndTransfer(connection);
+                    roffs_close(connection->file);
+                    connection->file = NULL;
+                    ploadTransmitVerifyRAM(connection);
+                    awaitPacketAck(connection, stVerifyRAMAck);
+                }
+                break;
+            case stVerifyRAMAck:
+                if (ploadVerifyPacketResponse(connection, &result) != 0) {
+                    connection->bytesReceived = 0;
+                    connection->bytesRemaining = 2 * sizeof(uint32_t);
+                    break;
+                }
+                if (result != -connection->checksum) {
+                    httpdSendResponse(connection->connData, 400, "Checksum error\r\n", -1);
+                    abortLoading(connection);
+                    break;
+                }
+                connection->packetID = -connection->checksum;
+                ploadTransmitReadyToLaunch(connection);
+                awaitPacketAck(connection, stReadyToLaunchAck);
+                break;
+            case stReadyToLaunchAck:
+                if (ploadVerifyPacketResponse(connection, &result) != 0) {
+                    connection->bytesReceived = 0;
+                    connection->bytesRemaining = 2 * sizeof(uint32_t);
+                    break;
+                }
+                if (result != connection->packetID - 1) {
+                    httpdSendResponse(connection->connData, 400, "ReadyToLaunch failed\r\n", -1);
+                    abortLoading(connection);
+                    break;
+                }
+                --connection->packetID;
+                ploadTransmitLaunchNow(connection);
+                armTimer(connection, ploadDrainDelay(connection));
+                setState(connection, stLaunch);
                 break;
             default:
                 break;
@@ -450,13 +1274,25 @@ static void ICACHE_FLASH_ATTR readCallback(char *buf, short length)
         break;
     case stVerifyChecksum:
         if (buf[0] == 0xFE) {
-            if ((connection->bytesRemaining = connection->responseSize) > 0) {
+            if (connection->loaderBaudRate > 0) {
                 connection->bytesReceived = 0;
+                connection->bytesRemaining = 2 * sizeof(uint32_t);
+                armTimer(connection, LOADER_START_TIMEOUT);
+                setState(connection, stLoaderStart);
+            }
+            else if (connection->responseSize != 0) {
+                if (!(connection->responseBuffer = (char *)os_malloc(RESPONSE_BUFFER_SIZE))) {
+                    httpdSendResponse(connection->connData, 400, "Insufficient memory\r\n", -1);
+                    abortLoading(connection);
+                    break;
+                }
+                connection->responseBufferSize = RESPONSE_BUFFER_SIZE;
+                connection->responseRemaining = connection->responseSize;
                 armTimer(connection, connection->responseTimeout);
-                connection->state = stStartAck;
+                setState(connection, stStartAck);
             }
             else {
-                httpdSendResponse(connection->connData, 200, "", -1);
+                httpdSendLoadResponse(connection, "", -1);
                 finishLoading(connection);
             }
         }
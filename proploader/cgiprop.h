@@ -8,6 +8,10 @@ int cgiPropSetBaudRate(HttpdConnData *connData);
 int cgiPropLoad(HttpdConnData *connData);
 int cgiPropLoadFile(HttpdConnData *connData);
 int cgiPropReset(HttpdConnData *connData);
+int cgiPropStatus(HttpdConnData *connData);
+int cgiPropStats(HttpdConnData *connData);
+int cgiPropImageHash(HttpdConnData *connData);
+int cgiPropLoaderBaudRate(HttpdConnData *connData);
 
 #endif
 
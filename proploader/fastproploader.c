@@ -0,0 +1,188 @@
+#include <esp8266.h>
+#include "proploader.h"
+#include "propimage.h"
+#include "uart.h"
+
+#define CLOCK_SPEED         80000000    /* clock speed assumed by the second-stage loader */
+#define FAILSAFE_TIMEOUT    2           /* Number of seconds to wait for a packet from the host */
+#define MAX_RX_SENSE_ERROR  23          /* Maximum number of cycles by which the detection of a start bit could be off (as affected by the Loader code) */
+
+// Offset (in bytes) from end of Loader Image pointing to where most host-initialized values exist.
+// Host-Initialized values are: Initial Bit Time, Final Bit Time, 1.5x Bit Time, Failsafe timeout,
+// End of Packet timeout, and ExpectedID.  In addition, the image checksum at word 5 needs to be
+// updated.  All these values need to be updated before the download stream is generated.
+// NOTE: DAT block data is always placed before the first Spin method
+#define RAW_LOADER_INIT_OFFSET_FROM_END (-(10 * 4) - 8)
+
+// Raw loader image.  This is the same second-stage loader used by espload.  It is loaded through the
+// ROM loader at the initial baud rate and then receives the real image in packets at the loader baud rate.
+#include "IP_Loader.h"
+
+static uint8_t initCallFrame[] = {0xFF, 0xFF, 0xF9, 0xFF, 0xFF, 0xFF, 0xF9, 0xFF};
+
+static void generateInitialLoaderImage(PropellerImage *image, uint8_t *imageData, int packetID, int initialBaudRate, int finalBaudRate);
+static int transmitPacket(PropellerConnection *connection, const uint8_t *payload, int payloadSize);
+static int32_t getLong(const uint8_t *buf);
+static void setLong(uint8_t *buf, uint32_t value);
+
+int ICACHE_FLASH_ATTR ploadInitFastLoader(PropellerConnection *connection, int imageSize)
+{
+    PropellerImage loaderImage;
+    int i;
+
+    if (!(connection->packet = (uint8_t *)os_malloc(2 * sizeof(uint32_t) + MAX_PACKET_SIZE)))
+        return -1;
+    connection->packetSize = 0;
+
+    /* the loader is patched for each load so it needs its own copy */
+    if (!(connection->loaderImage = (uint8_t *)os_malloc(sizeof(rawLoaderImage)))) {
+        ploadFreeFastLoader(connection);
+        return -1;
+    }
+
+    /* compute the packet ID (number of packets to be sent) */
+    connection->packetID = (imageSize + MAX_PACKET_SIZE - 1) / MAX_PACKET_SIZE;
+
+    /* the image checksum is accumulated as the image packets are sent */
+    connection->checksum = 0;
+    for (i = 0; i < sizeof(initCallFrame); ++i)
+        connection->checksum += initCallFrame[i];
+
+    /* generate the loader image that will be sent through the ROM loader */
+    generateInitialLoaderImage(&loaderImage, connection->loaderImage, connection->packetID, connection->baudRate, connection->loaderBaudRate);
+    connection->image = loaderImage.imageData;
+    connection->imageSize = loaderImage.imageSize;
+
+    return 0;
+}
+
+void ICACHE_FLASH_ATTR ploadFreeFastLoader(PropellerConnection *connection)
+{
+    if (connection->packet) {
+        os_free(connection->packet);
+        connection->packet = NULL;
+    }
+    if (connection->loaderImage) {
+        os_free(connection->loaderImage);
+        connection->loaderImage = NULL;
+    }
+}
+
+int ICACHE_FLASH_ATTR ploadVerifyLoaderStart(PropellerConnection *connection)
+{
+    return getLong(connection->buffer) == connection->packetID ? 0 : -1;
+}
+
+int ICACHE_FLASH_ATTR ploadVerifyPacketResponse(PropellerConnection *connection, int32_t *pResult)
+{
+    int32_t result = getLong(&connection->buffer[0]);
+    if (getLong(&connection->buffer[4]) != connection->packetTag || result == connection->packetID)
+        return -1;
+    *pResult = result;
+    return 0;
+}
+
+int ICACHE_FLASH_ATTR ploadTransmitImagePacket(PropellerConnection *connection, int *pFinished)
+{
+    uint8_t *payload = &connection->packet[2 * sizeof(uint32_t)];
+    int readSize, i;
+
+    if ((readSize = connection->imageSize) > MAX_PACKET_SIZE)
+        readSize = MAX_PACKET_SIZE;
+
+    if (roffs_read(connection->file, (char *)payload, readSize) != readSize)
+        return -1;
+
+    for (i = 0; i < readSize; ++i)
+        connection->checksum += payload[i];
+
+    if (transmitPacket(connection, NULL, readSize) != 0)
+        return -1;
+
+    *pFinished = (connection->imageSize -= readSize) == 0;
+
+    return 0;
+}
+
+int ICACHE_FLASH_ATTR ploadTransmitVerifyRAM(PropellerConnection *connection)
+{
+    return transmitPacket(connection, verifyRAM, sizeof(verifyRAM));
+}
+
+int ICACHE_FLASH_ATTR ploadTransmitReadyToLaunch(PropellerConnection *connection)
+{
+    return transmitPacket(connection, readyToLaunch, sizeof(readyToLaunch));
+}
+
+int ICACHE_FLASH_ATTR ploadTransmitLaunchNow(PropellerConnection *connection)
+{
+    return transmitPacket(connection, launchNow, sizeof(launchNow));
+}
+
+int ICACHE_FLASH_ATTR ploadRetransmitPacket(PropellerConnection *connection)
+{
+    return transmitPacket(connection, NULL, connection->packetSize - 2 * sizeof(uint32_t));
+}
+
+static void ICACHE_FLASH_ATTR generateInitialLoaderImage(PropellerImage *image, uint8_t *imageData, int packetID, int initialBaudRate, int finalBaudRate)
+{
+    int initAreaOffset = sizeof(rawLoaderImage) + RAW_LOADER_INIT_OFFSET_FROM_END;
+
+    // Make an image from a copy of the loader template
+    os_memcpy(imageData, rawLoaderImage, sizeof(rawLoaderImage));
+    pimageSetImage(image, imageData, sizeof(rawLoaderImage));
+
+    // Initial Bit Time.
+    pimageSetLong(image, initAreaOffset +  4, (CLOCK_SPEED + initialBaudRate / 2) / initialBaudRate);
+
+    // Final Bit Time.
+    pimageSetLong(image, initAreaOffset +  8, (CLOCK_SPEED + finalBaudRate / 2) / finalBaudRate);
+
+    // 1.5x Final Bit Time minus maximum start bit sense error.
+    pimageSetLong(image, initAreaOffset + 12, (3 * (CLOCK_SPEED / 2) + finalBaudRate / 2) / finalBaudRate - MAX_RX_SENSE_ERROR);
+
+    // Failsafe Timeout (seconds-worth of Loader's Receive loop iterations).
+    pimageSetLong(image, initAreaOffset + 16, (FAILSAFE_TIMEOUT * CLOCK_SPEED + (3 * 4) / 2) / (3 * 4));
+
+    // EndOfPacket Timeout (2 bytes worth of Loader's Receive loop iterations).
+    pimageSetLong(image, initAreaOffset + 20, (2 * 10 * CLOCK_SPEED / 12 + finalBaudRate / 2) / finalBaudRate);
+
+    // First Expected Packet ID; total packet count.
+    pimageSetLong(image, initAreaOffset + 36, packetID);
+
+    // Recalculate and update checksum so low byte of checksum calculates to 0.
+    pimageUpdateChecksum(image);
+}
+
+// send a packet to the second-stage loader
+// if payload is NULL, the payload is already in the packet buffer
+static int ICACHE_FLASH_ATTR transmitPacket(PropellerConnection *connection, const uint8_t *payload, int payloadSize)
+{
+    uint8_t *packet = connection->packet;
+
+    if (payload)
+        os_memcpy(&packet[2 * sizeof(uint32_t)], payload, payloadSize);
+    connection->packetSize = 2 * sizeof(uint32_t) + payloadSize;
+
+    /* use a new tag each time so stale responses can't be mistaken for this packet */
+    connection->packetTag = (int32_t)os_random();
+    setLong(&packet[0], connection->packetID);
+    setLong(&packet[4], connection->packetTag);
+
+    uart0_tx_buffer((char *)packet, (uint16_t)connection->packetSize);
+
+    return 0;
+}
+
+static int32_t ICACHE_FLASH_ATTR getLong(const uint8_t *buf)
+{
+     return (buf[3] << 24) | (buf[2] << 16) | (buf[1] << 8) | buf[0];
+}
+
+static void ICACHE_FLASH_ATTR setLong(uint8_t *buf, uint32_t value)
+{
+     buf[3] = value >> 24;
+     buf[2] = value >> 16;
+     buf[1] = value >>  8;
+     buf[0] = value;
+}
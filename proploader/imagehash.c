@@ -0,0 +1,116 @@
+#include <esp8266.h>
+#include "roffs.h"
+#include "imagehash.h"
+
+// The content hash of a file is kept in a small file next to it named "hash/<file name>" so
+// checking whether an image is already loaded doesn't require reading the whole image. The
+// hash file holds the hash and the size of the file it was computed from. It is only used if
+// it was written after the file since writing the file again puts it after its hash file.
+//
+// The hash of the last image loaded is remembered for each reset pin until the Propeller on
+// that pin is reset again.
+
+#define FNV_OFFSET_BASIS    2166136261
+#define FNV_PRIME           16777619
+
+#define HASH_BUFFER_SIZE    1024
+
+static uint32_t loadedHash[MAX_IMAGE_HASH_PIN + 1];
+static uint32_t loadedHashValid;   // bit mask of the reset pins with a loaded image hash
+
+static int hashFileName(const char *fileName, char *name);
+static int computeFileHash(const char *fileName, uint32_t *pHash, int *pSize);
+
+int ICACHE_FLASH_ATTR ploadFileHash(const char *fileName, uint32_t *pHash)
+{
+    char name[sizeof(IMAGE_HASH_PREFIX) + 128];
+    uint32_t entry[2];
+    ROFFS_FILE *file;
+    int size, position;
+
+    if (hashFileName(fileName, name) != 0)
+        return -1;
+
+    /* use the stored hash if it was computed from the current file */
+    if ((file = roffs_open(name)) != NULL) {
+        int cnt = roffs_file_size(file) == sizeof(entry) ? roffs_read(file, (char *)entry, sizeof(entry)) : 0;
+        position = roffs_file_position(file);
+        roffs_close(file);
+        if (cnt == sizeof(entry) && (file = roffs_open(fileName)) != NULL) {
+            int current = entry[1] == roffs_file_size(file) && roffs_file_position(file) < position;
+            roffs_close(file);
+            if (current) {
+                *pHash = entry[0];
+                return 0;
+            }
+        }
+    }
+
+    if (computeFileHash(fileName, &entry[0], &size) != 0)
+        return -1;
+    entry[1] = size;
+
+    /* failing to store the hash (another file may be being written) only means it will be computed again next time */
+    if ((file = roffs_create(name)) != NULL) {
+        roffs_write(file, (char *)entry, sizeof(entry));
+        roffs_close(file);
+    }
+
+    *pHash = entry[0];
+    return 0;
+}
+
+void ICACHE_FLASH_ATTR ploadSetLoadedImage(int resetPin, uint32_t hash)
+{
+    if (resetPin >= 0 && resetPin <= MAX_IMAGE_HASH_PIN) {
+        loadedHash[resetPin] = hash;
+        loadedHashValid |= 1 << resetPin;
+    }
+}
+
+int ICACHE_FLASH_ATTR ploadLoadedImage(int resetPin, uint32_t *pHash)
+{
+    if (resetPin < 0 || resetPin > MAX_IMAGE_HASH_PIN || !(loadedHashValid & (1 << resetPin)))
+        return 0;
+    *pHash = loadedHash[resetPin];
+    return 1;
+}
+
+void ICACHE_FLASH_ATTR ploadForgetLoadedImage(int resetPin)
+{
+    if (resetPin >= 0 && resetPin <= MAX_IMAGE_HASH_PIN)
+        loadedHashValid &= ~(1 << resetPin);
+}
+
+static int ICACHE_FLASH_ATTR hashFileName(const char *fileName, char *name)
+{
+    if (os_strlen(fileName) >= 128)
+        return -1;
+    os_sprintf(name, "%s%s", IMAGE_HASH_PREFIX, fileName);
+    return 0;
+}
+
+/* FNV-1a hash of the file content */
+static int ICACHE_FLASH_ATTR computeFileHash(const char *fileName, uint32_t *pHash, int *pSize)
+{
+    uint32_t hash = FNV_OFFSET_BASIS;
+    uint32_t buf[HASH_BUFFER_SIZE / sizeof(uint32_t)];  /* roffs_read needs a long aligned buffer */
+    ROFFS_FILE *file;
+    int cnt, i;
+
+    if (!(file = roffs_open(fileName)))
+        return -1;
+
+    while ((cnt = roffs_read(file, (char *)buf, sizeof(buf))) > 0) {
+        for (i = 0; i < cnt; ++i)
+            hash = (hash ^ ((uint8_t *)buf)[i]) * FNV_PRIME;
+    }
+    *pSize = roffs_file_size(file);
+    roffs_close(file);
+
+    if (cnt < 0)
+        return -1;
+
+    *pHash = hash;
+    return 0;
+}
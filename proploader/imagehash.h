@@ -0,0 +1,15 @@
+#ifndef IMAGEHASH_H
+#define IMAGEHASH_H
+
+#include <esp8266.h>
+
+#define IMAGE_HASH_PREFIX       "hash/"
+#define MAX_IMAGE_HASH_PIN      16
+
+int ploadFileHash(const char *fileName, uint32_t *pHash);
+
+void ploadSetLoadedImage(int resetPin, uint32_t hash);
+int ploadLoadedImage(int resetPin, uint32_t *pHash);
+void ploadForgetLoadedImage(int resetPin);
+
+#endif
@@ -0,0 +1,114 @@
+#include <esp8266.h>
+#include "proploader.h"
+
+// A cached download stream is the complete ROM loader byte stream that follows the handshake
+// (load command, image size and encoded image) stored in its own file. Loading from the cache
+// is a straight copy from flash to the UART. The cache file name is derived from a hash of the
+// image content, the size of the part of the image that is loaded, the load type and the
+// encoding so that any file with the same content shares the same cached download stream.
+// Only the CACHE_MAX_FILES most recently built streams are kept.
+
+static void trimCache(int keep);
+static int flushCache(PropellerConnection *connection, int finished);
+
+// the hash is the content hash of the image file (see ploadFileHash)
+void ICACHE_FLASH_ATTR ploadCacheName(uint32_t hash, int imageSize, LoadType loadType, int denseEncoding, char *name)
+{
+    os_sprintf(name, CACHE_PREFIX "%08lx-%x-%d%c", (unsigned long)hash, imageSize, loadType, denseEncoding ? 'd' : 'l');
+}
+
+// returns 1 if the cache can't be built now because the filesystem is busy or short of space
+// and the image should be loaded without it
+int ICACHE_FLASH_ATTR ploadInitCacheBuild(PropellerConnection *connection, LoadType loadType, int *pFinished)
+{
+    uint32_t freeSpace, reclaimable;
+    int busy;
+
+    /* make room for the new stream */
+    trimCache(CACHE_MAX_FILES - 1);
+
+    /* no encoding takes more than 11 bytes for each long of the image */
+    if (roffs_space(&freeSpace, &reclaimable) != 0
+    ||  freeSpace < (uint32_t)connection->imageSize * 11 / 4 + CACHE_MIN_FREE_SPACE) {
+        DBG("  not enough space for cache\n");
+        return 1;
+    }
+
+    if (!(connection->output = (uint8_t *)os_malloc(CACHE_BUFFER_SIZE)))
+        return -1;
+    connection->outputSize = CACHE_BUFFER_SIZE;
+    connection->outputCount = 0;
+
+    if (!(connection->cacheFile = roffs_create(connection->cacheName))) {
+        busy = roffs_busy();
+        ploadFreeCacheBuild(connection);
+        return busy ? 1 : -1;
+    }
+
+    /* encode the first part of the download stream into the cache buffer */
+    if (ploadLoadImage(connection, loadType, pFinished) != 0)
+        return -1;
+
+    return flushCache(connection, *pFinished);
+}
+
+int ICACHE_FLASH_ATTR ploadCacheBuildContinue(PropellerConnection *connection, LoadType loadType, int *pFinished)
+{
+    if (ploadLoadImageContinue(connection, loadType, pFinished) != 0)
+        return -1;
+    return flushCache(connection, *pFinished);
+}
+
+// free the cache buffer and discard a partially built cache file
+void ICACHE_FLASH_ATTR ploadFreeCacheBuild(PropellerConnection *connection)
+{
+    if (connection->cacheFile) {
+        roffs_discard(connection->cacheFile);
+        connection->cacheFile = NULL;
+    }
+    if (connection->output) {
+        os_free(connection->output);
+        connection->output = NULL;
+    }
+}
+
+// remove the oldest cached download streams so that no more than keep are left
+static void ICACHE_FLASH_ATTR trimCache(int keep)
+{
+    char name[32];
+    uint32_t position = 0;
+    int count = 0;
+
+    while (roffs_next_file(&position, name, sizeof(name)) == 0) {
+        if (os_strncmp(name, CACHE_PREFIX, sizeof(CACHE_PREFIX) - 1) == 0)
+            ++count;
+    }
+
+    for (position = 0; count > keep && roffs_next_file(&position, name, sizeof(name)) == 0; ) {
+        if (os_strncmp(name, CACHE_PREFIX, sizeof(CACHE_PREFIX) - 1) == 0 && roffs_delete(name) == 0) {
+            DBG("  removed cache %s\n", name);
+            --count;
+        }
+    }
+}
+
+// write the cache buffer to the cache file
+static int ICACHE_FLASH_ATTR flushCache(PropellerConnection *connection, int finished)
+{
+    int size = connection->outputCount;
+
+    if (size > 0 && roffs_write(connection->cacheFile, (char *)connection->output, size) != size)
+        return -1;
+    connection->outputCount = 0;
+
+    if (finished) {
+        if (roffs_close(connection->cacheFile) != 0) {
+            ploadFreeCacheBuild(connection);
+            return -1;
+        }
+        connection->cacheFile = NULL;
+        ploadFreeCacheBuild(connection);
+    }
+
+    return 0;
+}
@@ -2,6 +2,9 @@
 
 #define OFFSET_OF(_s, _f) ((int)&((_s *)0)->_f)
 
+/* initial call frame inserted below dbase when an image is loaded */
+static uint8_t initCallFrame[] = {0xFF, 0xFF, 0xF9, 0xFF, 0xFF, 0xFF, 0xF9, 0xFF};
+
 void ICACHE_FLASH_ATTR pimageSetImage(PropellerImage *image, uint8_t *imageData, int imageSize)
 {
     image->imageData = imageData;
@@ -40,6 +43,49 @@ uint8_t ICACHE_FLASH_ATTR pimageUpdateChecksum(PropellerImage *image)
     return chksum & 0xff;
 }
 
+/* size of the program region of a Spin image (the image size if it doesn't have a valid Spin header)
+   only the Spin header needs to be in memory */
+int ICACHE_FLASH_ATTR pimageProgramSize(PropellerImage *image)
+{
+    int pbase, vbase, dbase;
+
+    if (image->imageSize < (int)sizeof(SpinHdr))
+        return image->imageSize;
+
+    pbase = pimageGetWord(image, OFFSET_OF(SpinHdr, pbase));
+    vbase = pimageGetWord(image, OFFSET_OF(SpinHdr, vbase));
+    dbase = pimageGetWord(image, OFFSET_OF(SpinHdr, dbase));
+
+    if (pbase != sizeof(SpinHdr) || (vbase & 3) != 0 || vbase < pbase || vbase >= image->imageSize || dbase < vbase + (int)sizeof(initCallFrame))
+        return image->imageSize;
+
+    return vbase;
+}
+
+/* check that bytes beyond the program region contain nothing but zero fill and the initial call frame
+   the loaders clear RAM above vbase and insert the initial call frame so these bytes needn't be sent */
+int ICACHE_FLASH_ATTR pimageIsPadding(PropellerImage *image, int offset, const uint8_t *buf, int size)
+{
+    int frame = pimageGetWord(image, OFFSET_OF(SpinHdr, dbase)) - sizeof(initCallFrame);
+    int i;
+
+    for (i = 0; i < size; ++i, ++offset) {
+        if (buf[i] != 0 && (offset < frame || offset >= frame + (int)sizeof(initCallFrame) || buf[i] != initCallFrame[offset - frame]))
+            return 0;
+    }
+
+    return 1;
+}
+
+/* size of the part of an image in memory that must be loaded */
+int ICACHE_FLASH_ATTR pimageLoadSize(PropellerImage *image)
+{
+    int size = pimageProgramSize(image);
+    if (size < image->imageSize && !pimageIsPadding(image, size, image->imageData + size, image->imageSize - size))
+        return image->imageSize;
+    return size;
+}
+
 uint8_t ICACHE_FLASH_ATTR pimageGetByte(PropellerImage *image, int offset)
 {
      uint8_t *buf = image->imageData + offset;
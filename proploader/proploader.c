@@ -1,13 +1,18 @@
 #include <string.h>
 #include <esp8266.h>
 #include "proploader.h"
+#include "propimage.h"
 #include "uart.h"
 
 // Propeller Download Stream Translator array.  Index into this array using the "Binary Value" (usually 5 bits) to translate,
 // the incoming bit size (again, usually 5), and the desired data element to retrieve (encoding = translation, bitCount = bit count
 // actually translated.
+//
+// The ROM loader reads a '1' bit as a one bit-period low pulse and a '0' bit as a two bit-period low pulse, so a serial byte
+// (including its start bit) can carry between three and five bits depending on the data.  txLong() always sends three bits
+// per byte; encoding through this table packs as many bits into each byte as the data allows.  It is used when the load
+// requests dense encoding.
 
-#if 0
 // first index is the next 1-5 bits from the incoming bit stream
 // second index is the number of bits in the first value
 // the result is a structure containing the byte to output to encode some or all of the input bits
@@ -24,7 +29,7 @@ static struct {
   {            {0,    0},             {0,    0},  /*%00100*/ {0xD2, 3},  /*%00100*/ {0xD2, 3},  /*%00100*/ {0xD2, 3} },
   {            {0,    0},             {0,    0},  /*%00101*/ {0xE9, 3},  /*%00101*/ {0x29, 4},  /*%00101*/ {0x29, 4} },
   {            {0,    0},             {0,    0},  /*%00110*/ {0xEA, 3},  /*%00110*/ {0x2A, 4},  /*%00110*/ {0x2A, 4} },
-  {            {0,    0},             {0,    0},  /*%00111*/ {0xFA, 3},  /*%00111*/ {0x95, 4},  /*%00111*/ {0x95, 4} },
+  {            {0,    0},             {0,    0},  /*%00111*/ {0xF5, 3},  /*%00111*/ {0x95, 4},  /*%00111*/ {0x95, 4} },
   {            {0,    0},             {0,    0},             {0,    0},  /*%01000*/ {0x92, 3},  /*%01000*/ {0x92, 3} },
   {            {0,    0},             {0,    0},             {0,    0},  /*%01001*/ {0x49, 4},  /*%01001*/ {0x49, 4} },
   {            {0,    0},             {0,    0},             {0,    0},  /*%01010*/ {0x4A, 4},  /*%01010*/ {0x4A, 4} },
@@ -50,7 +55,6 @@ static struct {
   {            {0,    0},             {0,    0},             {0,    0},             {0,    0},  /*%11110*/ {0xAA, 4} },
   {            {0,    0},             {0,    0},             {0,    0},             {0,    0},  /*%11111*/ {0x55, 5} }
  };
-#endif
 
 // After reset, the Propeller's exact clock rate is not known by either the host or the Propeller itself, so communication
 // with the Propeller takes place based on a host-transmitted timing template that the Propeller uses to read the stream
@@ -138,10 +142,14 @@ static const uint8_t rxHandshake[] = {
     0xEF,0xCE,0xEE,0xCE,0xEF,0xCE,0xCE,0xEE,0xCF,0xCF,0xCE,0xCF,0xCF};
 
 static int startLoad(PropellerConnection *connection, LoadType loadType, int imageSize);
-static int encodeFile(PropellerConnection *connection, int *pFinished);
-static int encodeBuffer(PropellerConnection *connection, const uint8_t *buffer, int size);
+static int nextSegment(PropellerConnection *connection);
+static int encodeSegment(PropellerConnection *connection);
 static void finishLoad(PropellerConnection *connection);
-static void txLong(uint32_t x);
+static int txDelay(PropellerConnection *connection, int pending);
+static int outputRoom(PropellerConnection *connection);
+static void outputByte(PropellerConnection *connection, uint8_t byte);
+static void outputBytes(PropellerConnection *connection, const uint8_t *bytes, int size);
+static void txLong(PropellerConnection *connection, uint32_t x);
 
 int ICACHE_FLASH_ATTR ploadInitiateHandshake(PropellerConnection *connection)
 {
@@ -171,142 +179,368 @@ int ICACHE_FLASH_ATTR ploadVerifyHandshakeResponse(PropellerConnection *connecti
 
 int ICACHE_FLASH_ATTR ploadLoadImage(PropellerConnection *connection, LoadType loadType, int *pFinished)
 {
-    if (startLoad(connection, loadType, connection->imageSize) != 0)
+    /* a cached download stream already starts with the load command and image size */
+    if (connection->cachedImageSize > 0)
+        connection->encodedSize = 0;
+    else if (startLoad(connection, loadType, connection->imageSize) != 0)
         return -1;
-    return ploadLoadImageContinue(connection, loadType, pFinished);
-}
 
-int ICACHE_FLASH_ATTR ploadLoadImageContinue(PropellerConnection *connection, LoadType loadType, int *pFinished)
-{
+    /* an image in memory is encoded as a single segment */
     if (connection->image) {
-        if (encodeBuffer(connection, connection->image, connection->imageSize) != 0)
-            return -1;
+        connection->segment = connection->image;
+        connection->segmentSize = connection->imageSize;
         connection->image = NULL;
-        *pFinished = 1;
     }
+
+    /* a file is read into the segment buffer one segment at a time */
     else if (connection->file) {
-        if (encodeFile(connection, pFinished) != 0)
+        if (!(connection->segmentBuffer = (uint8_t *)os_malloc(LOAD_SEGMENT_MAX_SIZE)))
             return -1;
-        if (*pFinished) {
-            roffs_close(connection->file);
-            connection->file = NULL;
-        }
+        connection->segment = connection->segmentBuffer;
+        connection->segmentSize = 0;
     }
+
+    /* a streamed image is encoded from the stream buffer as it arrives */
+    else if (connection->streamBuffer) {
+        connection->segment = NULL;
+        connection->segmentSize = 0;
+    }
+
     else
         return -1;
 
-    if (*pFinished)
-        finishLoad(connection);
+    connection->segmentBit = 0;
+    ploadStartTransfer(connection, connection->cachedImageSize > 0 ? connection->cachedImageSize : connection->imageSize);
+
+    return ploadLoadImageContinue(connection, loadType, pFinished);
+}
+
+int ICACHE_FLASH_ATTR ploadLoadImageContinue(PropellerConnection *connection, LoadType loadType, int *pFinished)
+{
+    int more;
+
+    /* encode until the image is done, the UART transmit FIFO is full or we run out of streamed data */
+    for (;;) {
+        if (connection->segmentBit >= connection->segmentSize * 8) {
+            if ((more = nextSegment(connection)) < 0)
+                return -1;
+            else if (!more)
+                break;
+            else if (connection->segmentSize == 0) {
+                *pFinished = 0;
+                return 0;
+            }
+        }
+        if (!encodeSegment(connection)) {
+            *pFinished = 0;
+            return 0;
+        }
+    }
+
+    /* the file stays open when it is to be sent by the second-stage loader */
+    if (connection->segmentBuffer) {
+        roffs_close(connection->file);
+        connection->file = NULL;
+    }
+    ploadFreeLoadBuffers(connection);
+
+    ploadEndTransfer(connection);
+    finishLoad(connection);
+    *pFinished = 1;
+
+    return 0;
+}
+
+// size of the part of an image file that must be loaded
+// this reads the whole file so the file must be reopened before it is loaded
+int ICACHE_FLASH_ATTR ploadFileLoadSize(ROFFS_FILE *file)
+{
+    uint8_t hdr[sizeof(SpinHdr)], buf[LOAD_SEGMENT_MAX_SIZE];
+    int fileSize = roffs_file_size(file);
+    int offset, loadSize, cnt, skip;
+    PropellerImage image;
+
+    /* only the Spin header of the image is kept in memory */
+    if ((cnt = roffs_read(file, (char *)buf, sizeof(buf))) < 0)
+        return -1;
+    if (cnt < sizeof(SpinHdr))
+        return fileSize;
+    os_memcpy(hdr, buf, sizeof(SpinHdr));
+    pimageSetImage(&image, hdr, fileSize);
+
+    /* make sure everything beyond the program region can be left to the loader */
+    loadSize = pimageProgramSize(&image);
+    offset = 0;
+    while (cnt > 0) {
+        if (offset + cnt > loadSize) {
+            skip = offset < loadSize ? loadSize - offset : 0;
+            if (!pimageIsPadding(&image, offset + skip, &buf[skip], cnt - skip))
+                return fileSize;
+        }
+        offset += cnt;
+        if ((cnt = roffs_read(file, (char *)buf, sizeof(buf))) < 0)
+            return -1;
+    }
+
+    return loadSize;
+}
+
+int ICACHE_FLASH_ATTR ploadInitStream(PropellerConnection *connection)
+{
+    if (!(connection->streamBuffer = (uint8_t *)os_malloc(LOAD_STREAM_BUFFER_SIZE)))
+        return -1;
+    connection->streamTail = 0;
+    connection->streamCount = 0;
+    return 0;
+}
+
+int ICACHE_FLASH_ATTR ploadWriteStream(PropellerConnection *connection, const uint8_t *data, int size)
+{
+    int head, cnt;
+
+    if (size > ploadStreamRoom(connection))
+        return -1;
+
+    /* copy the data into the ring buffer, wrapping at the end */
+    while (size > 0) {
+        head = (connection->streamTail + connection->streamCount) % LOAD_STREAM_BUFFER_SIZE;
+        if ((cnt = LOAD_STREAM_BUFFER_SIZE - head) > size)
+            cnt = size;
+        os_memcpy(&connection->streamBuffer[head], data, cnt);
+        connection->streamCount += cnt;
+        data += cnt;
+        size -= cnt;
+    }
 
     return 0;
 }
 
+int ICACHE_FLASH_ATTR ploadStreamRoom(PropellerConnection *connection)
+{
+    return connection->streamBuffer ? LOAD_STREAM_BUFFER_SIZE - connection->streamCount : 0;
+}
+
+int ICACHE_FLASH_ATTR ploadLoadDelay(PropellerConnection *connection)
+{
+    return txDelay(connection, uart0_tx_fifo_count() - LOAD_TX_LOW_WATER);
+}
+
+// time until the last byte has left the UART transmit FIFO
+int ICACHE_FLASH_ATTR ploadDrainDelay(PropellerConnection *connection)
+{
+    return txDelay(connection, uart0_tx_fifo_count());
+}
+
+void ICACHE_FLASH_ATTR ploadFreeLoadBuffers(PropellerConnection *connection)
+{
+    if (connection->segmentBuffer) {
+        os_free(connection->segmentBuffer);
+        connection->segmentBuffer = NULL;
+    }
+    if (connection->streamBuffer) {
+        os_free(connection->streamBuffer);
+        connection->streamBuffer = NULL;
+    }
+}
+
+void ICACHE_FLASH_ATTR ploadStartTransfer(PropellerConnection *connection, int size)
+{
+    connection->transferSize = size;
+    connection->transferStart = system_get_time();
+}
+
+void ICACHE_FLASH_ATTR ploadEndTransfer(PropellerConnection *connection)
+{
+    uint32_t elapsed = system_get_time() - connection->transferStart;
+    connection->bytesPerSecond = elapsed > 0 ? (int)(((uint64_t)connection->transferSize * 1000000) / elapsed) : 0;
+    DBG("transfer: %d bytes in %d ms, %d bytes/s\n", connection->transferSize, (int)(elapsed / 1000), connection->bytesPerSecond);
+}
+
 static int ICACHE_FLASH_ATTR startLoad(PropellerConnection *connection, LoadType loadType, int imageSize)
 {
     switch (loadType) {
     case ltShutdown:
-        uart0_tx_buffer((char *)shutdownCmd, (uint16_t)sizeof(shutdownCmd));
+        outputBytes(connection, shutdownCmd, sizeof(shutdownCmd));
         break;
     case ltDownloadAndRun:
-        uart0_tx_buffer((char *)loadRunCmd, (uint16_t)sizeof(loadRunCmd));
+        outputBytes(connection, loadRunCmd, sizeof(loadRunCmd));
         break;
     case ltDownloadAndProgram:
-        uart0_tx_buffer((char *)programShutdownCmd, (uint16_t)sizeof(loadRunCmd));
+        outputBytes(connection, programShutdownCmd, sizeof(programShutdownCmd));
         break;
     case ltDownloadAndProgramAndRun:
-        uart0_tx_buffer((char *)programRunCmd, (uint16_t)sizeof(loadRunCmd));
+        outputBytes(connection, programRunCmd, sizeof(programRunCmd));
         break;
     default:
         return -1;
     }
     
     if (loadType != ltShutdown) {
-        txLong(imageSize / 4);
-        connection->encodedSize = 0;
+        txLong(connection, imageSize / 4);
+        connection->encodedSize = 11;
     }
 
     return 0;
 }
 
-static int ICACHE_FLASH_ATTR encodeFile(PropellerConnection *connection, int *pFinished)
+// advance to the next segment of the image
+// returns 1 if there is a segment to encode (segmentSize is zero while waiting for streamed data),
+// 0 if the image is done and -1 on error
+static int ICACHE_FLASH_ATTR nextSegment(PropellerConnection *connection)
 {
-    uint8_t buffer[LOAD_SEGMENT_MAX_SIZE];
-    int readSize;
+    int size;
 
-    if ((readSize = connection->imageSize) <= 0) {
-        *pFinished = 1;
+    /* an image in memory is a single segment */
+    if (!connection->segmentBuffer && !connection->streamBuffer)
         return 0;
+
+    /* release the stream data used by the previous segment */
+    if (connection->streamBuffer) {
+        connection->streamTail = (connection->streamTail + connection->segmentSize) % LOAD_STREAM_BUFFER_SIZE;
+        connection->streamCount -= connection->segmentSize;
+        connection->segmentSize = 0;
     }
 
-    if (readSize > sizeof(buffer))
-        readSize = sizeof(buffer);
+    if (connection->imageSize <= 0)
+        return 0;
 
-    if (roffs_read(connection->file, (char *)buffer, readSize) != readSize)
-        return -1;
+    /* read the next segment from the file */
+    if (connection->segmentBuffer) {
+        if ((size = connection->imageSize) > LOAD_SEGMENT_MAX_SIZE)
+            size = LOAD_SEGMENT_MAX_SIZE;
+        if (roffs_read(connection->file, (char *)connection->segmentBuffer, size) != size)
+            return -1;
+    }
 
-    if (encodeBuffer(connection, buffer, readSize) != 0)
-        return -1;
+    /* use the contiguous data at the tail of the stream buffer (whole longs until the last segment) */
+    else {
+        if ((size = LOAD_STREAM_BUFFER_SIZE - connection->streamTail) > connection->streamCount)
+            size = connection->streamCount;
+        if (!connection->denseEncoding && size < connection->imageSize)
+            size &= ~3;
+        connection->segment = &connection->streamBuffer[connection->streamTail];
+    }
 
-    if ((connection->imageSize -= readSize) == 0)
-        *pFinished = 1;
-    else
-        *pFinished = 0;
+    connection->segmentSize = size;
+    connection->segmentBit = 0;
+    connection->imageSize -= size;
 
-    return 0;
+    return 1;
 }
 
-static int ICACHE_FLASH_ATTR encodeBuffer(PropellerConnection *connection, const uint8_t *buffer, int size)
+// encode the current segment until it is done (returns 1) or there is no more room for output (returns 0)
+static int ICACHE_FLASH_ATTR encodeSegment(PropellerConnection *connection)
 {
-#if 0
-    static uint8_t masks[] = { 0x00, 0x01, 0x03, 0x07, 0x0f, 0x1f };
-    int bitCount = size * 8;
-    int nextBit = 0;
-
-    /* encode all bits in the input buffer */
-    while (nextBit < bitCount) {
-        int bits, bitsIn;
-
-        /* encode 5 bits or whatever remains in inBytes, whichever is smaller */
-        bitsIn = bitCount - nextBit;
-        if (bitsIn > 5)
-            bitsIn = 5;
-
-        /* extract the next 'bitsIn' bits from the input buffer */
-        bits = ((buffer[nextBit / 8] >> (nextBit % 8))
-              | (buffer[nextBit / 8 + 1] << (8 - (nextBit % 8)))) & masks[bitsIn];
-
-        /* transmit the encoded value */
-        uart_tx_one_char(UART0, PDSTx[bits][bitsIn - 1].encoding);
-        ++connection->encodedSize;
-
-        /* advance to the next group of bits */
-        nextBit += PDSTx[bits][bitsIn - 1].bitCount;
+    const uint8_t *buffer = connection->segment;
+    int bitCount = connection->segmentSize * 8;
+    int room = outputRoom(connection);
+
+    if (connection->cachedImageSize > 0) {
+
+        /* a cached download stream is already encoded */
+        while (connection->segmentBit < bitCount) {
+            if (room <= 0)
+                return 0;
+            outputByte(connection, buffer[connection->segmentBit / 8]);
+            ++connection->encodedSize;
+            connection->segmentBit += 8;
+            --room;
+        }
+    }
+    else if (connection->denseEncoding) {
+        static const uint8_t masks[] = { 0x00, 0x01, 0x03, 0x07, 0x0f, 0x1f };
+
+        /* encode all bits in the segment */
+        while (connection->segmentBit < bitCount) {
+            int byteIndex = connection->segmentBit / 8;
+            int bitIndex = connection->segmentBit % 8;
+            int bits, bitsIn;
+
+            if (room <= 0)
+                return 0;
+
+            /* encode 5 bits or whatever remains in the segment, whichever is smaller */
+            bitsIn = bitCount - connection->segmentBit;
+            if (bitsIn > 5)
+                bitsIn = 5;
+
+            /* extract the next 'bitsIn' bits from the segment without reading past its end */
+            bits = buffer[byteIndex] >> bitIndex;
+            if (bitIndex + bitsIn > 8)
+                bits |= buffer[byteIndex + 1] << (8 - bitIndex);
+            bits &= masks[bitsIn];
+
+            /* transmit the encoded value */
+            outputByte(connection, PDSTx[bits][bitsIn - 1].encoding);
+            ++connection->encodedSize;
+            --room;
+
+            /* advance to the next group of bits */
+            connection->segmentBit += PDSTx[bits][bitsIn - 1].bitCount;
+        }
+    }
+    else {
+        /* encode all complete longs in the segment */
+        while (connection->segmentBit + 32 <= bitCount) {
+            const uint8_t *p = &buffer[connection->segmentBit / 8];
+            if (room < 11)
+                return 0;
+            txLong(connection, p[0] | (p[1] << 8) | (p[2] << 16) | (p[3] << 24));
+            connection->encodedSize += 11;
+            connection->segmentBit += 32;
+            room -= 11;
+        }
+        connection->segmentBit = bitCount;
     }
-#else
-    uint32_t *p = (uint32_t *)buffer;
-    while ((size -= sizeof(uint32_t)) >= 0)
-        txLong(*p++);
-#endif
 
-    return 0;
+    return 1;
 }
 
+// checksum polling starts once the UART has drained and backs off exponentially from there
 static void ICACHE_FLASH_ATTR finishLoad(PropellerConnection *connection)
 {
-    int tmp = (connection->encodedSize * 10 * 1000) / connection->baudRate;
-    connection->retriesRemaining = (tmp + 250) / CALIBRATE_DELAY;
-    connection->retryDelay = CALIBRATE_DELAY;
+    connection->checksumTimeRemaining = RX_CHECKSUM_TIMEOUT;
+    connection->retryDelay = CHECKSUM_POLL_MIN_DELAY;
+}
+
+// milliseconds to transmit pending bytes rounded up with a minimum of one
+static int ICACHE_FLASH_ATTR txDelay(PropellerConnection *connection, int pending)
+{
+    int delay = pending > 0 ? (pending * 10 * 1000 + connection->baudRate - 1) / connection->baudRate : 0;
+    return delay > 0 ? delay : 1;
+}
+
+// encoded bytes go to the cache buffer while building a cached download stream and to the UART otherwise
+static int ICACHE_FLASH_ATTR outputRoom(PropellerConnection *connection)
+{
+    if (connection->output)
+        return connection->outputSize - connection->outputCount;
+    return UART_TX_FIFO_LIMIT - uart0_tx_fifo_count();
+}
+
+static void ICACHE_FLASH_ATTR outputByte(PropellerConnection *connection, uint8_t byte)
+{
+    if (connection->output)
+        connection->output[connection->outputCount++] = byte;
+    else
+        uart_tx_one_char(UART0, byte);
+}
+
+static void ICACHE_FLASH_ATTR outputBytes(PropellerConnection *connection, const uint8_t *bytes, int size)
+{
+    while (--size >= 0)
+        outputByte(connection, *bytes++);
 }
 
-static void ICACHE_FLASH_ATTR txLong(uint32_t x)
+static void ICACHE_FLASH_ATTR txLong(PropellerConnection *connection, uint32_t x)
 {
     int i;
     for (i = 0; i < 11; ++i) {
-        uart_tx_one_char(UART0, 0x92 
-                              | (i == 10 ? 0x60 : 0x00)
-                              |  (x & 1)
-                              | ((x & 2) << 2)
-                              | ((x & 4) << 4));
+        outputByte(connection, 0x92
+                             | (i == 10 ? 0x60 : 0x00)
+                             |  (x & 1)
+                             | ((x & 2) << 2)
+                             | ((x & 4) << 4));
         x >>= 3;
     }
 }
@@ -23,35 +23,99 @@ typedef enum {
 
 typedef enum {
 /* 0 */    stIdle,
-/* 1 */    stReset,
-/* 2 */    stTxHandshake,
-/* 3 */    stRxHandshakeStart,
-/* 4 */    stRxHandshake,
-/* 5 */    stLoadContinue,
-/* 6 */    stVerifyChecksum,
-/* 7 */    stStartAck, 
+/* 1 */    stQueued,
+/* 2 */    stReset,
+/* 3 */    stTxHandshake,
+/* 4 */    stRxHandshakeStart,
+/* 5 */    stRxHandshake,
+/* 6 */    stLoadContinue,
+/* 7 */    stVerifyChecksum,
+/* 8 */    stStartAck, 
+/* 9 */    stLoaderStart,
+/* 10 */   stImagePacketAck,
+/* 11 */   stVerifyRAMAck,
+/* 12 */   stReadyToLaunchAck,
+/* 13 */   stBuildCache,
+/* 14 */   stLaunch,
            stMAX
 } LoadState;
 
+typedef enum {
+    jtLoad,
+    jtLoadFile,
+    jtReset
+} JobType;
+
+// state timing for a load
+typedef struct {
+    JobType jobType;
+    int succeeded;
+    uint32_t statesEntered;     // bit mask of the states entered
+    uint32_t stateTime[stMAX];  // microseconds spent in each state
+} LoadStats;
+
 typedef struct {
+    JobType jobType;
     HttpdConnData *connData;
     ETSTimer timer;
     int resetPin;
     int baudRate;
     int finalBaudRate;
-    int responseSize;
-    int responseTimeout;
+    int uartBaudRate;       // rate the UART is running at
+    int responseSize;       // -1 to capture the response until it goes idle
+    int responseTimeout;    // idle timeout for the response
     LoadType loadType;
+    int denseEncoding;      // encode the image using the PDSTx table rather than txLong
     ROFFS_FILE *file;       // this is set for loading a file
+    int loadSize;           // size of the part of the file that must be loaded
+    uint32_t imageHash;     // content hash of the file
+    int imageHashValid;
+    int skipIfCurrent;      // don't load the file if the Propeller is already running it
     const uint8_t *image;   // this is set for loading an image in memory
     int imageSize;
     int encodedSize;
     LoadState state;
+    uint32_t stateStart;    // system time when the current state was entered
+    LoadStats stats;
     int retriesRemaining;
     int retryDelay;
+    int checksumTimeRemaining;  // milliseconds left to poll for the checksum result
     uint8_t buffer[125 + 4]; // sizeof(rxHandshake) + 4
     int bytesReceived;
     int bytesRemaining;
+    int loaderBaudRate;     // second-stage loader baud rate or zero to use only the ROM loader
+    int packetID;           // packet ID expected by the second-stage loader
+    int32_t packetTag;      // tag sent with the last packet
+    int32_t checksum;       // checksum of the image sent to the second-stage loader
+    uint8_t *packet;        // last packet sent to the second-stage loader
+    uint8_t *loaderImage;   // second-stage loader patched for this load
+    int packetSize;
+    const uint8_t *segment; // image segment being encoded
+    int segmentSize;
+    int segmentBit;         // next bit of the segment to encode
+    uint8_t *segmentBuffer; // buffer for segments read from a file
+    uint32_t transferStart; // system time when the image transfer started
+    int transferSize;       // number of image bytes in the transfer
+    int bytesPerSecond;     // image bytes per second achieved by the last transfer
+    uint8_t *streamBuffer;  // ring buffer for an image streamed from the request body
+    int streamTail;         // offset of the oldest byte in the stream buffer
+    int streamCount;        // number of bytes in the stream buffer
+    int receiveHeld;        // TCP receive is held while the stream buffer drains
+    int useCache;           // load from a cached download stream
+    char fileName[128];     // file to load
+    int cachedImageSize;    // size of the image when the file is a cached download stream, zero otherwise
+    char cacheName[32];     // name of the cached download stream for the image being loaded
+    ROFFS_FILE *cacheFile;  // cached download stream being built
+    uint8_t *output;        // buffer for encoded bytes while building a cached download stream
+    int outputSize;
+    int outputCount;
+    char *responseBuffer;   // response received from the program waiting to be sent to the client
+    int responseBufferSize;
+    int responseCount;
+    int responseLost;       // response bytes dropped because the buffer could not grow
+    int responseRemaining;  // bytes left to capture, zero when the capture is complete
+    int responseStarted;    // the response headers have been sent
+    int responseSending;    // a send to the client is in progress
 } PropellerConnection;
 
 #define RESET_BUTTON_PIN                0
@@ -60,21 +124,76 @@ typedef struct {
 #define RESET_BUTTON_PRESS_DELTA        500
 #define RESET_BUTTON_PRESS_COUNT        4
 
+#define COMPACT_INTERVAL                100     // time between filesystem compaction steps
+
+#define LOAD_QUEUE_SIZE                 4       // must leave some of the httpd connections free
+#define LOAD_STATS_SIZE                 8       // number of recent loads kept for /propeller/stats
+
 #define RESET_DELAY_1                   10
 #define RESET_DELAY_2                   100
-#define CALIBRATE_DELAY                 10
+#define CHECKSUM_POLL_MIN_DELAY         1       // first checksum poll after the UART has drained
+#define CHECKSUM_POLL_MAX_DELAY         32      // the checksum poll delay doubles up to this
 
 #define LOAD_SEGMENT_MAX_SIZE           1024
-#define LOAD_SEGMENT_DELAY              50
+#define LOAD_TX_LOW_WATER               24      // refill the UART transmit FIFO before it drains below this
+
+// httpd delivers the request body in MAX_POST (1024 byte) chunks. Holding TCP receive only stops
+// window updates so a full receive window that is already in flight still arrives after the hold
+// along with the rest of the chunk being delivered.
+#define LOAD_TCP_WINDOW                 (4 * 1460)  // TCP_WND in the SDK's lwIP
+#define LOAD_STREAM_HOLD_ROOM           (LOAD_TCP_WINDOW + 1024)    // hold TCP receive when less room than this remains
+#define LOAD_STREAM_BUFFER_SIZE         (LOAD_STREAM_HOLD_ROOM + LOAD_SEGMENT_MAX_SIZE)
+
+#define CACHE_BUFFER_SIZE               1024
+#define CACHE_PREFIX                    "cache/"
+#define CACHE_MAX_FILES                 8           // the oldest cached download streams are removed beyond this
+#define CACHE_MIN_FREE_SPACE            (64 * 1024) // free space to leave for uploads after building a cache
+
+#define RESPONSE_BUFFER_SIZE            1024    // response bytes received while the previous send is in progress
+#define RESPONSE_BUFFER_MAX_SIZE        8192    // the buffer doubles up to this while the client falls behind
+#define RESPONSE_SEND_MAX_SIZE          2048    // response bytes queued for the client in each send
+#define CACHE_BUILD_DELAY               1
+
 #define RX_HANDSHAKE_TIMEOUT            2000
 #define RX_CHECKSUM_TIMEOUT             250
 #define EEPROM_PROGRAM_TIMEOUT          5000
 #define EEPROM_VERIFY_TIMEOUT           2000
 
+#define MAX_PACKET_SIZE                 1024    // size of data buffer in the second-stage loader
+#define LOADER_START_TIMEOUT            2000
+#define LOADER_BAUD_RATE_MIN            9600    // second-stage loader baud rates outside this range are rejected
+#define LOADER_BAUD_RATE_MAX            3000000
+#define PACKET_ACK_TIMEOUT              2000
+#define PACKET_RETRIES                  3
+
 int ploadInitiateHandshake(PropellerConnection *connection);
 int ploadVerifyHandshakeResponse(PropellerConnection *connection, int *pVersion);
 int ploadLoadImage(PropellerConnection *connection, LoadType loadType, int *pFinished);
 int ploadLoadImageContinue(PropellerConnection *connection, LoadType loadType, int *pFinished);
+int ploadLoadDelay(PropellerConnection *connection);
+int ploadDrainDelay(PropellerConnection *connection);
+void ploadFreeLoadBuffers(PropellerConnection *connection);
+int ploadFileLoadSize(ROFFS_FILE *file);
+int ploadInitStream(PropellerConnection *connection);
+int ploadWriteStream(PropellerConnection *connection, const uint8_t *data, int size);
+int ploadStreamRoom(PropellerConnection *connection);
+
+void ploadCacheName(uint32_t hash, int imageSize, LoadType loadType, int denseEncoding, char *name);
+int ploadInitCacheBuild(PropellerConnection *connection, LoadType loadType, int *pFinished);
+int ploadCacheBuildContinue(PropellerConnection *connection, LoadType loadType, int *pFinished);
+void ploadFreeCacheBuild(PropellerConnection *connection);
+void ploadStartTransfer(PropellerConnection *connection, int size);
+void ploadEndTransfer(PropellerConnection *connection);
+
+int ploadInitFastLoader(PropellerConnection *connection, int imageSize);
+void ploadFreeFastLoader(PropellerConnection *connection);
+int ploadVerifyLoaderStart(PropellerConnection *connection);
+int ploadVerifyPacketResponse(PropellerConnection *connection, int32_t *pResult);
+int ploadTransmitImagePacket(PropellerConnection *connection, int *pFinished);
+int ploadTransmitVerifyRAM(PropellerConnection *connection);
+int ploadTransmitReadyToLaunch(PropellerConnection *connection);
+int ploadTransmitLaunchNow(PropellerConnection *connection);
+int ploadRetransmitPacket(PropellerConnection *connection);
 
 #endif
 
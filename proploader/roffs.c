@@ -2,11 +2,12 @@
 #include "roffs.h"
 
 // WARNING!!
-// This code assumes that buffers passed in for reading/writing are long aligned.
-// It also always reads/writes an integral number of longs even if the size parameter
+// This code assumes that buffers passed in for reading are long aligned.
+// It also always reads an integral number of longs even if the size parameter
 // is not long aligned. Make sure buffers have enough space to account for this.
 // This was done to simplify the code and it causes no problems with the way the
 // code is used by httpdroffs.c.
+// Writes can be any size since they are collected into whole flash pages.
 
 #ifndef SPIFFS
 
@@ -18,15 +19,159 @@ struct ROFFS_FILE_STRUCT {
     uint32_t start;
     uint32_t offset;
     uint32_t size;
+    uint32_t hash;
     uint8_t flags;
+    uint32_t *buffer;   // data written to a new file that hasn't been programmed yet
+    int buffered;       // number of bytes in buffer
 };
 
+// index entry for an active file
+typedef struct {
+    uint32_t hash;      // hash of the file name
+    uint32_t header;    // offset of the file header or INDEX_EMPTY or INDEX_REMOVED
+    uint32_t size;      // size of the file data
+    uint16_t nameLen;   // length of the file name including padding
+    uint8_t flags;      // file flags
+} IndexEntry;
+
 #define BAD_FILESYSTEM_BASE 3
 #define NOT_FOUND           0xffffffff
 
+// writes are collected and programmed a flash page at a time
+#define WRITE_PAGE_SIZE     256
+
+// Compaction slides the active files that follow deleted files down over them a window at a time.
+// The moved files are followed by a deleted filler file that reaches the first file that was not
+// moved, or by the terminator when the window reaches the end of the filesystem. The new contents
+// of each sector of the window are built in the scratch sector before the sector is erased and
+// the plan and progress are recorded in the journal sector so an interrupted step found by
+// roffs_mount can be finished. Files only ever move down so their old contents are still there
+// when needed. Each call to roffs_compact does one sector so files in the window are busy until
+// the step is done. A step only starts once the filesystem has been idle for a while. When a file
+// needs the step out of the way it is abandoned if it hasn't rewritten any sector yet, unless it was
+// abandoned before, or finished right away if only a few sectors are left.
+#define COMPACT_JOURNAL     (fsLimit - 2 * SPI_FLASH_SEC_SIZE)
+#define COMPACT_SCRATCH     (fsLimit - SPI_FLASH_SEC_SIZE)
+#define COMPACT_MAGIC       ('R' | ('O' << 8) | ('c' << 16) | ('p' << 24))
+#define COMPACT_MAX_SECTORS 32          // largest window, files that don't fit are left in place
+#define COMPACT_MAX_SEGMENTS 16
+#define COMPACT_CHUNK_SIZE  256
+#define COMPACT_IDLE_TIME   2000        // milliseconds without an open, create or delete before a step starts
+#define COMPACT_LOW_SPACE   (128 * 1024)    // steps start without waiting for the filesystem to be idle below this
+#define COMPACT_SYNC_SECTORS 2          // sectors left in a step that are finished without waiting for roffs_compact
+
+// The superblock sector records the offset of the terminator each time it moves so the end of the
+// log is known even if a damaged file header stops the walk at mount. Each update is appended as a
+// new record with a higher generation number and the sector is erased when it fills up.
+#define SUPERBLOCK          (fsLimit - 3 * SPI_FLASH_SEC_SIZE)
+#define SUPERBLOCK_MAGIC    ('R' | ('O' << 8) | ('s' << 16) | ('b' << 24))
+#define FILE_SPACE_END      SUPERBLOCK
+
+#define INDEX_EMPTY         0xffffffff  // header offset of a slot that has never been used
+#define INDEX_REMOVED       0xfffffffe  // header offset of a slot whose file has been replaced
+#define INDEX_MIN_SIZE      16          // must be a power of two
+
+// superblock record
+typedef struct {
+    int32_t magic;
+    uint32_t generation;
+    uint32_t end;           // offset of the terminator
+    uint32_t check;         // ~(generation ^ end) to detect an incomplete record
+} SuperRecord;
+
+// a range of the new contents of a compaction window copied from the old contents
+typedef struct {
+    uint32_t dst;
+    uint32_t src;
+    uint32_t len;
+} CompactSegment;
+
+// compaction plan kept in the journal sector
+// it is followed by two progress words for each sector of the window, the first is cleared when
+// the scratch sector holds the new contents of the sector and the second when they have been copied
+typedef struct {
+    int32_t magic;          // written last so an incomplete plan is ignored
+    uint32_t complete;      // cleared when the plan has been carried out
+    uint32_t start;         // first sector of the window
+    uint32_t sectorCount;   // number of sectors in the window
+    uint32_t from;          // first file that is moved or removed
+    uint32_t to;            // first file that is left in place
+    uint32_t tail;          // offset of the filler or terminator that follows the moved files
+    RoFsHeader tailHeader;
+    uint32_t segmentCount;
+    CompactSegment segments[COMPACT_MAX_SEGMENTS];
+} CompactPlan;
+
 // initialize to an invalid address to indicate that no filesystem is mounted
 static uint32_t fsData = BAD_FILESYSTEM_BASE;
 
+// end of the flash used by the filesystem including the superblock and compaction sectors
+static uint32_t fsLimit = 0;
+
+// offset of the terminator where the next file will be created or NOT_FOUND if unknown
+static uint32_t fsEnd = NOT_FOUND;
+
+// offset of a pending file that must be removed before the next file can be created
+static uint32_t fsPending = NOT_FOUND;
+
+// hash index of the active files built by roffs_mount so files can be found without walking the flash
+// it uses open addressing with linear probing and always has at least one empty slot
+static IndexEntry *fsIndex = NULL;
+static int fsIndexSize = 0;     // number of slots
+static int fsIndexUsed = 0;     // number of slots that are not empty including removed ones
+
+// space used by deleted files
+static uint32_t fsReclaimable = 0;
+
+// latest superblock record and the offset of the next one within the superblock sector
+static uint32_t superGeneration = 0;
+static uint32_t superEnd = NOT_FOUND;
+static uint32_t superNext = 0;
+
+// number of open files and the file being written if any
+static int fsOpenFiles = 0;
+static ROFFS_FILE *fsWriter = NULL;
+
+// the last call failed only because the filesystem was busy (see roffs_busy)
+static int fsBusy = 0;
+
+// system time of the last open, create or delete
+static uint32_t fsLastUse = 0;
+
+// file where the search for deleted files resumes or NOT_FOUND if there is nothing to compact
+static uint32_t compactCursor = NOT_FOUND;
+
+// compaction step in progress
+static CompactPlan compactPlan;
+static int compactActive = 0;
+static int compactRecovering = 0;   // the step was interrupted and the files are indexed once it is finished
+static int compactYielded = 0;      // a step was abandoned and the next one has to be finished
+static int compactSector;       // next sector of the window
+static int compactBuilt;        // the scratch sector holds the new contents of compactSector
+
+static int buildIndex(void);
+static void resetIndex(void);
+static IndexEntry *findIndexEntry(const char *fileName, uint32_t hash);
+static int addIndexEntry(uint32_t hash, uint32_t header, RoFsHeader *h);
+static int growIndex(void);
+static uint32_t hashName(const char *name);
+static int removePendingFile(void);
+static int deleteIndexedFile(IndexEntry *entry);
+static int flushWriteBuffer(ROFFS_FILE *file);
+static int planCompaction(void);
+static int continueCompaction(void);
+static int finishCompaction(void);
+static int recoverCompaction(void);
+static int yieldCompaction(void);
+static void fillCompactChunk(uint32_t addr, uint32_t *buf);
+static int markCompactProgress(int sector, int copied);
+static int overlapsCompaction(uint32_t hash);
+static uint32_t entryLength(RoFsHeader *h);
+static int readSuperblock(void);
+static int writeSuperblock(uint32_t end);
+static void checkSuperblock(void);
+static uint32_t compactWindowEnd(void);
+static uint32_t flashFilesystemEnd(void);
 static int readFlash(uint32_t addr, void *buf, int size);
 static int writeFlash(uint32_t addr, void *buf, int size);
 static int updateFlash(uint32_t addr, void *buf, int size);
@@ -39,6 +184,13 @@ int ICACHE_FLASH_ATTR roffs_mount(uint32_t flashAddress)
 	if ((flashAddress & 3) != 0)
 		return -1;
 
+    // leave room for at least one sector of files
+    fsLimit = flashFilesystemEnd();
+    if (flashAddress + 4 * SPI_FLASH_SEC_SIZE > fsLimit) {
+os_printf("mount: no room for a filesystem at %08lx\n", flashAddress);
+        return -5;
+    }
+
 	// read the filesystem header (first file header)
 	if (readFlash(flashAddress, &testHeader, sizeof(RoFsHeader)) != SPI_FLASH_RESULT_OK)
         return -2;
@@ -47,29 +199,126 @@ int ICACHE_FLASH_ATTR roffs_mount(uint32_t flashAddress)
 	if (testHeader.magic != ROFS_MAGIC)
 		return -3;
 
-	// filesystem is mounted successfully
+	// index the active files unless a compaction step was interrupted
+	// roffs_compact finishes the step and then indexes the files, until then they can't be opened
     fsData = flashAddress;
+    if (readSuperblock() != 0 || recoverCompaction() != 0) {
+        fsData = BAD_FILESYSTEM_BASE;
+        return -4;
+    }
+    if (compactRecovering) {
+        resetIndex();
+        fsEnd = NOT_FOUND;
+        fsPending = NOT_FOUND;
+        fsReclaimable = 0;
+        compactCursor = NOT_FOUND;
+        return 0;
+    }
+    switch (buildIndex()) {
+    case 0:
+        break;
+    case -2:
+        fsData = BAD_FILESYSTEM_BASE;
+        return -6;
+    default:
+        fsData = BAD_FILESYSTEM_BASE;
+        return -4;
+    }
+    compactCursor = fsReclaimable > 0 ? fsData : NOT_FOUND;
+
+    // check the end of the log against the superblock
+    checkSuperblock();
+
+	// filesystem is mounted successfully
+    return 0;
+}
+
+// unmount the filesystem so its flash can be written directly
+// fails while files are open (see roffs_busy) since they would be left pointing at the old contents
+int ICACHE_FLASH_ATTR roffs_unmount(void)
+{
+    fsBusy = 0;
+
+    if (fsData == BAD_FILESYSTEM_BASE)
+        return 0;
+
+    if (fsOpenFiles > 0) {
+os_printf("unmount: files are open\n");
+        fsBusy = 1;
+        return -1;
+    }
+
+    resetIndex();
+    fsData = BAD_FILESYSTEM_BASE;
+    fsEnd = NOT_FOUND;
+    fsPending = NOT_FOUND;
+    fsReclaimable = 0;
+    compactCursor = NOT_FOUND;
+    compactActive = 0;
+    compactRecovering = 0;
+    compactYielded = 0;
     return 0;
 }
 
 int ICACHE_FLASH_ATTR roffs_format(uint32_t flashAddress)
 {
 	RoFsHeader h;
+
+    fsBusy = 0;
+
+    // the mounted filesystem can't be emptied under open files
+    if (flashAddress == fsData && fsOpenFiles > 0) {
+os_printf("format: files are open\n");
+        fsBusy = 1;
+        return -1;
+    }
+
+    fsLimit = flashFilesystemEnd();
+    if (flashAddress + 4 * SPI_FLASH_SEC_SIZE > fsLimit) {
+os_printf("format: no room for a filesystem at %08lx\n", flashAddress);
+        return -1;
+    }
+
+    // abandon any compaction step
+    compactActive = 0;
+    compactRecovering = 0;
+    compactYielded = 0;
+    if (spi_flash_erase_sector(COMPACT_JOURNAL / SPI_FLASH_SEC_SIZE) != SPI_FLASH_RESULT_OK) {
+os_printf("format: error erasing compaction journal\n");
+        return -1;
+    }
+
     os_memset(&h, 0xff, sizeof(RoFsHeader));
     h.magic = ROFS_MAGIC;
     if (writeFlash(flashAddress, (uint32 *)&h, sizeof(RoFsHeader)) != SPI_FLASH_RESULT_OK) {
 os_printf("format: error writing terminator\n");
         return -1;
     }
+
+    // forget the old files if this is the mounted filesystem
+    if (flashAddress == fsData) {
+        resetIndex();
+        fsEnd = flashAddress;
+        fsPending = NOT_FOUND;
+        fsReclaimable = 0;
+        compactCursor = NOT_FOUND;
+    }
+
+    // start a new superblock
+    superNext = 0;
+    if (writeSuperblock(flashAddress) != 0)
+        return -1;
+
     return 0;
 }
 
 ROFFS_FILE ICACHE_FLASH_ATTR *roffs_open(const char *fileName)
 {
-    uint32_t p = fsData;
-	char namebuf[256];
 	ROFFS_FILE *file;
-	RoFsHeader h;
+	IndexEntry *entry;
+	uint32_t hash;
+
+    fsBusy = 0;
 
 	// make sure there is a filesystem mounted
     if (fsData == BAD_FILESYSTEM_BASE) {
@@ -81,72 +330,93 @@ os_printf("open: filesystem not mounted\n");
 	while (fileName[0] == '/')
         fileName++;
 
+    // a file that is being moved by compaction can't be opened until the step is finished
+    fsLastUse = system_get_time();
+    hash = hashName(fileName);
+    if ((compactRecovering || overlapsCompaction(hash)) && yieldCompaction() != 0) {
+        fsBusy = 1;
+        return NULL;
+    }
+
 	// find the file
-	for (;;) {
+    if (!(entry = findIndexEntry(fileName, hash)))
+        return NULL;
 
-		// read the next file header
-		if (readFlash(p, &h, sizeof(RoFsHeader)) != SPI_FLASH_RESULT_OK)
-            return NULL;
+    if (!(file = (ROFFS_FILE *)os_malloc(sizeof(ROFFS_FILE))))
+        return NULL;
+    ++fsOpenFiles;
+    file->header = entry->header;
+    file->start = entry->header + sizeof(RoFsHeader) + entry->nameLen;
+    file->offset = 0;
+    file->size = entry->size;
+    file->hash = entry->hash;
+    file->flags = entry->flags;
+    file->buffer = NULL;
+    file->buffered = 0;
+    return file;
+}
 
-		// read the next file header
-		if (readFlash(p, &h, sizeof(RoFsHeader)) != SPI_FLASH_RESULT_OK) {
-os_printf("open: %08lx error reading file header\n", p);
-            return NULL;
-        }
+// do the next small part of compacting the filesystem
+// returns 1 if there is more to do, 0 if there is nothing to compact and -1 on an error
+int ICACHE_FLASH_ATTR roffs_compact(void)
+{
+    uint32_t freeSpace, reclaimable;
 
-        // check the magic number
-		if (h.magic != ROFS_MAGIC) {
-os_printf("open: %08lx bad magic number\n", p);
-            return NULL;
-        }
+    if (fsData == BAD_FILESYSTEM_BASE)
+        return 0;
 
-		// check for the end of image marker
-        if (h.flags & FLAG_LASTFILE)
-            return NULL;
+    // continue the current step
+    if (compactActive) {
+        if (continueCompaction() != 0)
+            return -1;
+        return compactActive || compactCursor != NOT_FOUND;
+    }
 
-		// terminate on a leftover pending file
-		else if (h.flags & FLAG_PENDING) {
-os_printf("open: terminate on a leftover pending file\n");
-            return NULL;
-        }
-        
-		// only check active files
-        else if (h.flags & FLAG_ACTIVE) {
+    if (compactCursor == NOT_FOUND)
+        return 0;
 
-            // get the name of the file
-		    if (readFlash(p + sizeof(RoFsHeader), namebuf, sizeof(namebuf)) != SPI_FLASH_RESULT_OK) {
-os_printf("open: %08lx error reading file name\n", p);
-                return NULL;
-            }
+    // files can't be moved while they are open
+    if (fsOpenFiles > 0)
+        return 1;
 
-os_printf("open: %08lx checking '%s'\n", p, namebuf);
-		    // check to see if this is the file we're looking for
-            if (os_strcmp(namebuf, fileName) == 0) {
-                if (!(file = (ROFFS_FILE *)os_malloc(sizeof(ROFFS_FILE))))
-                    return NULL;
-                file->header = p;
-			    file->start = p + sizeof(RoFsHeader) + h.nameLen;
-			    file->offset = 0;
-                file->size = h.fileLenComp;
-                file->flags = h.flags;
-			    return file;
-		    }
-        }
+    // a step would only get in the way of a busy filesystem unless it is running out of space
+    if (system_get_time() - fsLastUse < COMPACT_IDLE_TIME * 1000 && roffs_space(&freeSpace, &reclaimable) == 0
+    &&  freeSpace >= COMPACT_LOW_SPACE)
+        return 1;
 
-        // deleted file
-        else {
-os_printf("open: %08lx skipping deleted file\n", p);
-        }
+    // remove a leftover pending file first
+    if (fsPending != NOT_FOUND)
+        return removePendingFile() == 0 ? 1 : -1;
 
-		// skip over the file data
-		p += sizeof(RoFsHeader) + h.nameLen + h.fileLenComp;
+    return planCompaction();
+}
 
-		// align to next 32 bit offset
-        p = (p + 3) & ~3;
-	}
+// get the free space and the space used by deleted files
+int ICACHE_FLASH_ATTR roffs_space(uint32_t *pFree, uint32_t *pReclaimable)
+{
+    uint32_t end, reclaimable = fsReclaimable;
 
-    // file not found
-    return NULL;
+    if (fsData == BAD_FILESYSTEM_BASE)
+        return -1;
+
+    // find the end of the used space
+    if (fsWriter)
+        end = fsWriter->start + fsWriter->size;
+    else if (fsPending != NOT_FOUND) {
+        end = (fsPending + sizeof(RoFsHeader) + SPI_FLASH_SEC_SIZE - 1) & ~(SPI_FLASH_SEC_SIZE - 1);
+        reclaimable += end - fsPending;
+    }
+    else if (fsEnd != NOT_FOUND)
+        end = fsEnd;
+    else
+        end = FILE_SPACE_END;
+
+    // leave room for the terminator
+    end += sizeof(RoFsHeader);
+
+    *pFree = end < FILE_SPACE_END ? FILE_SPACE_END - end : 0;
+    *pReclaimable = reclaimable;
+    return 0;
 }
 
 int ICACHE_FLASH_ATTR roffs_close(ROFFS_FILE *file)
@@ -156,6 +426,10 @@ int ICACHE_FLASH_ATTR roffs_close(ROFFS_FILE *file)
 
     if (file->flags & FLAG_LASTFILE) {
 	    RoFsHeader h;
+
+        // program the rest of the file
+        if (flushWriteBuffer(file) != 0)
+            return -1;
 	    
         if (readFlash(file->header, (uint32 *)&h, sizeof(RoFsHeader)) != SPI_FLASH_RESULT_OK) {
 os_printf("close: error reading new file header\n");
@@ -176,12 +450,63 @@ os_printf("close: error updating new file header\n");
 os_printf("close: error writing new terminator\n");
             return -1;
         }
+
+        if (fsWriter == file)
+            fsWriter = NULL;
+        os_free(file->buffer);
+        file->buffer = NULL;
+
+        // add the new file to the index
+        if (fsPending == file->header) {
+            fsPending = NOT_FOUND;
+            fsEnd = file->start + file->offset;
+            if (readFlash(file->header, (uint32 *)&h, sizeof(RoFsHeader)) != SPI_FLASH_RESULT_OK
+            ||  addIndexEntry(file->hash, file->header, &h) != 0) {
+os_printf("close: error indexing new file\n");
+                --fsOpenFiles;
+                os_free(file);
+                return -1;
+            }
+            writeSuperblock(fsEnd);
+        }
     }
 
+    --fsOpenFiles;
+    os_free(file);
+    return 0;
+}
+
+// abandon a file without finishing it
+// a file being created is left pending (fsPending) and is removed the next time a file is created
+int ICACHE_FLASH_ATTR roffs_discard(ROFFS_FILE *file)
+{
+    if (!file)
+        return -1;
+    if (fsWriter == file)
+        fsWriter = NULL;
+    if (file->buffer)
+        os_free(file->buffer);
+    --fsOpenFiles;
     os_free(file);
     return 0;
 }
 
+// check whether the last roffs_format, roffs_unmount, roffs_open, roffs_create, roffs_delete or
+// roffs_next_file failed only because the filesystem was busy, the call can be tried again later
+int ICACHE_FLASH_ATTR roffs_busy(void)
+{
+    return fsBusy;
+}
+
+// get the position of a file in the log
+// a file written later has a higher position and compaction keeps files in the same order
+int ICACHE_FLASH_ATTR roffs_file_position(ROFFS_FILE *file)
+{
+    if (!file)
+        return -1;
+    return (int)file->header;
+}
+
 int ICACHE_FLASH_ATTR roffs_file_size(ROFFS_FILE *file)
 {
     if (!file)
@@ -215,18 +540,169 @@ int ICACHE_FLASH_ATTR roffs_read(ROFFS_FILE *file, char *buf, int len)
 	return len;
 }
 
-static int ICACHE_FLASH_ATTR find_file_and_insertion_point(const char *fileName, uint32_t *pFileOffset, uint32_t *pInsertionOffset)
+// remove a leftover pending file by converting it to a deleted file that extends to the next sector boundary
+static int ICACHE_FLASH_ATTR removePendingFile(void)
 {
-    uint32_t p = fsData;
-	char namebuf[256];
+    uint32_t pending = fsPending;
+    uint32_t p;
+	RoFsHeader h;
+
+os_printf("create: remove a leftover pending file\n");
+    if (readFlash(pending, (uint32_t *)&h, sizeof(RoFsHeader)) != SPI_FLASH_RESULT_OK) {
+os_printf("create: error reading pending file header\n");
+        return -1;
+    }
+
+    // move ahead to the next sector boundary after the pending file header
+    p = (pending + sizeof(RoFsHeader) + SPI_FLASH_SEC_SIZE - 1) & ~(SPI_FLASH_SEC_SIZE - 1);
+
+    // convert the pending file header to deleted
+    h.flags &= ~(FLAG_PENDING | FLAG_ACTIVE);
+    h.nameLen = 0;
+    h.fileLenComp = p - pending - sizeof(RoFsHeader);
+    if (updateFlash(pending, (uint32_t *)&h, sizeof(RoFsHeader)) != SPI_FLASH_RESULT_OK) {
+os_printf("create: error updating pending file header\n");
+        return -1;
+    }
+
+    // write a new terminator
+    os_memset(&h, 0xff, sizeof(RoFsHeader));
+    h.magic = ROFS_MAGIC;
+    if (writeFlash(p, (uint32_t *)&h, sizeof(RoFsHeader)) != SPI_FLASH_RESULT_OK) {
+os_printf("create: error writing terminator\n");
+        return -1;
+    }
+
+    // the space used by the pending file can be reclaimed by compaction
+    fsReclaimable += p - pending;
+    if (compactCursor == NOT_FOUND || pending < compactCursor)
+        compactCursor = pending;
+
+    fsPending = NOT_FOUND;
+    fsEnd = p;
+    return writeSuperblock(fsEnd);
+}
+
+ROFFS_FILE ICACHE_FLASH_ATTR *roffs_create(const char *fileName)
+{
+    uint32_t insertionOffset, hash;
+	IndexEntry *entry;
+	int nameLen;
+	ROFFS_FILE *file;
 	RoFsHeader h;
 
-    // assume file won't be found
-    *pFileOffset = NOT_FOUND;
+    fsBusy = 0;
 
 	// make sure there is a filesystem mounted
     if (fsData == BAD_FILESYSTEM_BASE) {
-os_printf("find: filesystem not mounted\n");
+os_printf("create: filesystem not mounted\n");
+		return NULL;
+	}
+
+    // only one file can be written at a time
+    // this also keeps the pending file of the file being written from being removed below
+    if (fsWriter) {
+os_printf("create: another file is being written\n");
+        fsBusy = 1;
+        return NULL;
+    }
+
+	// strip initial slashes
+	while (fileName[0] == '/')
+        fileName++;
+    hash = hashName(fileName);
+
+    // a compaction step rewrites the sectors of its window so wait for the compaction timer to finish it
+    fsLastUse = system_get_time();
+    if (compactActive && yieldCompaction() != 0) {
+os_printf("create: waiting for compaction\n");
+        fsBusy = 1;
+        return NULL;
+    }
+
+    if (fsPending != NOT_FOUND && removePendingFile() != 0) {
+os_printf("create: can't remove pending file\n");
+        return NULL;
+    }
+
+    if ((insertionOffset = fsEnd) == NOT_FOUND) {
+os_printf("create: can't find insertion point\n");
+        return NULL;
+}
+
+	// make sure there is room for the header, the name and a new terminator
+	nameLen = (os_strlen(fileName) + 1 + 3) & ~3;
+	if (insertionOffset + sizeof(RoFsHeader) + nameLen + sizeof(RoFsHeader) > FILE_SPACE_END) {
+os_printf("create: filesystem full\n");
+        return NULL;
+}
+
+    if (!(file = (ROFFS_FILE *)os_malloc(sizeof(ROFFS_FILE)))) {
+os_printf("create: insufficient memory\n");
+        return NULL;
+}
+    if (!(file->buffer = (uint32_t *)os_malloc(WRITE_PAGE_SIZE))) {
+os_printf("create: insufficient memory\n");
+        os_free(file);
+        return NULL;
+}
+    file->buffered = 0;
+
+	// delete the old version of the file if one was found
+    if ((entry = findIndexEntry(fileName, hash)) != NULL && deleteIndexedFile(entry) != 0) {
+        os_free(file->buffer);
+        os_free(file);
+        return NULL;
+    }
+
+	h.magic = ROFS_MAGIC;
+	h.flags = FLAG_ACTIVE | FLAG_PENDING;
+	h.compression = COMPRESS_NONE;
+	h.nameLen = nameLen;
+	h.fileLenComp = 0xffffffff;
+	h.fileLenDecomp = 0xffffffff;
+
+    file->header = insertionOffset;
+    file->start = insertionOffset + sizeof(RoFsHeader) + h.nameLen;
+    file->offset = 0;
+    file->size = 0;
+    file->hash = hash;
+    file->flags = FLAG_LASTFILE;
+
+    // the new file is pending until it is closed
+    fsPending = insertionOffset;
+    fsEnd = NOT_FOUND;
+
+	if (writeFlash(insertionOffset, (uint32 *)&h, sizeof(RoFsHeader)) != SPI_FLASH_RESULT_OK) {
+os_printf("create: error writing new file header\n");
+        os_free(file->buffer);
+        os_free(file);
+        return NULL;
+    }
+	if (writeFlash(insertionOffset + sizeof(RoFsHeader), (uint32 *)fileName, h.nameLen) != SPI_FLASH_RESULT_OK) {
+os_printf("create: error reading new file name\n");
+        os_free(file->buffer);
+        os_free(file);
+        return NULL;
+    }
+
+    ++fsOpenFiles;
+    fsWriter = file;
+    return file;
+}
+
+// delete a file
+// files that are open keep their contents until they are closed since compaction waits for them
+int ICACHE_FLASH_ATTR roffs_delete(const char *fileName)
+{
+	IndexEntry *entry;
+	uint32_t hash;
+
+    fsBusy = 0;
+
+	// make sure there is a filesystem mounted
+    if (fsData == BAD_FILESYSTEM_BASE) {
+os_printf("delete: filesystem not mounted\n");
 		return -1;
 	}
 
@@ -234,75 +710,574 @@ os_printf("find: filesystem not mounted\n");
 	while (fileName[0] == '/')
         fileName++;
 
-	// find the file
+    // the header of a file that is being moved by compaction can't be updated
+    fsLastUse = system_get_time();
+    hash = hashName(fileName);
+    if ((compactRecovering || overlapsCompaction(hash)) && yieldCompaction() != 0) {
+        fsBusy = 1;
+        return -1;
+    }
+
+    if (!(entry = findIndexEntry(fileName, hash)))
+        return -1;
+
+    return deleteIndexedFile(entry);
+}
+
+// get the name of the first active file at or after a position in the log
+// start with a position of zero, the position is advanced past the file that is returned
+// so files come back oldest first, the order can't be followed while compaction moves files
+int ICACHE_FLASH_ATTR roffs_next_file(uint32_t *pPosition, char *name, int size)
+{
+	char namebuf[256];
+    IndexEntry *next = NULL;
+    int nameLen, i;
+
+    fsBusy = 0;
+
+    if (fsData == BAD_FILESYSTEM_BASE || size <= 0)
+        return -1;
+
+    if (compactActive) {
+        fsBusy = 1;
+        return -1;
+    }
+
+    for (i = 0; i < fsIndexSize; ++i) {
+        IndexEntry *entry = &fsIndex[i];
+        if (entry->header != INDEX_EMPTY && entry->header != INDEX_REMOVED && entry->header >= *pPosition
+        &&  (!next || entry->header < next->header))
+            next = entry;
+    }
+    if (!next)
+        return -1;
+
+    nameLen = next->nameLen < sizeof(namebuf) ? next->nameLen : sizeof(namebuf);
+    if (readFlash(next->header + sizeof(RoFsHeader), namebuf, nameLen) != SPI_FLASH_RESULT_OK) {
+os_printf("next: %08lx error reading file name\n", next->header);
+        return -1;
+    }
+    namebuf[sizeof(namebuf) - 1] = '\0';
+
+    os_strncpy(name, namebuf, size);
+    name[size - 1] = '\0';
+    *pPosition = next->header + 1;
+    return 0;
+}
+
+int ICACHE_FLASH_ATTR roffs_write(ROFFS_FILE *file, char *buf, int len)
+{
+    int remaining = len;
+
+    if (file->start + file->size + len + 3 + sizeof(RoFsHeader) > FILE_SPACE_END) {
+os_printf("write: filesystem full\n");
+        return -1;
+    }
+
+    while (remaining > 0) {
+
+        // fill the buffer up to the end of the current flash page
+        int room = WRITE_PAGE_SIZE - ((file->start + file->size) & (WRITE_PAGE_SIZE - 1));
+        int cnt = remaining < room ? remaining : room;
+        os_memcpy((uint8_t *)file->buffer + file->buffered, buf, cnt);
+        file->buffered += cnt;
+        file->offset += cnt;
+        file->size += cnt;
+        buf += cnt;
+        remaining -= cnt;
+
+        // program the page when it is complete
+        if (cnt == room && flushWriteBuffer(file) != 0)
+            return -1;
+    }
+
+    return len;
+}
+
+// program the buffered data padded to a whole number of longs
+// the buffer always starts on a long boundary since files start on one and it is flushed at page boundaries
+static int ICACHE_FLASH_ATTR flushWriteBuffer(ROFFS_FILE *file)
+{
+    int size = (file->buffered + 3) & ~3;
+
+    if (file->buffered == 0)
+        return 0;
+
+    os_memset((uint8_t *)file->buffer + file->buffered, 0xff, size - file->buffered);
+    if (writeFlash(file->start + file->size - file->buffered, file->buffer, size) != SPI_FLASH_RESULT_OK) {
+os_printf("write: error writing to file\n");
+        return -1;
+    }
+    file->buffered = 0;
+
+    return 0;
+}
+
+// find the first deleted file at or after the cursor and start a compaction step that removes it
+// returns 1 if there is more to do, 0 if there is nothing to compact and -1 on an error
+static int ICACHE_FLASH_ATTR planCompaction(void)
+{
+    CompactPlan *plan = &compactPlan;
+    uint32_t p = compactCursor, d, windowEnd, len = 0;
+    int32_t magic = COMPACT_MAGIC;
+    int last = 0, n = 0;
+	RoFsHeader h;
+
+    // find the first deleted file
+	for (;;) {
+		if (readFlash(p, &h, sizeof(RoFsHeader)) != SPI_FLASH_RESULT_OK || h.magic != ROFS_MAGIC) {
+os_printf("compact: %08lx bad file header\n", p);
+            compactCursor = NOT_FOUND;
+            return -1;
+        }
+        if (h.flags & FLAG_LASTFILE) {
+            compactCursor = NOT_FOUND;
+            return 0;
+        }
+        if (!(h.flags & (FLAG_ACTIVE | FLAG_PENDING)))
+            break;
+        p += entryLength(&h);
+    }
+
+    // keep whatever precedes the deleted file in its first sector
+    os_memset(plan, 0xff, sizeof(CompactPlan));
+    plan->start = p & ~(SPI_FLASH_SEC_SIZE - 1);
+    plan->from = p;
+    if (p > plan->start) {
+        plan->segments[n].dst = plan->start;
+        plan->segments[n].src = plan->start;
+        plan->segments[n++].len = p - plan->start;
+    }
+
+    // move the active files that follow down over the deleted files as long as they fit in the window
+    for (d = p; ; p += len) {
+		if (readFlash(p, &h, sizeof(RoFsHeader)) != SPI_FLASH_RESULT_OK || h.magic != ROFS_MAGIC) {
+os_printf("compact: %08lx bad file header\n", p);
+            compactCursor = NOT_FOUND;
+            return -1;
+        }
+        if (h.flags & FLAG_LASTFILE) {
+            last = 1;
+            break;
+        }
+        len = entryLength(&h);
+        if (h.flags & FLAG_ACTIVE) {
+            windowEnd = (d + len + sizeof(RoFsHeader) + SPI_FLASH_SEC_SIZE - 1) & ~(SPI_FLASH_SEC_SIZE - 1);
+            if (n >= COMPACT_MAX_SEGMENTS - 1 || windowEnd - plan->start > COMPACT_MAX_SECTORS * SPI_FLASH_SEC_SIZE)
+                break;
+            plan->segments[n].dst = d;
+            plan->segments[n].src = p;
+            plan->segments[n++].len = len;
+            d += len;
+        }
+    }
+    plan->to = p;
+
+    // skip over a file that is too big to move
+    if (!last && d == plan->from) {
+os_printf("compact: %08lx file too big to move\n", p);
+        compactCursor = p + len;
+        return 1;
+    }
+
+    // follow the moved files with the terminator or with a deleted file that reaches the first file left in place
+    os_memset(&plan->tailHeader, 0xff, sizeof(RoFsHeader));
+    plan->tailHeader.magic = ROFS_MAGIC;
+    if (!last) {
+        plan->tailHeader.flags = 0;
+        plan->tailHeader.compression = COMPRESS_NONE;
+        plan->tailHeader.nameLen = 0;
+        plan->tailHeader.fileLenComp = plan->to - d - sizeof(RoFsHeader);
+        plan->tailHeader.fileLenDecomp = plan->tailHeader.fileLenComp;
+    }
+    plan->tail = d;
+
+    // keep whatever follows in the last sector of the window
+    windowEnd = (d + sizeof(RoFsHeader) + SPI_FLASH_SEC_SIZE - 1) & ~(SPI_FLASH_SEC_SIZE - 1);
+    if (!last && plan->to < windowEnd) {
+        plan->segments[n].dst = plan->to;
+        plan->segments[n].src = plan->to;
+        plan->segments[n++].len = windowEnd - plan->to;
+    }
+    plan->sectorCount = (windowEnd - plan->start) / SPI_FLASH_SEC_SIZE;
+    plan->segmentCount = n;
+
+os_printf("compact: window %08lx-%08lx moves %08lx-%08lx to %08lx\n", plan->start, windowEnd, plan->from, plan->to, plan->from);
+
+    // record the plan and then make it valid by writing the magic number
+    if (writeFlash(COMPACT_JOURNAL, (uint32_t *)plan, sizeof(CompactPlan)) != SPI_FLASH_RESULT_OK
+    ||  updateFlash(COMPACT_JOURNAL, (uint32_t *)&magic, sizeof(magic)) != SPI_FLASH_RESULT_OK) {
+os_printf("compact: error writing journal\n");
+        return -1;
+    }
+    plan->magic = magic;
+
+    compactActive = 1;
+    compactSector = 0;
+    compactBuilt = 0;
+    return 1;
+}
+
+// build the new contents of the next sector of the window in the scratch sector or copy them back
+static int ICACHE_FLASH_ATTR continueCompaction(void)
+{
+    uint32_t sector = compactPlan.start + compactSector * SPI_FLASH_SEC_SIZE;
+    uint32_t buf[COMPACT_CHUNK_SIZE / sizeof(uint32_t)];
+    int offset;
+
+    if (compactSector >= compactPlan.sectorCount)
+        return finishCompaction();
+
+    if (!compactBuilt) {
+        for (offset = 0; offset < SPI_FLASH_SEC_SIZE; offset += COMPACT_CHUNK_SIZE) {
+            fillCompactChunk(sector + offset, buf);
+            if (writeFlash(COMPACT_SCRATCH + offset, buf, COMPACT_CHUNK_SIZE) != SPI_FLASH_RESULT_OK) {
+os_printf("compact: error writing scratch sector\n");
+                return -1;
+            }
+        }
+        if (markCompactProgress(compactSector, 0) != 0)
+            return -1;
+        compactBuilt = 1;
+    }
+
+    else {
+        for (offset = 0; offset < SPI_FLASH_SEC_SIZE; offset += COMPACT_CHUNK_SIZE) {
+            if (readFlash(COMPACT_SCRATCH + offset, buf, COMPACT_CHUNK_SIZE) != SPI_FLASH_RESULT_OK
+            ||  writeFlash(sector + offset, buf, COMPACT_CHUNK_SIZE) != SPI_FLASH_RESULT_OK) {
+os_printf("compact: %08lx error copying scratch sector\n", sector);
+                return -1;
+            }
+        }
+        if (markCompactProgress(compactSector, 1) != 0)
+            return -1;
+        ++compactSector;
+        compactBuilt = 0;
+    }
+
+    return 0;
+}
+
+// mark the plan complete and index the files in their new locations
+static int ICACHE_FLASH_ATTR finishCompaction(void)
+{
+    uint32_t complete = 0;
+
+    if (updateFlash(COMPACT_JOURNAL + sizeof(int32_t), &complete, sizeof(complete)) != SPI_FLASH_RESULT_OK) {
+os_printf("compact: error writing journal\n");
+        return -1;
+    }
+    compactActive = 0;
+    compactYielded = 0;
+
+    // continue with the filler that now holds all of the deleted space
+    compactCursor = compactPlan.tailHeader.flags & FLAG_LASTFILE ? NOT_FOUND : compactPlan.tail;
+
+    // the mount that found the step interrupted fails if the files reach into the reserved sectors
+    if (buildIndex() != 0) {
+        if (compactRecovering) {
+            compactRecovering = 0;
+            fsData = BAD_FILESYSTEM_BASE;
+        }
+        return -1;
+    }
+
+    // finish the mount that found the step interrupted
+    if (compactRecovering) {
+        compactRecovering = 0;
+        compactCursor = fsReclaimable > 0 ? fsData : NOT_FOUND;
+        checkSuperblock();
+        return 0;
+    }
+
+    // record the new end of the log
+    return fsEnd != NOT_FOUND && fsEnd != superEnd ? writeSuperblock(fsEnd) : 0;
+}
+
+// find a compaction step that was interrupted so roffs_compact can finish it
+static int ICACHE_FLASH_ATTR recoverCompaction(void)
+{
+    uint32_t progress[2];
+
+    compactActive = 0;
+    compactRecovering = 0;
+    compactYielded = 0;
+
+    if (readFlash(COMPACT_JOURNAL, (uint32_t *)&compactPlan, sizeof(CompactPlan)) != SPI_FLASH_RESULT_OK)
+        return -1;
+    if (compactPlan.magic != COMPACT_MAGIC || compactPlan.complete == 0
+    ||  compactPlan.start < fsData || compactPlan.sectorCount > COMPACT_MAX_SECTORS || compactPlan.segmentCount > COMPACT_MAX_SEGMENTS)
+        return 0;
+
+    // find the first sector that hasn't been copied back
+    for (compactSector = 0; compactSector < compactPlan.sectorCount; ++compactSector) {
+        if (readFlash(COMPACT_JOURNAL + sizeof(CompactPlan) + compactSector * sizeof(progress), progress, sizeof(progress)) != SPI_FLASH_RESULT_OK)
+            return -1;
+        if (progress[1] == 0xffffffff)
+            break;
+    }
+    compactBuilt = progress[0] != 0xffffffff;
+
+os_printf("compact: interrupted step continues at sector %d\n", compactSector);
+    compactActive = 1;
+    compactRecovering = 1;
+    return 0;
+}
+
+// get the current compaction step out of the way of a file
+// returns -1 if the step has to be left to roffs_compact
+static int ICACHE_FLASH_ATTR yieldCompaction(void)
+{
+    uint32_t complete = 0;
+
+    if (!compactActive)
+        return 0;
+
+    // finish a step that is almost done
+    if (compactPlan.sectorCount - compactSector <= COMPACT_SYNC_SECTORS) {
+        while (compactActive)
+            if (continueCompaction() != 0)
+                return -1;
+        return fsData != BAD_FILESYSTEM_BASE ? 0 : -1;
+    }
+
+    // a step that was abandoned once is never abandoned again so creates can't starve compaction
+    if (compactRecovering || compactSector > 0 || compactYielded)
+        return -1;
+
+    // the cursor still points at the deleted file so the step is planned again later
+    if (updateFlash(COMPACT_JOURNAL + sizeof(int32_t), &complete, sizeof(complete)) != SPI_FLASH_RESULT_OK) {
+os_printf("compact: error writing journal\n");
+        return -1;
+    }
+os_printf("compact: step abandoned\n");
+    compactActive = 0;
+    compactYielded = 1;
+    return 0;
+}
+
+// fill a chunk of the new contents of the window
+static void ICACHE_FLASH_ATTR fillCompactChunk(uint32_t addr, uint32_t *buf)
+{
+    uint32_t end = addr + COMPACT_CHUNK_SIZE, lo, hi;
+    int i;
+
+    os_memset(buf, 0xff, COMPACT_CHUNK_SIZE);
+
+    for (i = 0; i < compactPlan.segmentCount; ++i) {
+        CompactSegment *segment = &compactPlan.segments[i];
+        lo = segment->dst > addr ? segment->dst : addr;
+        hi = segment->dst + segment->len < end ? segment->dst + segment->len : end;
+        if (lo < hi)
+            readFlash(segment->src + (lo - segment->dst), (uint8_t *)buf + (lo - addr), hi - lo);
+    }
+
+    lo = compactPlan.tail > addr ? compactPlan.tail : addr;
+    hi = compactPlan.tail + sizeof(RoFsHeader) < end ? compactPlan.tail + sizeof(RoFsHeader) : end;
+    if (lo < hi)
+        os_memcpy((uint8_t *)buf + (lo - addr), (uint8_t *)&compactPlan.tailHeader + (lo - compactPlan.tail), hi - lo);
+}
+
+static int ICACHE_FLASH_ATTR markCompactProgress(int sector, int copied)
+{
+    uint32_t done = 0;
+    uint32_t addr = COMPACT_JOURNAL + sizeof(CompactPlan) + (sector * 2 + copied) * sizeof(uint32_t);
+    if (updateFlash(addr, &done, sizeof(done)) != SPI_FLASH_RESULT_OK) {
+os_printf("compact: error writing journal\n");
+        return -1;
+    }
+    return 0;
+}
+
+// check for a file with the given name hash in the sectors being rewritten by compaction
+// the names of these files can't be checked since they may already have been overwritten
+static int ICACHE_FLASH_ATTR overlapsCompaction(uint32_t hash)
+{
+    uint32_t end = compactWindowEnd();
+    int i;
+
+    if (!compactActive || fsIndexSize == 0)
+        return 0;
+
+    for (i = hash & (fsIndexSize - 1); fsIndex[i].header != INDEX_EMPTY; i = (i + 1) & (fsIndexSize - 1)) {
+        IndexEntry *entry = &fsIndex[i];
+        if (entry->header != INDEX_REMOVED && entry->hash == hash
+        &&  entry->header < end && entry->header + sizeof(RoFsHeader) + entry->nameLen + entry->size > compactPlan.start)
+            return 1;
+    }
+
+    return 0;
+}
+
+static uint32_t ICACHE_FLASH_ATTR compactWindowEnd(void)
+{
+    return compactPlan.start + compactPlan.sectorCount * SPI_FLASH_SEC_SIZE;
+}
+
+// find the latest superblock record
+static int ICACHE_FLASH_ATTR readSuperblock(void)
+{
+    SuperRecord records[COMPACT_CHUNK_SIZE / sizeof(SuperRecord)];
+    uint32_t offset;
+    int i;
+
+    superGeneration = 0;
+    superEnd = NOT_FOUND;
+
+    for (offset = 0; offset < SPI_FLASH_SEC_SIZE; offset += sizeof(records)) {
+        if (readFlash(SUPERBLOCK + offset, records, sizeof(records)) != SPI_FLASH_RESULT_OK)
+            return -1;
+        for (i = 0; i < sizeof(records) / sizeof(SuperRecord); ++i) {
+            SuperRecord *record = &records[i];
+
+            // the first unused record is where the next one goes
+            if (record->magic == -1 && record->generation == 0xffffffff && record->end == 0xffffffff && record->check == 0xffffffff) {
+                superNext = offset + i * sizeof(SuperRecord);
+                return 0;
+            }
+
+            if (record->magic == SUPERBLOCK_MAGIC && record->check == ~(record->generation ^ record->end)
+            &&  record->generation >= superGeneration) {
+                superGeneration = record->generation;
+                superEnd = record->end;
+            }
+        }
+    }
+
+    // the superblock is full
+    superNext = SPI_FLASH_SEC_SIZE;
+    return 0;
+}
+
+// append a record of the end of the log to the superblock
+static int ICACHE_FLASH_ATTR writeSuperblock(uint32_t end)
+{
+    SuperRecord record;
+
+    // don't write over a file that extends into the superblock sector
+    if (end + sizeof(RoFsHeader) > SUPERBLOCK)
+        return 0;
+
+    // start over at the beginning of the sector when it is full, this erases it
+    if (superNext >= SPI_FLASH_SEC_SIZE)
+        superNext = 0;
+
+    record.magic = SUPERBLOCK_MAGIC;
+    record.generation = ++superGeneration;
+    record.end = end;
+    record.check = ~(record.generation ^ record.end);
+    if (writeFlash(SUPERBLOCK + superNext, (uint32_t *)&record, sizeof(record)) != SPI_FLASH_RESULT_OK) {
+os_printf("superblock: error writing record\n");
+        return -1;
+    }
+    superNext += sizeof(record);
+    superEnd = end;
+
+    return 0;
+}
+
+// compare the end of the log found by walking the files with the one recorded in the superblock
+static void ICACHE_FLASH_ATTR checkSuperblock(void)
+{
+	RoFsHeader h;
+
+    // a leftover pending file moves the end when it is removed
+    if (fsPending != NOT_FOUND)
+        return;
+
+    // the superblock is out of date if the last update was interrupted
+    if (fsEnd != NOT_FOUND) {
+        if (fsEnd != superEnd) {
+os_printf("mount: superblock end %08lx doesn't match %08lx\n", superEnd, fsEnd);
+            writeSuperblock(fsEnd);
+        }
+    }
+
+    // a damaged file header stopped the walk so continue at the recorded end if it is a terminator
+    else if (superEnd != NOT_FOUND && superEnd > fsData && superEnd < FILE_SPACE_END
+         &&  readFlash(superEnd, &h, sizeof(RoFsHeader)) == SPI_FLASH_RESULT_OK
+         &&  h.magic == ROFS_MAGIC && (h.flags & FLAG_LASTFILE)) {
+os_printf("mount: damaged filesystem, new files go at %08lx\n", superEnd);
+        fsEnd = superEnd;
+    }
+}
+
+// size of a file including its header and name
+static uint32_t ICACHE_FLASH_ATTR entryLength(RoFsHeader *h)
+{
+    return (sizeof(RoFsHeader) + h->nameLen + h->fileLenComp + 3) & ~3;
+}
+
+// walk the filesystem once to index the active files and find the insertion point
+// returns -2 if the files reach into the sectors reserved for the superblock and compaction
+static int ICACHE_FLASH_ATTR buildIndex(void)
+{
+    uint32_t p = fsData;
+	char namebuf[256];
+	RoFsHeader h;
+
+    resetIndex();
+    fsEnd = NOT_FOUND;
+    fsPending = NOT_FOUND;
+    fsReclaimable = 0;
+
 	for (;;) {
 
+		// the superblock, journal and scratch sectors follow the file space
+		if (p + sizeof(RoFsHeader) > FILE_SPACE_END) {
+os_printf("mount: %08lx files reach into the reserved sectors\n", p);
+            return -2;
+        }
+
 		// read the next file header
 		if (readFlash(p, &h, sizeof(RoFsHeader)) != SPI_FLASH_RESULT_OK) {
-os_printf("find: %08lx error reading file header\n", p);
-            return -1;
+os_printf("mount: %08lx error reading file header\n", p);
+            return 0;
         }
 
         // check the magic number
+        // files before a bad header can still be opened but no new files can be created
 		if (h.magic != ROFS_MAGIC) {
-os_printf("find: %08lx bad magic number\n", p);
-            return -1;
+os_printf("mount: %08lx bad magic number\n", p);
+            return 0;
         }
 
 		// check for the end of image marker
         if (h.flags & FLAG_LASTFILE) {
-os_printf("find: %08lx insertion point\n", p);
-            *pInsertionOffset = p;
+os_printf("mount: %08lx insertion point\n", p);
+            fsEnd = p;
             return 0;
         }
 
-		// remove a leftover pending file
+		// a leftover pending file is always the last file and is removed by the next create
+		// nothing can be writing it since the filesystem has just been mounted
 		else if (h.flags & FLAG_PENDING) {
-		    uint32_t pending = p;
-os_printf("find: remove a leftover pending file\n");
-		    
-		    // move ahead to next sector boundary
-		    p = (p + SPI_FLASH_SEC_SIZE - 1) & (SPI_FLASH_SEC_SIZE - 1);
-		    
-		    // convert the pending file header to deleted
-		    h.flags &= ~FLAG_PENDING;
-		    h.nameLen = 0;
-		    h.fileLenComp = p - pending - sizeof(RoFsHeader);
-		    if (updateFlash(pending, (uint32_t *)&h, sizeof(RoFsHeader)) != SPI_FLASH_RESULT_OK) {
-os_printf("find: error updating pending file header\n");
-                return -1;
-		    }
-		    
-		    // write a new terminator
-		    memset(&h, 0xff, sizeof(RoFsHeader));
-		    h.magic = ROFS_MAGIC;
-		    if (writeFlash(p, (uint32_t *)&h, sizeof(RoFsHeader)) != SPI_FLASH_RESULT_OK) {
-os_printf("find: error writing terminator\n");
-		    }
-		    
-		    *pInsertionOffset = p;
-		    return 0;
-		}
-		
-		// only check active files
+os_printf("mount: %08lx leftover pending file\n", p);
+            fsPending = p;
+            return 0;
+        }
+
+		// only index active files
         else if (h.flags & FLAG_ACTIVE) {
+            int nameLen = h.nameLen < sizeof(namebuf) ? h.nameLen : sizeof(namebuf);
 
             // get the name of the file
-		    if (readFlash(p + sizeof(RoFsHeader), namebuf, sizeof(namebuf)) != SPI_FLASH_RESULT_OK) {
-os_printf("find: %08lx error reading file name\n", p);
-                return -1;
+		    if (readFlash(p + sizeof(RoFsHeader), namebuf, nameLen) != SPI_FLASH_RESULT_OK) {
+os_printf("mount: %08lx error reading file name\n", p);
+                return 0;
             }
+            namebuf[sizeof(namebuf) - 1] = '\0';
 
-os_printf("find: %08lx checking '%s'\n", p, namebuf);
-		    // check to see if this is the file we're looking for
-            if (os_strcmp(namebuf, fileName) == 0)
-                *pFileOffset = p;
+os_printf("mount: %08lx indexing '%s'\n", p, namebuf);
+            if (addIndexEntry(hashName(namebuf), p, &h) != 0) {
+os_printf("mount: insufficient memory for index\n");
+                return -1;
+            }
         }
-        
+
         // deleted file
-        else {
-os_printf("find: %08lx skipping deleted file\n", p);
-        }
+        else
+            fsReclaimable += entryLength(&h);
 
 		// skip over the file data
 		p += sizeof(RoFsHeader) + h.nameLen + h.fileLenComp;
@@ -310,80 +1285,148 @@ os_printf("find: %08lx skipping deleted file\n", p);
 		// align to next 32 bit offset
         p = (p + 3) & ~3;
 	}
-
-    // never reached
-os_printf("find: internal error\n");
-    return -1;
 }
 
-ROFFS_FILE ICACHE_FLASH_ATTR *roffs_create(const char *fileName)
+// mark an indexed file deleted and remove it from the index
+static int ICACHE_FLASH_ATTR deleteIndexedFile(IndexEntry *entry)
 {
-    uint32_t fileOffset, insertionOffset;
-	ROFFS_FILE *file;
 	RoFsHeader h;
 
-    if (find_file_and_insertion_point(fileName, &fileOffset, &insertionOffset) != 0) {
-os_printf("create: can't find insertion point\n");
-        return NULL;
+    if (readFlash(entry->header, (uint32 *)&h, sizeof(RoFsHeader)) != SPI_FLASH_RESULT_OK) {
+os_printf("delete: error reading file header\n");
+        return -1;
+    }
+    h.flags &= ~FLAG_ACTIVE;
+    if (updateFlash(entry->header, (uint32 *)&h, sizeof(RoFsHeader)) != SPI_FLASH_RESULT_OK) {
+os_printf("delete: error writing file header\n");
+        return -1;
+    }
+    fsReclaimable += entryLength(&h);
+    if (compactCursor == NOT_FOUND || entry->header < compactCursor)
+        compactCursor = entry->header;
+    entry->header = INDEX_REMOVED;
+    return 0;
 }
 
-    if (!(file = (ROFFS_FILE *)os_malloc(sizeof(ROFFS_FILE)))) {
-os_printf("create: insufficient memory\n");
-        return NULL;
+static void ICACHE_FLASH_ATTR resetIndex(void)
+{
+    int i;
+    for (i = 0; i < fsIndexSize; ++i)
+        fsIndex[i].header = INDEX_EMPTY;
+    fsIndexUsed = 0;
 }
 
-	// delete the old version of the file if one was found
-    if (fileOffset != NOT_FOUND) {
-        if (readFlash(fileOffset, (uint32 *)&h, sizeof(RoFsHeader)) != SPI_FLASH_RESULT_OK) {
-os_printf("create: error reading old file header\n");
-            os_free(file);
-            return NULL;
-        }
-        h.flags &= ~FLAG_ACTIVE;
-	    if (updateFlash(fileOffset, (uint32 *)&h, sizeof(RoFsHeader)) != SPI_FLASH_RESULT_OK) {
-os_printf("create: error writing old file header\n");
-            os_free(file);
-            return NULL;
+// find the index entry for an active file
+// the name is checked against the flash since different names can have the same hash
+static IndexEntry ICACHE_FLASH_ATTR *findIndexEntry(const char *fileName, uint32_t hash)
+{
+	char namebuf[256];
+    int i;
+
+    if (fsIndexSize == 0)
+        return NULL;
+
+    for (i = hash & (fsIndexSize - 1); fsIndex[i].header != INDEX_EMPTY; i = (i + 1) & (fsIndexSize - 1)) {
+        IndexEntry *entry = &fsIndex[i];
+        if (entry->header != INDEX_REMOVED && entry->hash == hash) {
+            int nameLen = entry->nameLen < sizeof(namebuf) ? entry->nameLen : sizeof(namebuf);
+		    if (readFlash(entry->header + sizeof(RoFsHeader), namebuf, nameLen) != SPI_FLASH_RESULT_OK) {
+os_printf("find: %08lx error reading file name\n", entry->header);
+                return NULL;
+            }
+            namebuf[sizeof(namebuf) - 1] = '\0';
+            if (os_strcmp(namebuf, fileName) == 0)
+                return entry;
         }
     }
 
-	h.magic = ROFS_MAGIC;
-	h.flags = FLAG_ACTIVE | FLAG_PENDING;
-	h.compression = COMPRESS_NONE;
-	h.nameLen = (os_strlen(fileName) + 1 + 3) & ~3;
-	h.fileLenComp = 0xffffffff;
-	h.fileLenDecomp = 0xffffffff;
+    return NULL;
+}
 
-    file->header = insertionOffset;
-    file->start = insertionOffset + sizeof(RoFsHeader) + h.nameLen;
-    file->offset = 0;
-    file->size = 0;
-    file->flags = FLAG_LASTFILE;
+static int ICACHE_FLASH_ATTR addIndexEntry(uint32_t hash, uint32_t header, RoFsHeader *h)
+{
+    IndexEntry *entry;
+    int i;
 
-	if (writeFlash(insertionOffset, (uint32 *)&h, sizeof(RoFsHeader)) != SPI_FLASH_RESULT_OK) {
-os_printf("create: error writing new file header\n");
-        os_free(file);
-        return NULL;
+    // keep the index no more than three quarters full
+    if ((fsIndexUsed + 1) * 4 > fsIndexSize * 3 && growIndex() != 0)
+        return -1;
+
+    for (i = hash & (fsIndexSize - 1); fsIndex[i].header != INDEX_EMPTY; i = (i + 1) & (fsIndexSize - 1))
+        ;
+
+    entry = &fsIndex[i];
+    entry->hash = hash;
+    entry->header = header;
+    entry->size = h->fileLenComp;
+    entry->nameLen = h->nameLen;
+    entry->flags = h->flags;
+    ++fsIndexUsed;
+
+    return 0;
+}
+
+// rehash the active files into a new index dropping the removed entries
+static int ICACHE_FLASH_ATTR growIndex(void)
+{
+    IndexEntry *oldIndex = fsIndex;
+    int oldSize = fsIndexSize;
+    int newSize = INDEX_MIN_SIZE;
+    int count = 0;
+    int i, j;
+
+    for (i = 0; i < oldSize; ++i)
+        if (oldIndex[i].header != INDEX_EMPTY && oldIndex[i].header != INDEX_REMOVED)
+            ++count;
+
+    while ((count + 1) * 2 > newSize)
+        newSize *= 2;
+
+    if (!(fsIndex = (IndexEntry *)os_malloc(newSize * sizeof(IndexEntry)))) {
+        fsIndex = oldIndex;
+        return -1;
     }
-	if (writeFlash(insertionOffset + sizeof(RoFsHeader), (uint32 *)fileName, h.nameLen) != SPI_FLASH_RESULT_OK) {
-os_printf("create: error reading new file name\n");
-        os_free(file);
-        return NULL;
+    fsIndexSize = newSize;
+    resetIndex();
+
+    for (i = 0; i < oldSize; ++i) {
+        IndexEntry *entry = &oldIndex[i];
+        if (entry->header != INDEX_EMPTY && entry->header != INDEX_REMOVED) {
+            for (j = entry->hash & (newSize - 1); fsIndex[j].header != INDEX_EMPTY; j = (j + 1) & (newSize - 1))
+                ;
+            fsIndex[j] = *entry;
+            ++fsIndexUsed;
+        }
     }
-    
-    return file;
+
+    if (oldIndex)
+        os_free(oldIndex);
+
+    return 0;
 }
 
-int ICACHE_FLASH_ATTR roffs_write(ROFFS_FILE *file, char *buf, int len)
+// find the end of the flash available to the filesystem from the size of the flash chip
+static uint32_t ICACHE_FLASH_ATTR flashFilesystemEnd(void)
 {
-    int roundedLen = (len + 3) & ~3;
-    if (writeFlash(file->start + file->size, (uint32 *)buf, roundedLen) != SPI_FLASH_RESULT_OK) {
-os_printf("write: error writing to file\n");
-        return -1;
+#ifdef FLASH_FILESYSTEM_END
+    return FLASH_FILESYSTEM_END;
+#else
+    // the third byte of the JEDEC id is log2 of the capacity
+    int capacity = (spi_flash_get_id() >> 16) & 0xff;
+    uint32_t size = capacity >= 19 && capacity < 22 ? 1 << capacity : FLASH_MAX_SIZE;
+    return size - FLASH_SYSTEM_PARAM_SIZE;
+#endif
+}
+
+// FNV-1a hash of a file name
+static uint32_t ICACHE_FLASH_ATTR hashName(const char *name)
+{
+    uint32_t hash = 2166136261;
+    while (*name) {
+        hash ^= (uint8_t)*name++;
+        hash *= 16777619;
     }
-    file->offset += len;
-    file->size += len;
-    return len;
+    return hash;
 }
 
 static int ICACHE_FLASH_ATTR readFlash(uint32_t addr, void *buf, int size)
@@ -5,6 +5,11 @@
 
 #define FLASH_FILESYSTEM_BASE   0x100000
 
+// the filesystem ends where the SDK keeps its system parameters in the last 16KB of the flash chip
+// roffs_mount finds the size of the chip unless FLASH_FILESYSTEM_END is defined
+#define FLASH_SYSTEM_PARAM_SIZE (16 * 1024)
+#define FLASH_MAX_SIZE          0x400000    // the SDK only uses the first 4MB of larger chips
+
 /* must match definitions in roffsformat.h */
 #define ROFFS_FLAG_GZIP (1<<1)
 
@@ -19,15 +24,23 @@ typedef struct ROFFS_FILE_STRUCT ROFFS_FILE;
 #endif
 
 int roffs_mount(uint32_t flashAddress);
+int roffs_unmount(void);
 int roffs_format(uint32_t flashAddress);
 ROFFS_FILE *roffs_open(const char *fileName);
 int roffs_file_size(ROFFS_FILE *file);
 int roffs_file_flags(ROFFS_FILE *file);
+int roffs_file_position(ROFFS_FILE *file);
 int roffs_read(ROFFS_FILE *file, char *buf, int len);
+int roffs_compact(void);
+int roffs_space(uint32_t *pFree, uint32_t *pReclaimable);
 int roffs_close(ROFFS_FILE *file);
+int roffs_discard(ROFFS_FILE *file);
+int roffs_busy(void);
 
 ROFFS_FILE *roffs_create(const char *fileName);
 int roffs_write(ROFFS_FILE *file, char *buf, int len);
+int roffs_delete(const char *fileName);
+int roffs_next_file(uint32_t *pPosition, char *name, int size);
 
 #endif
 
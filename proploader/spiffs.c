@@ -40,6 +40,12 @@ int ICACHE_FLASH_ATTR roffs_mount(uint32_t flashAddress)
     return res == SPIFFS_OK ? 0 : -1;
 }
 
+int ICACHE_FLASH_ATTR roffs_unmount(void)
+{
+    SPIFFS_unmount(&fs);
+    return 0;
+}
+
 ROFFS_FILE ICACHE_FLASH_ATTR *roffs_open(const char *fileName)
 {
     ROFFS_FILE *file;
@@ -74,11 +80,31 @@ int ICACHE_FLASH_ATTR roffs_file_flags(ROFFS_FILE *file)
     return 0; // no place to store this metadata
 }
 
+int ICACHE_FLASH_ATTR roffs_file_position(ROFFS_FILE *file)
+{
+    return 0; // spiffs doesn't keep files in the order they were written
+}
+
 int ICACHE_FLASH_ATTR roffs_read(ROFFS_FILE *file, char *buf, int len)
 {
     return SPIFFS_read(&fs, file->fd, buf, len);
 }
 
+int ICACHE_FLASH_ATTR roffs_compact(void)
+{
+    return 0; // spiffs reclaims deleted space itself
+}
+
+int ICACHE_FLASH_ATTR roffs_space(uint32_t *pFree, uint32_t *pReclaimable)
+{
+    return -1;
+}
+
+int ICACHE_FLASH_ATTR roffs_busy(void)
+{
+    return 0; // spiffs allows more than one file to be written at a time
+}
+
 ROFFS_FILE ICACHE_FLASH_ATTR *roffs_create(const char *fileName, int size)
 {
     ROFFS_FILE *file;
@@ -98,5 +124,15 @@ int ICACHE_FLASH_ATTR roffs_write(ROFFS_FILE *file, char *buf, int len)
     return SPIFFS_write(&fs, file->fd, buf, len);
 }
 
+int ICACHE_FLASH_ATTR roffs_delete(const char *fileName)
+{
+    return SPIFFS_remove(&fs, fileName) == SPIFFS_OK ? 0 : -1;
+}
+
+int ICACHE_FLASH_ATTR roffs_next_file(uint32_t *pPosition, char *name, int size)
+{
+    return -1; // spiffs doesn't keep files in the order they were written
+}
+
 #endif
 
@@ -213,9 +213,8 @@ static void do_reply(int argc, char *argv[])
     httpdHeader(h->connData, "Content-Length", buf);
     httpdEndHeaders(h->connData);
     httpdSend(h->connData, argv[2], len);
-    httpdFlush(h->connData);
-    
     h->connData->cgi = NULL;
+    httpdFlush(h->connData);
     h->connData = NULL;
     
     sendResponse("OK");
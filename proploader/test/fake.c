@@ -0,0 +1,294 @@
+#include <esp8266.h>
+#include "cgi.h"
+#include "config.h"
+#include "serbridge.h"
+#include "uart.h"
+#include "fake.h"
+
+#define FAKE_UART_TX_SIZE   (256 * 1024)
+#define FAKE_RESPONSE_SIZE  (32 * 1024)
+#define FAKE_TIMER_MAX      32
+
+uint8_t fakeFlash[FAKE_FLASH_SIZE];
+
+uint8_t fakeUartTx[FAKE_UART_TX_SIZE];
+int fakeUartTxCount;
+int fakeBaudRate;
+
+int fakeResponseCode;
+char fakeResponse[FAKE_RESPONSE_SIZE];
+int fakeResponseCount;
+
+FlashConfig flashConfig;
+void (*programmingCB)(char *buffer, short length);
+
+static ETSTimer *timers[FAKE_TIMER_MAX];
+static int timerCount;
+static uint32_t now;    // milliseconds
+
+static HttpdPostData post;
+static esp_tcp tcp;
+static struct espconn conn;
+
+void fakeReset(void)
+{
+    memset(fakeFlash, 0xff, sizeof(fakeFlash));
+    fakeUartTxCount = 0;
+    fakeBaudRate = 0;
+    fakeResponseCode = 0;
+    fakeResponseCount = 0;
+    memset(&flashConfig, 0, sizeof(flashConfig));
+    flashConfig.baud_rate = 115200;
+    programmingCB = NULL;
+    timerCount = 0;
+}
+
+// advance the clock a millisecond at a time running the timers that come due
+void fakeRunTimers(int ms)
+{
+    int i;
+    while (--ms >= 0) {
+        ++now;
+        for (i = 0; i < timerCount; ++i) {
+            ETSTimer *t = timers[i];
+            if ((int32_t)(now - t->timer_expire) >= 0) {
+                if (t->timer_period)
+                    t->timer_expire += t->timer_period;
+                else {
+                    memmove(&timers[i], &timers[i + 1], (--timerCount - i) * sizeof(ETSTimer *));
+                    --i;
+                }
+                t->timer_func(t->timer_arg);
+            }
+        }
+    }
+}
+
+void fakeRequest(HttpdConnData *connData, char *args, char *body, int len)
+{
+    memset(connData, 0, sizeof(HttpdConnData));
+    memset(&post, 0, sizeof(post));
+    post.len = post.buffLen = post.received = post.buffSize = len;
+    post.buff = body;
+    conn.proto.tcp = &tcp;
+    connData->conn = &conn;
+    connData->getArgs = args;
+    connData->post = &post;
+    fakeResponseCode = 0;
+    fakeResponseCount = 0;
+}
+
+void fakeReceive(const uint8_t *data, int len)
+{
+    if (programmingCB)
+        programmingCB((char *)data, len);
+}
+
+SpiFlashOpResult spi_flash_read(uint32 addr, uint32 *des, uint32 size)
+{
+    memcpy(des, &fakeFlash[addr], size);
+    return SPI_FLASH_RESULT_OK;
+}
+
+SpiFlashOpResult spi_flash_write(uint32 addr, uint32 *src, uint32 size)
+{
+    uint8_t *p = (uint8_t *)src;
+    uint32 i;
+    if ((addr & 3) || (size & 3))
+        return SPI_FLASH_RESULT_ERR;
+    for (i = 0; i < size; ++i)
+        fakeFlash[addr + i] &= p[i];
+    return SPI_FLASH_RESULT_OK;
+}
+
+SpiFlashOpResult spi_flash_erase_sector(uint16 sec)
+{
+    memset(&fakeFlash[sec * SPI_FLASH_SEC_SIZE], 0xff, SPI_FLASH_SEC_SIZE);
+    return SPI_FLASH_RESULT_OK;
+}
+
+// manufacturer, memory type and a capacity of 2^22 bytes
+uint32 spi_flash_get_id(void)
+{
+    return 0x1640ef;
+}
+
+void uart0_tx_buffer(char *buf, uint16 len)
+{
+    while (len-- > 0)
+        uart_tx_one_char(UART0, *buf++);
+}
+
+STATUS uart_tx_one_char(uint8 uart, uint8 c)
+{
+    if (fakeUartTxCount < FAKE_UART_TX_SIZE)
+        fakeUartTx[fakeUartTxCount++] = c;
+    return OK;
+}
+
+// the transmit FIFO drains instantly
+uint16_t uart0_tx_fifo_count(void)
+{
+    return 0;
+}
+
+void uart0_baud(int rate)
+{
+    fakeBaudRate = rate;
+}
+
+void os_timer_setfn(os_timer_t *t, os_timer_func_t *fn, void *arg)
+{
+    os_timer_disarm(t);
+    t->timer_func = fn;
+    t->timer_arg = arg;
+}
+
+void os_timer_arm(os_timer_t *t, uint32 ms, bool repeat)
+{
+    os_timer_disarm(t);
+    t->timer_expire = now + ms;
+    t->timer_period = repeat ? ms : 0;
+    timers[timerCount++] = t;
+}
+
+void os_timer_disarm(os_timer_t *t)
+{
+    int i;
+    for (i = 0; i < timerCount; ++i) {
+        if (timers[i] == t) {
+            memmove(&timers[i], &timers[i + 1], (--timerCount - i) * sizeof(ETSTimer *));
+            break;
+        }
+    }
+}
+
+uint32 system_get_time(void)
+{
+    return now * 1000;
+}
+
+void system_set_os_print(uint8 on)
+{
+}
+
+int os_printf_plus(const char *format, ...)
+{
+    va_list ap;
+    if (getenv("FAKE_DEBUG")) {
+        va_start(ap, format);
+        vprintf(format, ap);
+        va_end(ap);
+    }
+    return 0;
+}
+
+void gpio_output_set(uint32 set_mask, uint32 clear_mask, uint32 enable_mask, uint32 disable_mask)
+{
+}
+
+// the reset button is not pressed
+uint32 gpio_input_get(void)
+{
+    return ~0;
+}
+
+bool wifi_set_opmode(uint8 mode)
+{
+    return true;
+}
+
+bool configSave(void)
+{
+    return true;
+}
+
+sint8 espconn_disconnect(struct espconn *c)
+{
+    return 0;
+}
+
+sint8 espconn_recv_hold(struct espconn *c)
+{
+    return 0;
+}
+
+sint8 espconn_recv_unhold(struct espconn *c)
+{
+    return 0;
+}
+
+int httpdFindArg(char *line, char *arg, char *buff, int buffLen)
+{
+    int len = strlen(arg);
+    char *p = line, *e;
+    while (p && *p) {
+        if (strncmp(p, arg, len) == 0 && p[len] == '=') {
+            p += len + 1;
+            if (!(e = strchr(p, '&')))
+                e = p + strlen(p);
+            if (e - p >= buffLen)
+                return -1;
+            memcpy(buff, p, e - p);
+            buff[e - p] = '\0';
+            return e - p;
+        }
+        if ((p = strchr(p, '&')) != NULL)
+            ++p;
+    }
+    return -1;
+}
+
+int8_t getStringArg(HttpdConnData *connData, char *name, char *config, int max_len)
+{
+    return httpdFindArg(connData->getArgs, name, config, max_len) < 0 ? 0 : 1;
+}
+
+void httpdSetOutputBuffer(HttpdConnData *c, char *buff, short max)
+{
+}
+
+void httpdStartResponse(HttpdConnData *c, int code)
+{
+    fakeResponseCode = code;
+}
+
+void httpdHeader(HttpdConnData *c, const char *field, const char *val)
+{
+}
+
+void httpdEndHeaders(HttpdConnData *c)
+{
+}
+
+int httpdSend(HttpdConnData *c, const char *data, int len)
+{
+    if (len < 0)
+        len = strlen(data);
+    if (fakeResponseCount + len < FAKE_RESPONSE_SIZE) {
+        memcpy(&fakeResponse[fakeResponseCount], data, len);
+        fakeResponseCount += len;
+        fakeResponse[fakeResponseCount] = '\0';
+    }
+    return 1;
+}
+
+void httpdFlush(HttpdConnData *c)
+{
+}
+
+void noCacheHeaders(HttpdConnData *c, int code)
+{
+    httpdStartResponse(c, code);
+}
+
+void jsonHeader(HttpdConnData *c, int code)
+{
+    httpdStartResponse(c, code);
+}
+
+void errorResponse(HttpdConnData *c, int code, char *message)
+{
+    httpdStartResponse(c, code);
+    httpdSend(c, message, -1);
+}
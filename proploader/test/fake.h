@@ -0,0 +1,26 @@
+#ifndef FAKE_H
+#define FAKE_H
+
+#include <esp8266.h>
+#include "httpd.h"
+
+// host stand-ins for the SDK, UART, timers and httpd used by the Propeller loader tests
+
+#define FAKE_FLASH_SIZE     0x400000
+
+extern uint8_t fakeFlash[FAKE_FLASH_SIZE];
+
+extern uint8_t fakeUartTx[];
+extern int fakeUartTxCount;
+extern int fakeBaudRate;
+
+extern int fakeResponseCode;
+extern char fakeResponse[];
+extern int fakeResponseCount;
+
+void fakeReset(void);
+void fakeRunTimers(int ms);
+void fakeRequest(HttpdConnData *connData, char *args, char *body, int len);
+void fakeReceive(const uint8_t *data, int len);
+
+#endif
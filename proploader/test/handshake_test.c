@@ -0,0 +1,103 @@
+#include <esp8266.h>
+#include "cgiprop.h"
+#include "proploader.h"
+#include "fake.h"
+
+// Loads a small image through /propeller/load and answers as the Propeller ROM would, delivering
+// the handshake response in chunks that don't line up with it to check that it is always found.
+
+#define IMAGE_SIZE  32
+
+static uint8_t rxHandshake[125 + 4];
+
+// the ROM sends two bits of the LFSR sequence that follows the 250 bits of the host handshake
+// in each byte followed by the hardware version two bits at a time
+static void makeHandshakeResponse(void)
+{
+    int lfsr = 'P', bits[2], i, j;
+
+    for (i = 0; i < 250 + 125 * 2; ++i) {
+        if (i >= 250) {
+            bits[i & 1] = lfsr & 1;
+            if (i & 1)
+                rxHandshake[(i - 250) / 2] = 0xCE | bits[0] | (bits[1] << 5);
+        }
+        lfsr = ((lfsr << 1) & 0xFE) | (((lfsr >> 7) ^ (lfsr >> 5) ^ (lfsr >> 4) ^ (lfsr >> 1)) & 1);
+    }
+    for (j = 0; j < 4; ++j)
+        rxHandshake[125 + j] = 0xCE | (j == 0);
+}
+
+// load an image and send the handshake response as junk followed by the response in pieces
+static int load(const char *what, int junkSize, int pieceSize)
+{
+    static uint8_t image[IMAGE_SIZE];
+    static uint8_t response[64 + sizeof(rxHandshake)];
+    HttpdConnData connData;
+    int size, sent, polls, i;
+
+    // a Spin header whose program ends at the end of the image
+    memset(image, 0, sizeof(image));
+    image[8] = 0x10;            // pbase
+    image[10] = IMAGE_SIZE;     // vbase
+    image[12] = IMAGE_SIZE + 8; // dbase
+
+    fakeRequest(&connData, "", (char *)image, sizeof(image));
+    if (cgiPropLoad(&connData) != HTTPD_CGI_MORE) {
+        printf("%s: load not started (%d) %s", what, fakeResponseCode, fakeResponse);
+        return -1;
+    }
+
+    // wait for the host handshake
+    for (i = 0; i < 1000 && fakeUartTxCount == 0; ++i)
+        fakeRunTimers(1);
+    if (fakeUartTxCount == 0) {
+        printf("%s: no handshake sent\n", what);
+        return -1;
+    }
+
+    for (size = 0; size < junkSize; ++size)
+        response[size] = size & 1 ? 0xF0 : 0x00;
+    memcpy(&response[size], rxHandshake, sizeof(rxHandshake));
+    size += sizeof(rxHandshake);
+    for (sent = 0; sent < size; sent += pieceSize)
+        fakeReceive(&response[sent], sent + pieceSize < size ? pieceSize : size - sent);
+
+    // answer the checksum polls
+    for (i = polls = 0; i < 5000 && fakeResponseCode == 0; ++i) {
+        fakeRunTimers(1);
+        if (fakeUartTxCount > 0 && fakeUartTx[fakeUartTxCount - 1] == 0xF9 && polls++ == 0) {
+            static const uint8_t ok = 0xFE;
+            fakeReceive(&ok, 1);
+        }
+    }
+
+    if (fakeResponseCode != 200) {
+        printf("%s: response %d %s", what, fakeResponseCode, fakeResponse);
+        return -1;
+    }
+
+    fakeUartTxCount = 0;
+    return 0;
+}
+
+int main(void)
+{
+    int failures = 0;
+
+    fakeReset();
+    cgiPropInit();
+    makeHandshakeResponse();
+
+    if (load("one chunk", 0, 1000) != 0)
+        ++failures;
+    if (load("one chunk after junk", 7, 1000) != 0)
+        ++failures;
+    if (load("byte at a time after junk", 3, 1) != 0)
+        ++failures;
+    if (load("odd pieces after junk", 5, 13) != 0)
+        ++failures;
+
+    printf("handshake_test: %s\n", failures ? "FAILED" : "passed");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,202 @@
+#include <esp8266.h>
+#include "proploader.h"
+#include "fake.h"
+
+// Encodes images for the ROM loader and decodes the bytes sent to the UART the way the ROM reads them
+// to check that every bit of the load command, image size and image comes back out.
+
+#define MAX_BITS    (64 * 1024 * 8)
+
+static uint8_t decoded[MAX_BITS];
+static int decodedCount;
+static int covered[6][32];  // tail and full group values seen, indexed by group size and value
+
+// a one bit period low pulse is a 1 and a two bit period low pulse is a 0
+// each serial byte is a start bit (low), eight data bits lsb first and a stop bit (high)
+static int decodeByte(uint8_t byte)
+{
+    int line = (byte << 1) | 0x200;
+    int i = 0, width;
+
+    while (i < 10) {
+        if (line & (1 << i)) {
+            ++i;
+            continue;
+        }
+        for (width = 0; i < 10 && !(line & (1 << i)); ++i)
+            ++width;
+        if (width == 1)
+            decoded[decodedCount++] = 1;
+        else if (width == 2)
+            decoded[decodedCount++] = 0;
+        else
+            return -1;
+    }
+
+    return 0;
+}
+
+static uint32_t decodedLong(int bit)
+{
+    uint32_t value = 0;
+    int i;
+    for (i = 0; i < 32; ++i)
+        value |= (uint32_t)decoded[bit + i] << i;
+    return value;
+}
+
+static int imageBit(const uint8_t *image, int bit)
+{
+    return (image[bit / 8] >> (bit % 8)) & 1;
+}
+
+// decode the UART output and compare it with the load command, image size and image
+// the group of image bits encoded by each byte is recorded to check coverage of the translation table
+static int checkStream(const uint8_t *image, int imageSize, const char *what)
+{
+    int imageBits = imageSize * 8;
+    int i, start, bits, cnt, value;
+
+    decodedCount = 0;
+    for (i = 0; i < fakeUartTxCount; ++i) {
+        start = decodedCount;
+        if (decodeByte(fakeUartTx[i]) != 0) {
+            printf("%s: size %d: byte %d (%02x) is not a valid encoding\n", what, imageSize, i, fakeUartTx[i]);
+            return -1;
+        }
+
+        // record the image bits that were available to this byte
+        if (start >= 64 && decodedCount > start) {
+            bits = imageBits - (start - 64);
+            if (bits > 5)
+                bits = 5;
+            for (value = 0, cnt = 0; cnt < bits; ++cnt)
+                value |= imageBit(image, start - 64 + cnt) << cnt;
+            covered[bits][value] = 1;
+        }
+    }
+
+    if (decodedCount != 64 + imageBits) {
+        printf("%s: size %d: decoded %d bits, expected %d\n", what, imageSize, decodedCount, 64 + imageBits);
+        return -1;
+    }
+    if (decodedLong(0) != ltDownloadAndRun || decodedLong(32) != imageSize / 4) {
+        printf("%s: size %d: bad command %lu or size %lu\n", what, imageSize, (unsigned long)decodedLong(0), (unsigned long)decodedLong(32));
+        return -1;
+    }
+    for (i = 0; i < imageBits; ++i) {
+        if (decoded[64 + i] != imageBit(image, i)) {
+            printf("%s: size %d: image bit %d differs\n", what, imageSize, i);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int loadImage(const uint8_t *image, int imageSize, int dense)
+{
+    PropellerConnection connection;
+    int finished;
+
+    memset(&connection, 0, sizeof(connection));
+    connection.baudRate = 115200;
+    connection.denseEncoding = dense;
+    connection.image = image;
+    connection.imageSize = imageSize;
+    fakeUartTxCount = 0;
+
+    if (ploadLoadImage(&connection, ltDownloadAndRun, &finished) != 0)
+        return -1;
+    while (!finished) {
+        if (ploadLoadImageContinue(&connection, ltDownloadAndRun, &finished) != 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+// stream the image in chunks of random size so that segments end on arbitrary bytes
+static int streamImage(const uint8_t *image, int imageSize)
+{
+    PropellerConnection connection;
+    int offset, finished, cnt;
+
+    memset(&connection, 0, sizeof(connection));
+    connection.baudRate = 115200;
+    connection.denseEncoding = 1;
+    connection.imageSize = imageSize;
+    fakeUartTxCount = 0;
+
+    if (ploadInitStream(&connection) != 0)
+        return -1;
+    cnt = rand() % 700 + 1;
+    if (cnt > imageSize)
+        cnt = imageSize;
+    ploadWriteStream(&connection, image, cnt);
+    offset = cnt;
+
+    if (ploadLoadImage(&connection, ltDownloadAndRun, &finished) != 0)
+        return -1;
+    while (!finished) {
+        if ((cnt = rand() % 700 + 1) > imageSize - offset)
+            cnt = imageSize - offset;
+        if (cnt > ploadStreamRoom(&connection))
+            cnt = ploadStreamRoom(&connection);
+        ploadWriteStream(&connection, &image[offset], cnt);
+        offset += cnt;
+        if (ploadLoadImageContinue(&connection, ltDownloadAndRun, &finished) != 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+int main(void)
+{
+    static uint8_t image[32768];
+    int failures = 0, size, i, bits, value;
+
+    fakeReset();
+
+    // every one and two byte image exercises every tail of 1 to 5 bits
+    for (i = 0; i < 256 + 65536; ++i) {
+        size = i < 256 ? 1 : 2;
+        image[0] = i;
+        image[1] = i >> 8;
+        if (loadImage(image, size, 1) != 0 || checkStream(image, size, "dense") != 0)
+            ++failures;
+    }
+
+    for (bits = 1; bits <= 5; ++bits) {
+        for (value = 0; value < (1 << bits); ++value) {
+            if (!covered[bits][value]) {
+                printf("no %d-bit group with value %x was encoded\n", bits, value);
+                ++failures;
+            }
+        }
+    }
+
+    // random images of every size up to a few hundred bytes
+    srand(1);
+    for (size = 3; size < 300; ++size) {
+        for (i = 0; i < size; ++i)
+            image[i] = rand();
+        if (loadImage(image, size, 1) != 0 || checkStream(image, size, "dense") != 0)
+            ++failures;
+        if ((size & 3) == 0 && (loadImage(image, size, 0) != 0 || checkStream(image, size, "long") != 0))
+            ++failures;
+    }
+
+    // full size images streamed in odd sized pieces
+    for (i = 0; i < 20; ++i) {
+        size = (rand() % (sizeof(image) / 4) + 1) * 4;
+        for (bits = 0; bits < size; ++bits)
+            image[bits] = i & 1 ? 0 : rand();
+        if (streamImage(image, size) != 0 || checkStream(image, size, "stream") != 0)
+            ++failures;
+    }
+
+    printf("pdstx_test: %s\n", failures ? "FAILED" : "passed");
+    return failures ? 1 : 0;
+}
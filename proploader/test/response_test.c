@@ -0,0 +1,109 @@
+#include <esp8266.h>
+#include "cgiprop.h"
+#include "proploader.h"
+#include "fake.h"
+
+// Loads a small image with response capture and has the program send more output than the
+// response buffer holds while the client is slow to accept it to check that none of it is lost
+// or, when there is too much to buffer, that the client is told.
+
+#define IMAGE_SIZE  32
+
+static uint8_t rxHandshake[125 + 4];
+static uint8_t output[20000];
+
+// the ROM sends two bits of the LFSR sequence that follows the 250 bits of the host handshake
+// in each byte followed by the hardware version two bits at a time
+static void makeHandshakeResponse(void)
+{
+    int lfsr = 'P', bits[2], i, j;
+
+    for (i = 0; i < 250 + 125 * 2; ++i) {
+        if (i >= 250) {
+            bits[i & 1] = lfsr & 1;
+            if (i & 1)
+                rxHandshake[(i - 250) / 2] = 0xCE | bits[0] | (bits[1] << 5);
+        }
+        lfsr = ((lfsr << 1) & 0xFE) | (((lfsr >> 7) ^ (lfsr >> 5) ^ (lfsr >> 4) ^ (lfsr >> 1)) & 1);
+    }
+    for (j = 0; j < 4; ++j)
+        rxHandshake[125 + j] = 0xCE | (j == 0);
+}
+
+// load an image, send outputSize bytes of program output in pieces with sentEvery pieces between
+// sent callbacks and return the number of response bytes the client got
+static int load(const char *what, int outputSize, int sentEvery)
+{
+    static uint8_t image[IMAGE_SIZE];
+    static HttpdConnData connData;
+    static const uint8_t ok = 0xFE;
+    int sent, pieces, i;
+
+    memset(image, 0, sizeof(image));
+    image[8] = 0x10;            // pbase
+    image[10] = IMAGE_SIZE;     // vbase
+    image[12] = IMAGE_SIZE + 8; // dbase
+
+    fakeRequest(&connData, "response-size=-1&response-timeout=50", (char *)image, sizeof(image));
+    connData.cgi = cgiPropLoad;
+    if (cgiPropLoad(&connData) != HTTPD_CGI_MORE) {
+        printf("%s: load not started (%d) %s", what, fakeResponseCode, fakeResponse);
+        return -1;
+    }
+
+    for (i = 0; i < 1000 && fakeUartTxCount == 0; ++i)
+        fakeRunTimers(1);
+    fakeReceive(rxHandshake, sizeof(rxHandshake));
+    for (i = 0; i < 5000 && fakeUartTx[fakeUartTxCount - 1] != 0xF9; ++i)
+        fakeRunTimers(1);
+    fakeReceive(&ok, 1);
+
+    // the program output arrives faster than the client takes it
+    for (sent = pieces = 0; sent < outputSize; sent += 100) {
+        fakeReceive(&output[sent], sent + 100 < outputSize ? 100 : outputSize - sent);
+        if (++pieces % sentEvery == 0 && connData.cgi)
+            connData.cgi(&connData);
+    }
+
+    // the client catches up and the output goes idle
+    for (i = 0; i < 1000 && connData.cgi; ++i) {
+        fakeRunTimers(1);
+        if (connData.cgi && connData.cgi(&connData) == HTTPD_CGI_DONE)
+            connData.cgi = NULL;
+    }
+
+    fakeUartTxCount = 0;
+    if (fakeResponseCode != 200) {
+        printf("%s: response %d\n", what, fakeResponseCode);
+        return -1;
+    }
+    return fakeResponseCount;
+}
+
+int main(void)
+{
+    int failures = 0, count, i;
+
+    fakeReset();
+    cgiPropInit();
+    makeHandshakeResponse();
+    for (i = 0; i < sizeof(output); ++i)
+        output[i] = 'a' + i % 26;
+
+    // more than the initial buffer arrives while each send is in progress
+    count = load("slow client", 6000, 30);
+    if (count != 6000 || memcmp(fakeResponse, output, 6000) != 0) {
+        printf("slow client: got %d of 6000 bytes\n", count);
+        ++failures;
+    }
+
+    // more than the buffer can grow to is reported at the end of the response
+    count = load("stalled client", sizeof(output), 1000);
+    if (count < 0 || strstr(fakeResponse, "response bytes lost]") == NULL) {
+        printf("stalled client: no lost bytes reported\n");
+        ++failures;
+    }
+
+    printf("response_test: %s\n", failures ? "FAILED" : "passed");
+    return failures ? 1 : 0;
+}
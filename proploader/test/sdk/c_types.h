@@ -0,0 +1,18 @@
+#ifndef C_TYPES_H
+#define C_TYPES_H
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+typedef uint8_t uint8; typedef int8_t sint8; typedef int8_t int8;
+typedef uint16_t uint16; typedef int16_t sint16; typedef int16_t int16;
+typedef uint32_t uint32; typedef int32_t sint32; typedef int32_t int32;
+typedef unsigned char u8; typedef unsigned short u16; typedef unsigned int u32;
+typedef enum { OK = 0, FAIL, PENDING, BUSY, CANCEL } STATUS;
+#define ICACHE_FLASH_ATTR
+#define ICACHE_RODATA_ATTR
+#define LOCAL static
+#define BIT(n) (1UL << (n))
+#define TRUE 1
+#define FALSE 0
+#define SPI_FLASH_SEC_SIZE 4096
+#endif
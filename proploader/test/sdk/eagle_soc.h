@@ -0,0 +1,19 @@
+#ifndef EAGLE_SOC_H
+#define EAGLE_SOC_H
+#include "bits.h"
+#define READ_PERI_REG(addr) fake_read_reg(addr)
+#define WRITE_PERI_REG(addr, val) fake_write_reg(addr, val)
+#define SET_PERI_REG_MASK(reg, mask) WRITE_PERI_REG((reg), (READ_PERI_REG(reg)|(mask)))
+#define CLEAR_PERI_REG_MASK(reg, mask) WRITE_PERI_REG((reg), (READ_PERI_REG(reg)&(~(mask))))
+#define ETS_UNCACHED_ADDR(addr) (addr)
+uint32 fake_read_reg(uint32 addr);
+void fake_write_reg(uint32 addr, uint32 val);
+#define PIN_FUNC_SELECT(a,b)
+#define PIN_PULLUP_DIS(a)
+#define PIN_PULLUP_EN(a)
+#define PERIPHS_IO_MUX_GPIO2_U 0
+#define PERIPHS_IO_MUX_U0TXD_U 0
+#define PERIPHS_IO_MUX_U0RXD_U 0
+#define FUNC_U1TXD_BK 0
+#define FUNC_U0TXD 0
+#endif
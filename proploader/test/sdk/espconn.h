@@ -0,0 +1,28 @@
+#ifndef ESPCONN_H
+#define ESPCONN_H
+typedef struct _esp_tcp { int remote_port; int local_port; uint8 local_ip[4]; uint8 remote_ip[4]; } esp_tcp;
+typedef struct _esp_udp { int remote_port; int local_port; uint8 local_ip[4]; uint8 remote_ip[4]; } esp_udp;
+enum espconn_type { ESPCONN_INVALID = 0, ESPCONN_TCP = 0x10, ESPCONN_UDP = 0x20 };
+enum espconn_state { ESPCONN_NONE, ESPCONN_WAIT, ESPCONN_LISTEN, ESPCONN_CONNECT, ESPCONN_WRITE, ESPCONN_READ, ESPCONN_CLOSE };
+typedef void (*espconn_sent_callback)(void *arg);
+typedef void (*espconn_recv_callback)(void *arg, char *pdata, unsigned short len);
+typedef void (*espconn_reconnect_callback)(void *arg, sint8 err);
+typedef void (*espconn_connect_callback)(void *arg);
+struct espconn { enum espconn_type type; enum espconn_state state; union { esp_tcp *tcp; esp_udp *udp; } proto; void *reverse; };
+typedef struct _remot_info { enum espconn_state state; int remote_port; uint8 remote_ip[4]; } remot_info;
+sint8 espconn_sent(struct espconn *, uint8 *, uint16);
+sint8 espconn_send(struct espconn *, uint8 *, uint16);
+sint8 espconn_create(struct espconn *);
+sint8 espconn_delete(struct espconn *);
+sint8 espconn_disconnect(struct espconn *);
+sint8 espconn_regist_sentcb(struct espconn *, espconn_sent_callback);
+sint8 espconn_regist_recvcb(struct espconn *, espconn_recv_callback);
+sint8 espconn_regist_reconcb(struct espconn *, espconn_reconnect_callback);
+sint8 espconn_regist_disconcb(struct espconn *, espconn_connect_callback);
+sint8 espconn_get_connection_info(struct espconn *, remot_info **, uint8);
+sint8 espconn_recv_hold(struct espconn *);
+sint8 espconn_recv_unhold(struct espconn *);
+sint8 espconn_set_opt(struct espconn *, uint8);
+#define ESPCONN_REUSEADDR 1
+#define ESPCONN_NODELAY 2
+#endif
@@ -0,0 +1,10 @@
+#ifndef ETS_SYS_H
+#define ETS_SYS_H
+#include "c_types.h"
+typedef void ETSTimerFunc(void *);
+typedef struct _ETSTIMER_ { struct _ETSTIMER_ *timer_next; uint32 timer_expire; uint32 timer_period; ETSTimerFunc *timer_func; void *timer_arg; } ETSTimer;
+typedef struct { uint32 sig; uint32 par; } os_event_t;
+#define ETS_UART_INTR_ENABLE()
+#define ETS_UART_INTR_DISABLE()
+#define ETS_UART_INTR_ATTACH(a,b)
+#endif
@@ -0,0 +1,8 @@
+#ifndef GPIO_H
+#define GPIO_H
+#define GPIO_OUTPUT_SET(gpio_no, bit_value) gpio_output_set((bit_value)<<(gpio_no), ((~(bit_value))&0x01)<<(gpio_no), 1<<(gpio_no), 0)
+#define GPIO_INPUT_GET(gpio_no) ((gpio_input_get()>>(gpio_no))&1)
+void gpio_output_set(uint32 set_mask, uint32 clear_mask, uint32 enable_mask, uint32 disable_mask);
+uint32 gpio_input_get(void);
+void gpio_init(void);
+#endif
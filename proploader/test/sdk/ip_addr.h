@@ -0,0 +1,6 @@
+#ifndef IP_ADDR_H
+#define IP_ADDR_H
+struct ip_addr { uint32 addr; };
+typedef struct ip_addr ip_addr_t;
+struct ip_info { struct ip_addr ip, netmask, gw; };
+#endif
@@ -0,0 +1,7 @@
+#ifndef MEM_H
+#define MEM_H
+#define os_malloc malloc
+#define os_zalloc(s) calloc(1, s)
+#define os_free free
+#define os_realloc realloc
+#endif
@@ -0,0 +1,6 @@
+#ifndef OS_TYPE_H
+#define OS_TYPE_H
+#include "ets_sys.h"
+typedef ETSTimer os_timer_t;
+typedef ETSTimerFunc os_timer_func_t;
+#endif
@@ -0,0 +1,25 @@
+#ifndef OSAPI_H
+#define OSAPI_H
+#include <string.h>
+#include "os_type.h"
+#define os_memcmp memcmp
+#define os_memcpy memcpy
+#define os_memmove memmove
+#define os_memset memset
+#define os_strcat strcat
+#define os_strchr strchr
+#define os_strcmp strcmp
+#define os_strcpy strcpy
+#define os_strlen strlen
+#define os_strncmp strncmp
+#define os_strncpy strncpy
+#define os_strstr strstr
+#define os_sprintf sprintf
+#define os_printf printf
+#define os_delay_us(x) ((void)(x))
+#define os_random() ((unsigned)rand())
+void os_timer_arm(os_timer_t *, uint32, bool);
+void os_timer_disarm(os_timer_t *);
+void os_timer_setfn(os_timer_t *, os_timer_func_t *, void *);
+void os_install_putc1(void *);
+#endif
@@ -0,0 +1,3 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H
+#endif
@@ -0,0 +1,25 @@
+#ifndef USER_INTERFACE_H
+#define USER_INTERFACE_H
+#include "ip_addr.h"
+#define STATION_IF 0
+#define SOFTAP_IF 1
+#define STATIONAP_MODE 3
+#define SPI_FLASH_RESULT_OK 0
+#define SPI_FLASH_RESULT_ERR 1
+typedef int SpiFlashOpResult;
+SpiFlashOpResult spi_flash_read(uint32 addr, uint32 *des, uint32 size);
+SpiFlashOpResult spi_flash_write(uint32 addr, uint32 *src, uint32 size);
+SpiFlashOpResult spi_flash_erase_sector(uint16 sec);
+uint32 spi_flash_get_id(void);
+bool wifi_get_ip_info(uint8, struct ip_info *);
+bool wifi_get_macaddr(uint8, uint8 *);
+bool wifi_set_opmode(uint8);
+uint32 system_get_free_heap_size(void);
+void system_set_os_print(uint8);
+typedef void (*os_task_t)(os_event_t *e);
+bool system_os_task(os_task_t task, uint8 prio, os_event_t *queue, uint8 qlen);
+bool system_os_post(uint8 prio, uint32 sig, uint32 par);
+#define USER_TASK_PRIO_0 0
+#define USER_TASK_PRIO_1 1
+#define USER_TASK_PRIO_2 2
+#endif
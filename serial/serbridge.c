@@ -12,6 +12,9 @@
 #include "cmd.h"
 #include "syslog.h"
 #include "sscp.h"
+#ifdef PROPLOADER
+#include "imagehash.h"
+#endif
 
 #define SKIP_AT_RESET
 
@@ -96,6 +99,9 @@ telnetUnwrap(uint8_t *inBuf, int len, uint8_t state)
         if (mcu_reset_pin >= 0) {
 #ifdef SERBR_DBG
           os_printf("MCU reset gpio%d\n", mcu_reset_pin);
+#endif
+#ifdef PROPLOADER
+          ploadForgetLoadedImage(mcu_reset_pin);
 #endif
           GPIO_OUTPUT_SET(mcu_reset_pin, 0);
           os_delay_us(100L);
@@ -145,6 +151,9 @@ serbridgeReset()
   if (mcu_reset_pin >= 0) {
 #ifdef SERBR_DBG
     os_printf("MCU reset gpio%d\n", mcu_reset_pin);
+#endif
+#ifdef PROPLOADER
+    ploadForgetLoadedImage(mcu_reset_pin);
 #endif
     GPIO_OUTPUT_SET(mcu_reset_pin, 0);
     os_delay_us(2000L); // esp8266 needs at least 1ms reset pulse, it seems...
@@ -210,6 +219,9 @@ serbridgeRecvCb(void *arg, char *data, unsigned short len)
     os_delay_us(2*1000L); // time for os_printf to happen
 #endif
     // send reset to arduino/ARM, send "ISP" signal for the duration of the programming
+#ifdef PROPLOADER
+    ploadForgetLoadedImage(mcu_reset_pin);
+#endif
     if (mcu_reset_pin >= 0) GPIO_OUTPUT_SET(mcu_reset_pin, 0);
     os_delay_us(100L);
     if (mcu_isp_pin >= 0) GPIO_OUTPUT_SET(mcu_isp_pin, 0);
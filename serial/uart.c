@@ -108,7 +108,7 @@ STATUS
 uart_tx_one_char(uint8 uart, uint8 c)
 {
   //Wait until there is room in the FIFO
-  while (((READ_PERI_REG(UART_STATUS(uart))>>UART_TXFIFO_CNT_S)&UART_TXFIFO_CNT)>=100) ;
+  while (((READ_PERI_REG(UART_STATUS(uart))>>UART_TXFIFO_CNT_S)&UART_TXFIFO_CNT)>=UART_TX_FIFO_LIMIT) ;
   //Send the character
   WRITE_PERI_REG(UART_FIFO(uart), c);
   return OK;
@@ -125,13 +125,25 @@ STATUS
 uart_try_tx_one_char(uint8 uart, uint8 c)
 {
   //Check for room in the FIFO
-  if (((READ_PERI_REG(UART_STATUS(uart))>>UART_TXFIFO_CNT_S)&UART_TXFIFO_CNT)>=100)
+  if (((READ_PERI_REG(UART_STATUS(uart))>>UART_TXFIFO_CNT_S)&UART_TXFIFO_CNT)>=UART_TX_FIFO_LIMIT)
     return FAIL;
   //Send the character
   WRITE_PERI_REG(UART_FIFO(uart), c);
   return OK;
 }
 
+/******************************************************************************
+ * FunctionName : uart0_tx_fifo_count
+ * Description  : Return the number of characters waiting in the UART0 TX FIFO
+ * Parameters   : NONE
+ * Returns      : number of characters
+*******************************************************************************/
+uint16_t ICACHE_FLASH_ATTR
+uart0_tx_fifo_count(void)
+{
+  return (READ_PERI_REG(UART_STATUS(UART0))>>UART_TXFIFO_CNT_S)&UART_TXFIFO_CNT;
+}
+
 /******************************************************************************
  * FunctionName : uart1_write_char
  * Description  : Internal used function
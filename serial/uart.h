@@ -13,6 +13,12 @@ void uart_init(UartBautRate uart0_br, UartBautRate uart1_br);
 // Transmit a buffer of characters on UART0
 void uart0_tx_buffer(char *buf, uint16 len);
 
+// uart_tx_one_char waits while the TX FIFO holds at least this many characters
+#define UART_TX_FIFO_LIMIT 100
+
+// Number of characters waiting in the UART0 TX FIFO
+uint16_t uart0_tx_fifo_count(void);
+
 void uart0_write_char(char c);
 STATUS uart_tx_one_char(uint8 uart, uint8 c);
 STATUS uart_try_tx_one_char(uint8 uart, uint8 c);